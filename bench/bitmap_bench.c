@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../bitmap.h"
+
+/* Time of the bitmap primitives used on the write path, for bitmaps of 1K to
+ * 100M bits. Range operations are done at random positions, for range lengths
+ * from a single bit to 64K bits; whole bitmap operations (count, copy) are
+ * repeated on the full bitmap.
+ *
+ * usage: bitmap_bench [maxbits]
+ **/
+
+/* bits touched by each measurement, so that all of them take about as long */
+#define WORK_BITS (1UL << 28)
+#define MAX_OPS (1UL << 20)
+#define MIN_OPS 16
+
+static const size_t _sizes[] = { 1000, 64000, 1000000, 16000000, 100000000 };
+static const int _lengths[] = { 1, 7, 64, 100, 1024, 65536 };
+
+static volatile size_t _sink;
+
+static double _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void _report(size_t nbits, const char *op, int len, size_t nops, double elapsed_ns)
+{
+	printf("%10zu bits %-14s %6d %12.1f ns/op\n", nbits, op, len, elapsed_ns / nops);
+}
+
+static size_t _nops(size_t bits_per_op)
+{
+	size_t n = WORK_BITS / bits_per_op;
+	if (n > MAX_OPS)
+		n = MAX_OPS;
+	return n < MIN_OPS ? MIN_OPS : n;
+}
+
+static void _bench_ranges(bitmap_hdl bm, size_t nbits, int len, size_t *pos)
+{
+	const size_t n = _nops(len);
+	double start;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		pos[i] = ((size_t) rand() * RAND_MAX + rand()) % (nbits - len + 1);
+
+	bitmap_zero(bm);
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		bitmap_set_range(bm, pos[i], len);
+	_report(nbits, "set_range", len, n, _now_ns() - start);
+
+	/* all bits are checked when the range is set */
+	bitmap_fill(bm);
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += bitmap_get_range(bm, pos[i], len);
+	_report(nbits, "get_range", len, n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		bitmap_reset_range(bm, pos[i], len);
+	_report(nbits, "reset_range", len, n, _now_ns() - start);
+}
+
+static void _bench_whole(bitmap_hdl bm, bitmap_hdl copy, size_t nbits)
+{
+	const size_t n = _nops(nbits);
+	double start;
+	size_t i;
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += bitmap_count_setbits(bm);
+	_report(nbits, "count_setbits", 0, n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		bitmap_copy(copy, bm, nbits);
+	_report(nbits, "copy", 0, n, _now_ns() - start);
+}
+
+int main(int argc, char **argv)
+{
+	size_t maxbits = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000000;
+	size_t *pos = malloc(MAX_OPS * sizeof(size_t));
+	size_t i, j;
+
+	if (!maxbits || !pos) {
+		fprintf(stderr, "usage: %s [maxbits]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	srand(time(NULL));
+
+	for (i = 0; i < sizeof(_sizes) / sizeof(_sizes[0]) && _sizes[i] <= maxbits; ++i) {
+		const size_t nbits = _sizes[i];
+		bitmap_hdl bm = bitmap_alloc(nbits);
+		bitmap_hdl copy = bitmap_alloc(nbits);
+
+		if (!bm || !copy) {
+			fprintf(stderr, "can't allocate a bitmap of %zu bits\n", nbits);
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < sizeof(_lengths) / sizeof(_lengths[0]); ++j) {
+			if ((size_t) _lengths[j] <= nbits)
+				_bench_ranges(bm, nbits, _lengths[j], pos);
+		}
+		/* half of the bits set, as after random writes */
+		bitmap_zero(bm);
+		for (j = 0; j < nbits; j += 2)
+			bitmap_set(bm, j);
+		_bench_whole(bm, copy, nbits);
+
+		bitmap_free(bm);
+		bitmap_free(copy);
+	}
+	free(pos);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <glib.h>
+#include "../cluster_map.h"
+
+/* Compare the cluster map with the GTree it replaced, on the operations done
+ * by fdc_write/fdc_read: insertion of new clusters, and lookups.
+ *
+ * usage: cluster_map_bench [nclusters]
+ **/
+
+#define CBUF(cidx) ((void *) (uintptr_t) ((cidx) + 1))
+
+static volatile uintptr_t _sink;
+
+static double _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static gint _key_cmp(gconstpointer a, gconstpointer b)
+{
+	if (a < b)
+		return -1;
+	else if (a > b)
+		return 1;
+	return 0;
+}
+
+static void _report(const char *workload, const char *map, const char *op,
+		    size_t nops, double elapsed_ns)
+{
+	printf("%-12s %-6s %-14s %10.1f ns/op\n", workload, map, op, elapsed_ns / nops);
+}
+
+/* shuffle indices, so that lookups don't follow insertion order */
+static void _shuffle(size_t *v, size_t n)
+{
+	size_t i;
+	for (i = n - 1; i > 0; --i) {
+		size_t j = ((size_t) rand() * RAND_MAX + rand()) % (i + 1);
+		size_t tmp = v[i];
+		v[i] = v[j];
+		v[j] = tmp;
+	}
+}
+
+static void _bench_gtree(const char *workload, const size_t *ins, const size_t *look, size_t n)
+{
+	GTree *tree = g_tree_new(_key_cmp);
+	double start;
+	size_t i;
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		g_tree_insert(tree, (gpointer) ins[i], CBUF(ins[i]));
+	_report(workload, "gtree", "insert", n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += (uintptr_t) g_tree_lookup(tree, (gpointer) ins[i]);
+	_report(workload, "gtree", "lookup-ordered", n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += (uintptr_t) g_tree_lookup(tree, (gpointer) look[i]);
+	_report(workload, "gtree", "lookup-random", n, _now_ns() - start);
+
+	g_tree_destroy(tree);
+}
+
+static void _bench_cmap(const char *workload, const size_t *ins, const size_t *look, size_t n)
+{
+	cluster_map_t map;
+	double start;
+	size_t i;
+
+	cmap_init(&map);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		cmap_set(&map, ins[i], CBUF(ins[i]));
+	_report(workload, "cmap", "insert", n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += (uintptr_t) cmap_lookup(&map, ins[i]);
+	_report(workload, "cmap", "lookup-ordered", n, _now_ns() - start);
+
+	start = _now_ns();
+	for (i = 0; i < n; ++i)
+		_sink += (uintptr_t) cmap_lookup(&map, look[i]);
+	_report(workload, "cmap", "lookup-random", n, _now_ns() - start);
+
+	printf("%-12s %-6s %-14s %10zu bytes\n", workload, "cmap", "overhead", cmap_overhead(&map));
+	cmap_destroy(&map, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+	size_t *ins = malloc(n * sizeof(size_t));
+	size_t *look = malloc(n * sizeof(size_t));
+	size_t i;
+
+	if (!n || !ins || !look) {
+		fprintf(stderr, "usage: %s [nclusters]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	srand(time(NULL));
+
+	/* append: clusters are created in order, as by sequential writes */
+	for (i = 0; i < n; ++i)
+		ins[i] = look[i] = i;
+	_shuffle(look, n);
+	_bench_gtree("append", ins, look, n);
+	_bench_cmap("append", ins, look, n);
+
+	/* sparse: one cluster out of 64 is written, in random order */
+	for (i = 0; i < n; ++i)
+		ins[i] = look[i] = i * 64;
+	_shuffle(ins, n);
+	_shuffle(look, n);
+	_bench_gtree("sparse", ins, look, n);
+	_bench_cmap("sparse", ins, look, n);
+
+	free(ins);
+	free(look);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "../fdcache.h"
+#include "../histogram.h"
+
+/* Throughput and latency of fdc_write/fdc_read under a few workloads, for
+ * several cluster geometries and thread counts. Each run prints one JSON
+ * object per line.
+ *
+ * usage: fdcache_bench [-w workload] [-t threads] [-g blocksizexblocks]
+ *                      [-s bytes] [-o io size] [-n inodes] [-l ram limit]
+ *
+ * -w, -t and -g may be given several times, by default every workload runs
+ * with 1 and 4 threads, for geometries 4096x1, 4096x16 and 65536x16.
+ **/
+
+typedef struct bench_params_ {
+	const char *workload;
+	unsigned int nthreads;
+	size_t block_size;
+	size_t blocks_per_cluster;
+	size_t bytes;		/* per thread */
+	size_t io_size;
+	size_t ninodes;		/* for fanout */
+} bench_params_t;
+
+typedef struct bench_thread_ {
+	pthread_t thread;
+	const bench_params_t *params;
+	unsigned int idx;
+	uint64_t state;		/* random generator */
+	char *buf;
+	size_t nops;
+	size_t nbytes;
+	int error;
+	uint64_t start;		/* once all threads are ready */
+	uint64_t end;
+	hist_t hist;
+} bench_thread_t;
+
+typedef void (*workload_fn)(bench_thread_t *t);
+
+static pthread_barrier_t _start;
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, each thread has its own sequence */
+static uint64_t _rand(bench_thread_t *t)
+{
+	t->state ^= t->state >> 12;
+	t->state ^= t->state << 25;
+	t->state ^= t->state >> 27;
+	return t->state * 2685821657736338717ULL;
+}
+
+/* wait for all the threads to be ready, and start the clock */
+static void _go(bench_thread_t *t)
+{
+	pthread_barrier_wait(&_start);
+	t->start = _now_ns();
+}
+
+static fd_cache_t _entry(bench_thread_t *t, cache_ino_t ino)
+{
+	fd_cache_t fd = NULL;
+	if (fdc_get_or_create(ino, t->params->block_size, t->params->blocks_per_cluster, &fd))
+		t->error = 1;
+	return fd;
+}
+
+static void _write(bench_thread_t *t, fd_cache_t fd, size_t count, off_t offset)
+{
+	const uint64_t start = _now_ns();
+	ssize_t rc = fdc_write(fd, t->buf, count, offset, NULL, NULL);
+
+	hist_record(&t->hist, _now_ns() - start);
+	if (rc != (ssize_t) count)
+		t->error = 1;
+	t->nops++;
+	t->nbytes += count;
+}
+
+static void _read(bench_thread_t *t, fd_cache_t fd, size_t count, off_t offset)
+{
+	const uint64_t start = _now_ns();
+	ssize_t rc = fdc_read(fd, t->buf, count, offset);
+
+	hist_record(&t->hist, _now_ns() - start);
+	if (rc != (ssize_t) count)
+		t->error = 1;
+	t->nops++;
+	t->nbytes += count;
+}
+
+/* inode of thread t, and of the entry shared by all threads */
+#define OWN_INO(t) ((cache_ino_t) (t)->idx + 1)
+#define SHARED_INO 0
+
+/* prefill of the entries written and read at random, before the clock starts */
+static void _prefill(bench_thread_t *t, cache_ino_t ino)
+{
+	fd_cache_t fd = _entry(t, ino);
+	size_t off;
+
+	for (off = 0; fd && off < t->params->bytes; off += t->params->io_size)
+		fdc_write(fd, t->buf, t->params->io_size, off, NULL, NULL);
+}
+
+/* each thread appends to its own entry */
+static void _seq_append(bench_thread_t *t)
+{
+	fd_cache_t fd = _entry(t, OWN_INO(t));
+	size_t off;
+
+	_go(t);
+	for (off = 0; fd && off < t->params->bytes; off += t->params->io_size)
+		_write(t, fd, t->params->io_size, off);
+}
+
+/* threads overwrite io size aligned ranges of a shared entry */
+static void _rand_overwrite(bench_thread_t *t)
+{
+	const size_t nslots = t->params->bytes / t->params->io_size;
+	fd_cache_t fd;
+	size_t i;
+
+	if (t->idx == 0)
+		_prefill(t, SHARED_INO);
+	_go(t);
+	fd = _entry(t, SHARED_INO);
+	for (i = 0; fd && i < nslots; ++i)
+		_write(t, fd, t->params->io_size, (_rand(t) % nslots) * t->params->io_size);
+}
+
+/* new small entries, between 1 byte and twice the io size, written then read
+ * back */
+static void _small_churn(bench_thread_t *t)
+{
+	cache_ino_t ino = ((cache_ino_t) t->idx + 1) << 40;
+	size_t done = 0;
+
+	_go(t);
+	while (done < t->params->bytes) {
+		const size_t count = 1 + _rand(t) % (2 * t->params->io_size);
+		fd_cache_t fd = _entry(t, ino++);
+		if (!fd)
+			return;
+		_write(t, fd, count, 0);
+		_read(t, fd, count, 0);
+		done += count;
+	}
+}
+
+/* io size writes and reads spread over many entries */
+static void _fanout(bench_thread_t *t)
+{
+	const size_t ninodes = t->params->ninodes;
+	const size_t nslots = t->params->bytes / t->params->io_size;
+	const size_t per_inode = nslots / ninodes ? nslots / ninodes : 1;
+	size_t i;
+
+	_go(t);
+	for (i = 0; i < nslots && !t->error; ++i) {
+		const uint64_t r = _rand(t);
+		const cache_ino_t ino = (r % ninodes) + 1;
+		const off_t off = ((r >> 32) % per_inode) * t->params->io_size;
+		fd_cache_t fd = _entry(t, ino);
+		size_t size;
+
+		if (!fd)
+			return;
+		/* entries are read once they've been written */
+		if (r & 1 && !fdc_entry_size(ino, &size) && size >= off + t->params->io_size)
+			_read(t, fd, t->params->io_size, off);
+		else
+			_write(t, fd, t->params->io_size, off);
+	}
+}
+
+/* 70% reads, 30% overwrites of a shared entry */
+static void _mixed(bench_thread_t *t)
+{
+	const size_t nslots = t->params->bytes / t->params->io_size;
+	fd_cache_t fd;
+	size_t i;
+
+	if (t->idx == 0)
+		_prefill(t, SHARED_INO);
+	_go(t);
+	fd = _entry(t, SHARED_INO);
+	for (i = 0; fd && i < nslots; ++i) {
+		const uint64_t r = _rand(t);
+		const off_t off = ((r >> 8) % nslots) * t->params->io_size;
+		if (r % 10 < 7)
+			_read(t, fd, t->params->io_size, off);
+		else
+			_write(t, fd, t->params->io_size, off);
+	}
+}
+
+static const struct {
+	const char *name;
+	workload_fn fn;
+} _workloads[] = {
+	{ "seq_append", _seq_append },
+	{ "rand_overwrite", _rand_overwrite },
+	{ "small_churn", _small_churn },
+	{ "fanout", _fanout },
+	{ "mixed", _mixed },
+};
+#define NWORKLOADS (sizeof(_workloads) / sizeof(_workloads[0]))
+
+static workload_fn _workload;
+
+static void *_bench_thread(void *arg)
+{
+	bench_thread_t *t = (bench_thread_t *) arg;
+	_workload(t);
+	t->end = _now_ns();
+	return NULL;
+}
+
+static int _run(const bench_params_t *params, workload_fn fn, size_t ram_fs_limit)
+{
+	bench_thread_t *threads = calloc(params->nthreads, sizeof(bench_thread_t));
+	const size_t buf_size = 2 * params->io_size;
+	size_t nops = 0, nbytes = 0;
+	uint64_t start = UINT64_MAX, end = 0;
+	double elapsed;
+	unsigned int i;
+	int error = 0;
+	hist_t hist;
+
+	if (!threads)
+		return -1;
+	fdc_init(ram_fs_limit);
+	pthread_barrier_init(&_start, NULL, params->nthreads);
+	_workload = fn;
+	for (i = 0; i < params->nthreads; ++i) {
+		bench_thread_t *t = &threads[i];
+		t->params = params;
+		t->idx = i;
+		t->state = 0x9E3779B97F4A7C15ULL * (i + 1);
+		t->buf = malloc(buf_size);
+		hist_reset(&t->hist);
+		if (t->buf)
+			memset(t->buf, 'a' + i % 26, buf_size);
+		if (!t->buf || pthread_create(&t->thread, NULL, _bench_thread, t)) {
+			fprintf(stderr, "can't start thread %u\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < params->nthreads; ++i)
+		pthread_join(threads[i].thread, NULL);
+
+	/* prefills are done before the clock starts */
+	hist_reset(&hist);
+	for (i = 0; i < params->nthreads; ++i) {
+		if (threads[i].start < start)
+			start = threads[i].start;
+		if (threads[i].end > end)
+			end = threads[i].end;
+		hist_merge(&hist, &threads[i].hist);
+		nops += threads[i].nops;
+		nbytes += threads[i].nbytes;
+		error |= threads[i].error;
+		free(threads[i].buf);
+	}
+	fdc_deinit();
+	pthread_barrier_destroy(&_start);
+	free(threads);
+	elapsed = (end - start) / 1e9;
+
+	printf("{\"workload\": \"%s\", \"threads\": %u, \"block_size\": %zu, "
+	       "\"blocks_per_cluster\": %zu, \"io_size\": %zu, \"ops\": %zu, "
+	       "\"bytes\": %zu, \"seconds\": %.6f, \"mb_s\": %.1f, \"ops_s\": %.0f, "
+	       "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+	       "\"p999_ns\": %llu, \"max_ns\": %llu, \"errors\": %d}\n",
+	       params->workload, params->nthreads, params->block_size,
+	       params->blocks_per_cluster, params->io_size, nops, nbytes,
+	       elapsed, nbytes / elapsed / (1 << 20), nops / elapsed,
+	       (unsigned long long) hist_percentile(&hist, 50),
+	       (unsigned long long) hist_percentile(&hist, 90),
+	       (unsigned long long) hist_percentile(&hist, 99),
+	       (unsigned long long) hist_percentile(&hist, 99.9),
+	       (unsigned long long) hist.max, error);
+	fflush(stdout);
+	return error ? -1 : 0;
+}
+
+static void _usage(const char *prog)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: %s [-w workload] [-t threads] [-g blocksizexblocks] "
+		"[-s bytes] [-o io size] [-n inodes] [-l ram limit]\n", prog);
+	fprintf(stderr, "workloads:");
+	for (i = 0; i < NWORKLOADS; ++i)
+		fprintf(stderr, " %s", _workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+#define MAX_ARGS 16
+
+int main(int argc, char **argv)
+{
+	unsigned int threads[MAX_ARGS] = { 1, 4 };
+	size_t geometries[MAX_ARGS][2] = { { 4096, 1 }, { 4096, 16 }, { 65536, 16 } };
+	size_t nthreads = 2, ngeometries = 3, nworkloads = 0;
+	size_t workloads[MAX_ARGS];
+	bench_params_t params = {
+		.bytes = 64 << 20,
+		.io_size = 4096,
+		.ninodes = 10000,
+	};
+	size_t ram_fs_limit = (size_t) -1;
+	size_t i, j, k;
+	int opt, rc = 0;
+	bool user_threads = false, user_geometries = false;
+
+	while ((opt = getopt(argc, argv, "w:t:g:s:o:n:l:h")) != -1) {
+		switch (opt) {
+		case 'w':
+			for (i = 0; i < NWORKLOADS && strcmp(optarg, _workloads[i].name); ++i)
+				;
+			if (i == NWORKLOADS || nworkloads == MAX_ARGS)
+				_usage(argv[0]);
+			workloads[nworkloads++] = i;
+			break;
+		case 't':
+			if (!user_threads)
+				nthreads = 0;
+			user_threads = true;
+			if (nthreads == MAX_ARGS || !(threads[nthreads++] = strtoul(optarg, NULL, 0)))
+				_usage(argv[0]);
+			break;
+		case 'g':
+			if (!user_geometries)
+				ngeometries = 0;
+			user_geometries = true;
+			if (ngeometries == MAX_ARGS ||
+			    sscanf(optarg, "%zux%zu", &geometries[ngeometries][0],
+				   &geometries[ngeometries][1]) != 2 ||
+			    !geometries[ngeometries][0] || !geometries[ngeometries][1])
+				_usage(argv[0]);
+			ngeometries++;
+			break;
+		case 's':
+			params.bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			params.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			params.ninodes = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			ram_fs_limit = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			_usage(argv[0]);
+		}
+	}
+	if (!params.io_size || params.bytes < params.io_size || !params.ninodes)
+		_usage(argv[0]);
+	if (!nworkloads) {
+		for (i = 0; i < NWORKLOADS; ++i)
+			workloads[i] = i;
+		nworkloads = NWORKLOADS;
+	}
+
+	for (i = 0; i < nworkloads; ++i) {
+		for (j = 0; j < ngeometries; ++j) {
+			for (k = 0; k < nthreads; ++k) {
+				params.workload = _workloads[workloads[i]].name;
+				params.block_size = geometries[j][0];
+				params.blocks_per_cluster = geometries[j][1];
+				params.nthreads = threads[k];
+				if (_run(&params, _workloads[workloads[i]].fn, ram_fs_limit))
+					rc = 1;
+			}
+		}
+	}
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <jemalloc/jemalloc.h>
+#include "../fdcache.h"
+#include "../fdcache_internal.h"
+#include "../epoch.h"
+
+/* Memory used by the cache per byte of user data, for entries of different
+ * size distributions. Each distribution prints one JSON object per line with
+ * the bytes reported by the allocator, the growth of the RSS, and the
+ * metadata (entry structs, cluster maps, bitmaps) of the entries.
+ *
+ * usage: fdcache_mem_bench [-d distribution] [-g blocksizexblocks]
+ *                          [-s bytes] [-n entries]
+ *
+ * Entries are created until their user data reaches -s bytes (64 MiB by
+ * default) or there are -n of them (100000 by default).
+ **/
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+typedef struct mem_params_ {
+	size_t block_size;
+	size_t blocks_per_cluster;
+	size_t bytes;
+	size_t nentries;
+} mem_params_t;
+
+/* write the data of an entry, return the number of bytes written */
+typedef size_t (*fill_fn)(const mem_params_t *params, fd_cache_t fd, const char *buf);
+
+static uint64_t _state = 0x9E3779B97F4A7C15ULL;
+
+/* xorshift64* */
+static uint64_t _rand(void)
+{
+	_state ^= _state >> 12;
+	_state ^= _state << 25;
+	_state ^= _state >> 27;
+	return _state * 2685821657736338717ULL;
+}
+
+static size_t _write(fd_cache_t fd, const char *buf, size_t count, off_t offset)
+{
+	ssize_t rc = fdc_write(fd, buf, count, offset, NULL, NULL);
+	if (rc != (ssize_t) count) {
+		fprintf(stderr, "fdc_write: %zd\n", rc);
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+/* 1 to 64 bytes, stored inline */
+static size_t _tiny(const mem_params_t *params, fd_cache_t fd, const char *buf)
+{
+	return _write(fd, buf, 1 + _rand() % FDC_INLINE_SIZE, 0);
+}
+
+/* less than a block, in a small size class */
+static size_t _small(const mem_params_t *params, fd_cache_t fd, const char *buf)
+{
+	return _write(fd, buf, FDC_INLINE_SIZE + 1 +
+		      _rand() % (params->block_size - FDC_INLINE_SIZE), 0);
+}
+
+/* a single, partly written cluster */
+static size_t _single(const mem_params_t *params, fd_cache_t fd, const char *buf)
+{
+	const size_t cluster_size = params->block_size * params->blocks_per_cluster;
+	return _write(fd, buf, cluster_size / 2 + 1 + _rand() % (cluster_size / 2), 0);
+}
+
+/* 2 to 16 clusters, the last one partly written */
+static size_t _multi(const mem_params_t *params, fd_cache_t fd, const char *buf)
+{
+	const size_t cluster_size = params->block_size * params->blocks_per_cluster;
+	const size_t size = cluster_size + 1 + _rand() % (15 * cluster_size);
+	size_t off;
+
+	for (off = 0; off < size; off += cluster_size)
+		_write(fd, buf, size - off < cluster_size ? size - off : cluster_size, off);
+	return size;
+}
+
+/* 4 blocks written at random in 256 clusters, one in each quarter */
+static size_t _sparse(const mem_params_t *params, fd_cache_t fd, const char *buf)
+{
+	const size_t cluster_size = params->block_size * params->blocks_per_cluster;
+	const size_t quarter = 64 * params->blocks_per_cluster;
+	size_t i, nbytes = 0;
+
+	for (i = 0; i < 4; ++i) {
+		const size_t block = i * quarter + _rand() % quarter;
+		nbytes += _write(fd, buf, params->block_size, block * params->block_size);
+	}
+	/* entries all have the same size */
+	if (nbytes < 256 * cluster_size)
+		nbytes += _write(fd, buf, 1, 256 * cluster_size - 1);
+	return nbytes;
+}
+
+static const struct {
+	const char *name;
+	fill_fn fn;
+} _distributions[] = {
+	{ "tiny", _tiny },
+	{ "small", _small },
+	{ "single", _single },
+	{ "multi", _multi },
+	{ "sparse", _sparse },
+};
+#define NDISTRIBUTIONS (sizeof(_distributions) / sizeof(_distributions[0]))
+
+static size_t _allocated(void)
+{
+	size_t epoch = 1, allocated = 0, sz = sizeof(epoch);
+
+	mallctl("epoch", &epoch, &sz, &epoch, sz);
+	sz = sizeof(allocated);
+	mallctl("stats.allocated", &allocated, &sz, NULL, 0);
+	return allocated;
+}
+
+static size_t _rss(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* give the pages of freed memory back, so that the RSS of a run doesn't
+ * benefit from the previous ones */
+static void _purge(void)
+{
+#ifdef MALLCTL_ARENAS_ALL
+	mallctl("arena." STRINGIFY(MALLCTL_ARENAS_ALL) ".purge", NULL, NULL, NULL, 0);
+#endif
+}
+
+/* bytes allocated for the bitmap of an entry, see bitmap.c */
+static size_t _bitmap_bytes(bitmap_hdl bitmap)
+{
+	const size_t nbits = bitmap_length(bitmap);
+	if (!nbits)
+		return 0;
+	return 2 * sizeof(void *) + (nbits + 63) / 64 * sizeof(unsigned long);
+}
+
+static void _run(const char *name, fill_fn fn, const mem_params_t *params)
+{
+	const size_t buf_size = params->block_size * params->blocks_per_cluster;
+	char *buf = malloc(buf_size);
+	size_t allocated0, rss0, allocated, rss;
+	size_t user = 0, nentries = 0, entries = 0, cmaps = 0, bitmaps = 0;
+	ssize_t other;
+	fdc_stats_t st;
+	cache_ino_t ino;
+
+	if (!buf) {
+		fprintf(stderr, "can't allocate the data buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	/* zeros would be holes */
+	memset(buf, 'x', buf_size);
+
+	_purge();
+	fdc_init((size_t) -1);
+	allocated0 = _allocated();
+	rss0 = _rss();
+
+	for (ino = 1; user < params->bytes && nentries < params->nentries; ++ino, ++nentries) {
+		fd_cache_t fd;
+		if (fdc_get_or_create(ino, params->block_size, params->blocks_per_cluster, &fd)) {
+			fprintf(stderr, "fdc_get_or_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		user += fn(params, fd, buf);
+	}
+	/* single threaded, nobody reads retired cluster buffers */
+	epoch_drain();
+
+	allocated = _allocated() - allocated0;
+	rss = _rss();
+	rss = rss > rss0 ? rss - rss0 : 0;
+	fdc_stats(&st);
+	for (ino = 1; ino <= nentries; ++ino) {
+		fd_cache_entry_t *ent = __fdc_lookup(ino);
+		entries += sizeof(fd_cache_entry_t);
+		cmaps += cmap_overhead(&ent->clusters);
+		bitmaps += _bitmap_bytes(ent->bitmap);
+	}
+	/* hash tables, allocator rounding and fragmentation */
+	other = (ssize_t) allocated - st.resident - entries - cmaps - bitmaps;
+
+	printf("{\"distribution\": \"%s\", \"block_size\": %zu, \"blocks_per_cluster\": %zu, "
+	       "\"entries\": %zu, \"user_bytes\": %zu, \"allocated_bytes\": %zu, "
+	       "\"rss_bytes\": %zu, \"cluster_bytes\": %llu, \"entry_bytes\": %zu, "
+	       "\"cmap_bytes\": %zu, \"bitmap_bytes\": %zu, \"other_bytes\": %zd, "
+	       "\"allocated_per_byte\": %.4f, \"rss_per_byte\": %.4f, "
+	       "\"metadata_per_byte\": %.4f}\n",
+	       name, params->block_size, params->blocks_per_cluster, nentries, user,
+	       allocated, rss, (unsigned long long) st.resident, entries, cmaps, bitmaps,
+	       other, (double) allocated / user, (double) rss / user,
+	       (double) (entries + cmaps + bitmaps) / user);
+	fflush(stdout);
+
+	fdc_deinit();
+	free(buf);
+}
+
+static void _usage(const char *prog)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: %s [-d distribution] [-g blocksizexblocks] [-s bytes] "
+		"[-n entries]\n", prog);
+	fprintf(stderr, "distributions:");
+	for (i = 0; i < NDISTRIBUTIONS; ++i)
+		fprintf(stderr, " %s", _distributions[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	mem_params_t params = {
+		.block_size = 4096,
+		.blocks_per_cluster = 16,
+		.bytes = 64 << 20,
+		.nentries = 100000,
+	};
+	bool selected[NDISTRIBUTIONS] = { false }, any = false;
+	size_t i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:g:s:n:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			for (i = 0; i < NDISTRIBUTIONS && strcmp(optarg, _distributions[i].name); ++i)
+				;
+			if (i == NDISTRIBUTIONS)
+				_usage(argv[0]);
+			selected[i] = any = true;
+			break;
+		case 'g':
+			if (sscanf(optarg, "%zux%zu", &params.block_size, &params.blocks_per_cluster) != 2)
+				_usage(argv[0]);
+			break;
+		case 's':
+			params.bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			params.nentries = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			_usage(argv[0]);
+		}
+	}
+	/* small entries need room past the inline data */
+	if (params.block_size <= FDC_INLINE_SIZE || !params.blocks_per_cluster ||
+	    !params.bytes || !params.nentries)
+		_usage(argv[0]);
+
+	for (i = 0; i < NDISTRIBUTIONS; ++i) {
+		if (!any || selected[i])
+			_run(_distributions[i].name, _distributions[i].fn, &params);
+	}
+	return EXIT_SUCCESS;
+}
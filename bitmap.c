@@ -1,6 +1,7 @@
 ﻿#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <asm/types.h>
 #include "bitmap.h"
 
@@ -26,9 +27,15 @@ bitmap_hdl bitmap_alloc(size_t nbits)
 	bitmap_t *bm = NULL;
 	if (nbits) {
 		bm = (bitmap_t *) malloc(sizeof(bitmap_t));
+		if (!bm)
+			return NULL;
 		bm->nbits = nbits;
 		size_t nbytes = BITS_TO_LONGS(nbits) * sizeof(unsigned long);
 		bm->bits = (unsigned long*) malloc(nbytes);
+		if (!bm->bits) {
+			free(bm);
+			return NULL;
+		}
 	}
 	return bm;
 }
@@ -46,7 +53,7 @@ void bitmap_free(bitmap_hdl hdl)
 	bitmap_t *bm = (bitmap_t *) hdl;
 	if (bm) {
 		free(bm->bits);
-		bm->nbits = 0;
+		free(bm);
 	}
 }
 
@@ -129,14 +136,14 @@ bool bitmap_get(bitmap_hdl hdl, size_t pos)
 	return (*p & BIT_MASK(pos)) != 0;
 }
 
-bool bitmap_get_range(bitmap_hdl hdl, size_t pos, int len)
+bool bitmap_get_range(bitmap_hdl hdl, size_t pos, size_t len)
 {
 	const bitmap_t *bm = (const bitmap_t *) hdl;
 	bool result = true;
 	size_t cur;
 	for (cur = 0; result && (cur < len); ++cur) {
 		const unsigned long *p = ((const unsigned long *) bm->bits) + BIT_WORD(pos + cur);
-		result &= ((*p & BIT_MASK(pos)) != 0);
+		result &= ((*p & BIT_MASK(pos + cur)) != 0);
 	}
 	return result;
 }
@@ -167,7 +174,7 @@ void bitmap_copy(bitmap_hdl dst, const bitmap_hdl src, size_t nbits)
 	memcpy(dstbm->bits, srcbm->bits, len);
 }
 
-void bitmap_realloc(bitmap_hdl hdl, size_t nbits)
+int bitmap_realloc(bitmap_hdl hdl, size_t nbits)
 {
 	bitmap_t *bm = (bitmap_t *) hdl;
 	if (nbits != bm->nbits) {
@@ -175,9 +182,17 @@ void bitmap_realloc(bitmap_hdl hdl, size_t nbits)
 		size_t newnbytes = BITS_TO_LONGS(nbits) * sizeof(unsigned long);
 		unsigned long *tmpbits = (unsigned long*) malloc(newnbytes);
 		size_t minbytes = nbits < bm->nbits ? newnbytes : oldnbytes;
+		if (!tmpbits)
+			return -ENOMEM;
 		memcpy(tmpbits, bm->bits, minbytes);
+		if (nbits > bm->nbits) {
+			/* the bits past the old length, in its last word too */
+			memset((char *) tmpbits + oldnbytes, 0, newnbytes - oldnbytes);
+			tmpbits[BIT_WORD(bm->nbits - 1)] &= BITMAP_LAST_WORD_MASK(bm->nbits);
+		}
 		free(bm->bits);
 		bm->bits = tmpbits;
 		bm->nbits = nbits;
 	}
+	return 0;
 }
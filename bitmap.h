@@ -7,7 +7,7 @@
 /* bitmap handle (opaque pointer) */
 typedef void* bitmap_hdl;
 
-/* allocate a bitmap */
+/* allocate a bitmap, NULL if nbits is 0 or on allocation failure */
 bitmap_hdl bitmap_alloc(size_t numbits);
 
 /* return the bitmap length in bits */
@@ -30,7 +30,7 @@ void bitmap_set_range(bitmap_hdl hdl, size_t pos, int len);
 
 /* get a specific range (true if all bits in the range are set, false
  * otherwise) */
-bool bitmap_get_range(bitmap_hdl hdl, size_t pos, int len);
+bool bitmap_get_range(bitmap_hdl hdl, size_t pos, size_t len);
 
 /* reset a specific bit */
 void bitmap_reset(bitmap_hdl hdl, size_t pos);
@@ -50,8 +50,10 @@ void bitmap_copy(bitmap_hdl dst, const bitmap_hdl src, size_t nbits);
 /* realloc changes the number of bits of the bitmap represented by hdl to
  * nbits. The bits will be unchanged in the range from the start of the region
  * up to the minimum of the old and new sizes. If the new number of bits is
- * larger than the old number of bits, added bits won't be initialized.
+ * larger than the old number of bits, added bits are reset.
+ * Return 0 on success, -ENOMEM if the bitmap can't be reallocated, in which
+ * case it's left unchanged.
  **/
-void bitmap_realloc(bitmap_hdl hdl, size_t nbits);
+int bitmap_realloc(bitmap_hdl hdl, size_t nbits);
 
 #endif
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "cluster_map.h"
+
+void cmap_init(cluster_map_t *map)
+{
+	map->first = NULL;
+	map->root = NULL;
+	map->nclusters = 0;
+	map->nnodes = 0;
+}
+
+static void _cmap_free_node(cmap_node_t *node, void (*free_fn)(void *))
+{
+	size_t i;
+
+	for (i = 0; i < CMAP_NODE_SIZE; ++i) {
+		if (!node->slots[i])
+			continue;
+		if (node->shift)
+			_cmap_free_node(node->slots[i], free_fn);
+		else if (free_fn)
+			free_fn(node->slots[i]);
+	}
+	free(node);
+}
+
+void cmap_destroy(cluster_map_t *map, void (*free_fn)(void *))
+{
+	if (free_fn && map->first)
+		free_fn(map->first);
+	if (map->root)
+		_cmap_free_node(map->root, free_fn);
+	cmap_init(map);
+}
+
+static cmap_node_t *_cmap_node_new(cluster_map_t *map, unsigned int shift)
+{
+	cmap_node_t *node = calloc(1, sizeof(cmap_node_t));
+	if (node) {
+		node->shift = shift;
+		map->nnodes++;
+	}
+	return node;
+}
+
+int cmap_set(cluster_map_t *map, size_t cidx, void *cbuf)
+{
+	cmap_node_t *node = map->root, *child;
+	unsigned int shift = 0;
+	void **slot;
+
+	if (!cidx) {
+		slot = &map->first;
+		goto set;
+	}
+
+	if (!node) {
+		if (!cbuf)
+			return 0;	/* unmapping a cluster that's not mapped */
+		/* the first root is as high as cidx requires */
+		while (_cmap_over(shift, cidx))
+			shift += CMAP_NODE_SHIFT;
+		node = _cmap_node_new(map, shift);
+		if (!node)
+			return -ENOMEM;
+		__atomic_store_n(&map->root, node, __ATOMIC_RELEASE);
+	}
+	/* the old root becomes the first child of the new one, lookups see
+	 * the same clusters through either */
+	while (_cmap_over(node->shift, cidx)) {
+		if (!cbuf)
+			return 0;
+		child = node;
+		node = _cmap_node_new(map, child->shift + CMAP_NODE_SHIFT);
+		if (!node)
+			return -ENOMEM;
+		node->slots[0] = child;
+		__atomic_store_n(&map->root, node, __ATOMIC_RELEASE);
+	}
+	while (node->shift) {
+		slot = &node->slots[(cidx >> node->shift) & CMAP_NODE_MASK];
+		if (!*slot) {
+			if (!cbuf)
+				return 0;
+			child = _cmap_node_new(map, node->shift - CMAP_NODE_SHIFT);
+			if (!child)
+				return -ENOMEM;
+			__atomic_store_n(slot, child, __ATOMIC_RELEASE);
+		}
+		node = *slot;
+	}
+	slot = &node->slots[cidx & CMAP_NODE_MASK];
+
+set:
+	if (!*slot && cbuf)
+		map->nclusters++;
+	else if (*slot && !cbuf)
+		map->nclusters--;
+	__atomic_store_n(slot, cbuf, __ATOMIC_RELEASE);
+	return 0;
+}
+
+size_t cmap_overhead(const cluster_map_t *map)
+{
+	return map->nnodes * sizeof(cmap_node_t);
+}
+
+static void _cmap_foreach_node(const cmap_node_t *node, size_t base,
+			       void (*fn)(size_t cidx, void *cbuf, void *arg),
+			       void *arg)
+{
+	size_t i;
+
+	for (i = 0; i < CMAP_NODE_SIZE; ++i) {
+		const size_t cidx = base | (i << node->shift);
+		if (!node->slots[i])
+			continue;
+		if (node->shift)
+			_cmap_foreach_node(node->slots[i], cidx, fn, arg);
+		else
+			fn(cidx, node->slots[i], arg);
+	}
+}
+
+void cmap_foreach(const cluster_map_t *map,
+		  void (*fn)(size_t cidx, void *cbuf, void *arg),
+		  void *arg)
+{
+	if (map->first)
+		fn(0, map->first, arg);
+	if (map->root)
+		_cmap_foreach_node(map->root, 0, fn, arg);
+}
@@ -0,0 +1,91 @@
+#ifndef CLUSTER_MAP_H
+#define CLUSTER_MAP_H
+
+#include <stddef.h>
+
+/* cluster map, a radix tree mapping a cluster index to its buffer.
+ *
+ * Each node holds CMAP_NODE_SIZE slots, pointing to child nodes, or to the
+ * buffers of consecutive clusters for the leaves. The tree only grows as high
+ * as the largest index requires, and nodes are only allocated on the paths to
+ * mapped clusters, so the map stays compact for sparse entries, whatever the
+ * offsets. Cluster 0 is kept in the map itself, so that entries of a single
+ * cluster don't allocate any.
+ *
+ * Modifications must be serialized by the caller, but lookups can run
+ * concurrently with them: the tree grows by putting a new root on top of the
+ * old one, and nodes are never freed before cmap_destroy().
+ **/
+
+#define CMAP_NODE_SHIFT 6
+#define CMAP_NODE_SIZE (1UL << CMAP_NODE_SHIFT)
+#define CMAP_NODE_MASK (CMAP_NODE_SIZE - 1)
+
+/* shift of the root of a tree covering all the indices */
+#define CMAP_MAX_SHIFT ((sizeof(size_t) * 8 - 1) / CMAP_NODE_SHIFT * CMAP_NODE_SHIFT)
+
+typedef struct cmap_node_ {
+	unsigned int shift;		/* index bits below the node, 0 for
+					 * leaves */
+	void *slots[CMAP_NODE_SIZE];
+} cmap_node_t;
+
+typedef struct cluster_map_ {
+	void *first;		/* buffer of cluster 0 */
+	cmap_node_t *root;
+	size_t nclusters;	/* number of mapped clusters */
+	size_t nnodes;		/* number of allocated nodes */
+} cluster_map_t;
+
+/* initialize an empty map */
+void cmap_init(cluster_map_t *map);
+
+/* free the map memory. If free_fn is not NULL, it's called on each mapped
+ * cluster buffer */
+void cmap_destroy(cluster_map_t *map, void (*free_fn)(void *));
+
+/* true if the tree under a root of this shift can't hold cidx */
+static inline int _cmap_over(unsigned int shift, size_t cidx)
+{
+	return shift < CMAP_MAX_SHIFT && cidx >> (shift + CMAP_NODE_SHIFT);
+}
+
+/* return the buffer of cluster cidx, or NULL if it's not mapped */
+static inline void *cmap_lookup(const cluster_map_t *map, size_t cidx)
+{
+	const cmap_node_t *node;
+
+	if (!cidx)
+		return __atomic_load_n(&map->first, __ATOMIC_ACQUIRE);
+	node = __atomic_load_n(&map->root, __ATOMIC_ACQUIRE);
+	if (!node || _cmap_over(node->shift, cidx))
+		return NULL;
+	while (node->shift) {
+		node = __atomic_load_n(&node->slots[(cidx >> node->shift) & CMAP_NODE_MASK],
+				       __ATOMIC_ACQUIRE);
+		if (!node)
+			return NULL;
+	}
+	return __atomic_load_n(&node->slots[cidx & CMAP_NODE_MASK], __ATOMIC_ACQUIRE);
+}
+
+/* map cluster cidx to cbuf (NULL to unmap it). Return 0 on success, -ENOMEM if
+ * the map can't grow */
+int cmap_set(cluster_map_t *map, size_t cidx, void *cbuf);
+
+/* return the number of mapped clusters */
+static inline size_t cmap_count(const cluster_map_t *map)
+{
+	return map->nclusters;
+}
+
+/* return the number of bytes used by the map itself */
+size_t cmap_overhead(const cluster_map_t *map);
+
+/* call fn on each mapped cluster, by increasing cluster index. fn must not
+ * modify the map */
+void cmap_foreach(const cluster_map_t *map,
+		  void (*fn)(size_t cidx, void *cbuf, void *arg),
+		  void *arg);
+
+#endif
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "hugepage.h"
+#include "cluster_pool.h"
+
+typedef struct cpool_magazine_ {
+	cluster_pool_t *pool;	/* NULL once the pool has been destroyed */
+	struct cpool_magazine_ *next;
+	unsigned int n;
+	void *bufs[CPOOL_MAGAZINE_MAX];
+} cpool_magazine_t;
+
+struct cluster_pool_ {
+	pthread_mutex_t lock;
+	size_t cluster_size;
+	unsigned int id;		/* index in _pools and in thread magazines */
+	unsigned int mag_size;		/* magazine capacity */
+	cpool_backend_t backend;
+	size_t align;			/* malloc backend alignment, or 0 */
+	void **depot;
+	size_t ndepot;
+	size_t depot_cap;
+	cpool_magazine_t *magazines;	/* magazines of all threads */
+	size_t nused;
+	size_t peak_used;
+};
+
+static pthread_mutex_t _pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static cluster_pool_t *_pools[CPOOL_MAX_POOLS];
+static size_t _depot_bytes;
+static size_t _depot_limit = (size_t) -1;
+static cpool_backend_t _backend = CPOOL_BACKEND_MALLOC;
+static size_t _align;
+
+static __thread cpool_magazine_t *_mags[CPOOL_MAX_POOLS];
+static pthread_key_t _mags_key;
+static pthread_once_t _mags_key_once = PTHREAD_ONCE_INIT;
+
+static void *_cbuf_alloc(cluster_pool_t *pool)
+{
+	void *cbuf;
+
+	if (pool->backend == CPOOL_BACKEND_HUGEPAGE)
+		return hpage_alloc(pool->cluster_size);
+	if (pool->align)
+		return posix_memalign(&cbuf, pool->align, pool->cluster_size) ? NULL : cbuf;
+	return malloc(pool->cluster_size);
+}
+
+static void _cbuf_free(cluster_pool_t *pool, void *cbuf)
+{
+	if (pool->backend == CPOOL_BACKEND_HUGEPAGE)
+		hpage_free(cbuf, pool->cluster_size);
+	else
+		free(cbuf);
+}
+
+/* push cbuf to the depot, or free it if the depot limit is reached. Pool lock
+ * must be held */
+static void _depot_push(cluster_pool_t *pool, void *cbuf)
+{
+	if (_depot_bytes + pool->cluster_size > __atomic_load_n(&_depot_limit, __ATOMIC_RELAXED)) {
+		_cbuf_free(pool, cbuf);
+		return;
+	}
+	if (pool->ndepot == pool->depot_cap) {
+		size_t newcap = pool->depot_cap ? pool->depot_cap * 2 : 16;
+		void **newdepot = realloc(pool->depot, newcap * sizeof(void *));
+		if (!newdepot) {
+			_cbuf_free(pool, cbuf);
+			return;
+		}
+		pool->depot = newdepot;
+		pool->depot_cap = newcap;
+	}
+	pool->depot[pool->ndepot++] = cbuf;
+	__atomic_add_fetch(&_depot_bytes, pool->cluster_size, __ATOMIC_RELAXED);
+}
+
+/* pop a buffer from the depot, NULL if empty. Pool lock must be held */
+static void *_depot_pop(cluster_pool_t *pool)
+{
+	if (!pool->ndepot)
+		return NULL;
+	__atomic_sub_fetch(&_depot_bytes, pool->cluster_size, __ATOMIC_RELAXED);
+	return pool->depot[--pool->ndepot];
+}
+
+static void _unlink_magazine(cluster_pool_t *pool, cpool_magazine_t *mag)
+{
+	cpool_magazine_t **pp = &pool->magazines;
+	while (*pp && *pp != mag)
+		pp = &(*pp)->next;
+	if (*pp)
+		*pp = mag->next;
+}
+
+/* thread exit, give the magazines content back to the depots */
+static void _thread_exit(void *arg)
+{
+	cpool_magazine_t **mags = (cpool_magazine_t **) arg;
+	unsigned int i;
+
+	pthread_mutex_lock(&_pools_lock);
+	for (i = 0; i < CPOOL_MAX_POOLS; ++i) {
+		cpool_magazine_t *mag = mags[i];
+		if (!mag)
+			continue;
+		if (mag->pool) {
+			cluster_pool_t *pool = mag->pool;
+			pthread_mutex_lock(&pool->lock);
+			while (mag->n) {
+				_depot_push(pool, mag->bufs[--mag->n]);
+				pool->nused--;
+			}
+			_unlink_magazine(pool, mag);
+			pthread_mutex_unlock(&pool->lock);
+		}
+		free(mag);
+		mags[i] = NULL;
+	}
+	pthread_mutex_unlock(&_pools_lock);
+}
+
+static void _make_key(void)
+{
+	pthread_key_create(&_mags_key, _thread_exit);
+}
+
+/* return the calling thread magazine for pool, NULL if it can't be allocated */
+static cpool_magazine_t *_magazine(cluster_pool_t *pool)
+{
+	cpool_magazine_t *mag = _mags[pool->id];
+	if (mag && mag->pool == pool)
+		return mag;
+
+	if (!mag) {
+		pthread_once(&_mags_key_once, _make_key);
+		mag = malloc(sizeof(cpool_magazine_t));
+		if (!mag)
+			return NULL;
+		_mags[pool->id] = mag;
+		pthread_setspecific(_mags_key, _mags);
+	}
+	/* new magazine, or left over by a destroyed pool */
+	mag->n = 0;
+	mag->pool = pool;
+	pthread_mutex_lock(&pool->lock);
+	mag->next = pool->magazines;
+	pool->magazines = mag;
+	pthread_mutex_unlock(&pool->lock);
+	return mag;
+}
+
+void cpool_set_limit(size_t nbytes)
+{
+	__atomic_store_n(&_depot_limit, nbytes, __ATOMIC_RELAXED);
+}
+
+void cpool_set_backend(cpool_backend_t backend)
+{
+	pthread_mutex_lock(&_pools_lock);
+	_backend = backend;
+	pthread_mutex_unlock(&_pools_lock);
+}
+
+void cpool_set_align(size_t align)
+{
+	pthread_mutex_lock(&_pools_lock);
+	_align = align;
+	pthread_mutex_unlock(&_pools_lock);
+}
+
+cluster_pool_t *cpool_get(size_t cluster_size)
+{
+	cluster_pool_t *pool = NULL;
+	unsigned int i, free_id = CPOOL_MAX_POOLS;
+
+	pthread_mutex_lock(&_pools_lock);
+	for (i = 0; i < CPOOL_MAX_POOLS; ++i) {
+		if (_pools[i] && _pools[i]->cluster_size == cluster_size) {
+			pool = _pools[i];
+			goto out;
+		}
+		if (!_pools[i] && free_id == CPOOL_MAX_POOLS)
+			free_id = i;
+	}
+	if (free_id == CPOOL_MAX_POOLS)
+		goto out;
+
+	pool = calloc(1, sizeof(cluster_pool_t));
+	if (!pool)
+		goto out;
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->cluster_size = cluster_size;
+	pool->id = free_id;
+	pool->backend = cluster_size >= HPAGE_SIZE ? _backend : CPOOL_BACKEND_MALLOC;
+	pool->align = _align && cluster_size % _align == 0 ? _align : 0;
+	pool->mag_size = CPOOL_MAGAZINE_BYTES / cluster_size;
+	if (pool->mag_size < CPOOL_MAGAZINE_MIN)
+		pool->mag_size = CPOOL_MAGAZINE_MIN;
+	if (pool->mag_size > CPOOL_MAGAZINE_MAX)
+		pool->mag_size = CPOOL_MAGAZINE_MAX;
+	_pools[free_id] = pool;
+out:
+	pthread_mutex_unlock(&_pools_lock);
+	return pool;
+}
+
+void *cpool_alloc(cluster_pool_t *pool)
+{
+	cpool_magazine_t *mag = _magazine(pool);
+	void *cbuf;
+
+	if (mag && mag->n)
+		return mag->bufs[--mag->n];
+
+	/* empty magazine, refill half of it from the depot */
+	pthread_mutex_lock(&pool->lock);
+	cbuf = _depot_pop(pool);
+	while (cbuf && mag && mag->n < pool->mag_size / 2) {
+		mag->bufs[mag->n++] = cbuf;
+		cbuf = _depot_pop(pool);
+	}
+	if (!cbuf && mag && mag->n)
+		cbuf = mag->bufs[--mag->n];
+	if (!cbuf)
+		cbuf = _cbuf_alloc(pool);
+	if (cbuf) {
+		/* clusters in the magazine are counted as used */
+		pool->nused += 1 + (mag ? mag->n : 0);
+		if (pool->nused > pool->peak_used)
+			pool->peak_used = pool->nused;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return cbuf;
+}
+
+void cpool_free(cluster_pool_t *pool, void *cbuf)
+{
+	cpool_magazine_t *mag = _magazine(pool);
+
+	if (mag && mag->n < pool->mag_size) {
+		mag->bufs[mag->n++] = cbuf;
+		return;
+	}
+
+	/* full magazine, flush half of it to the depot */
+	pthread_mutex_lock(&pool->lock);
+	_depot_push(pool, cbuf);
+	pool->nused--;
+	while (mag && mag->n > pool->mag_size / 2) {
+		_depot_push(pool, mag->bufs[--mag->n]);
+		pool->nused--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+size_t cpool_cluster_size(cluster_pool_t *pool)
+{
+	return pool->cluster_size;
+}
+
+void cpool_stats(cluster_pool_t *pool, cpool_stats_t *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	stats->cluster_size = pool->cluster_size;
+	stats->nused = pool->nused;
+	stats->ncached = pool->ndepot;
+	stats->peak_used = pool->peak_used;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void cpool_destroy_all(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&_pools_lock);
+	for (i = 0; i < CPOOL_MAX_POOLS; ++i) {
+		cluster_pool_t *pool = _pools[i];
+		cpool_magazine_t *mag;
+		if (!pool)
+			continue;
+
+		/* empty the magazines of all threads, other threads free their
+		 * magazine on exit */
+		for (mag = pool->magazines; mag; mag = mag->next) {
+			while (mag->n)
+				_cbuf_free(pool, mag->bufs[--mag->n]);
+			mag->pool = NULL;
+		}
+		while (pool->ndepot)
+			_cbuf_free(pool, _depot_pop(pool));
+		free(pool->depot);
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		_pools[i] = NULL;
+
+		/* ours can go right now */
+		free(_mags[i]);
+		_mags[i] = NULL;
+	}
+	pthread_mutex_unlock(&_pools_lock);
+}
@@ -0,0 +1,77 @@
+#ifndef CLUSTER_POOL_H
+#define CLUSTER_POOL_H
+
+#include <stddef.h>
+
+/* cluster pools, caches of fixed-size cluster buffers.
+ *
+ * There's one pool per cluster size (block_size * blocks_per_cluster), shared
+ * by all the entries having this geometry, so that clusters freed by an entry
+ * are recycled by the others instead of going back to the allocator.
+ *
+ * Each thread keeps a small magazine of free clusters per pool, so that most
+ * allocations and frees don't take any lock. Magazines are refilled from, and
+ * flushed to, a per-pool depot. Free clusters in depots are bounded by a
+ * global limit, above which freed clusters are returned to the allocator.
+ **/
+
+/* maximum number of different cluster sizes */
+#define CPOOL_MAX_POOLS 32
+
+/* magazines are sized to hold about this many bytes of clusters */
+#define CPOOL_MAGAZINE_BYTES (8 << 20)
+#define CPOOL_MAGAZINE_MIN 2
+#define CPOOL_MAGAZINE_MAX 64
+
+typedef struct cluster_pool_ cluster_pool_t;
+
+/* where cluster buffers come from */
+typedef enum cpool_backend_ {
+	CPOOL_BACKEND_MALLOC,		/* the regular allocator */
+	CPOOL_BACKEND_HUGEPAGE,		/* huge page aligned mappings, see
+					 * hugepage.h. Clusters smaller than a
+					 * huge page still use malloc */
+} cpool_backend_t;
+
+typedef struct cpool_stats_ {
+	size_t cluster_size;
+	size_t nused;		/* clusters currently handed out */
+	size_t ncached;		/* free clusters kept in the depot */
+	size_t peak_used;	/* high-water mark of nused */
+} cpool_stats_t;
+
+/* set the maximum number of bytes of free clusters kept in depots, all pools
+ * together */
+void cpool_set_limit(size_t nbytes);
+
+/* set the backend of the pools created from now on */
+void cpool_set_backend(cpool_backend_t backend);
+
+/* align the clusters of the pools created from now on to `align` bytes, a
+ * power of two (0 for the allocator default alignment), e.g. for O_DIRECT
+ * I/O. Only pools whose cluster size is a multiple of align are concerned,
+ * huge page clusters are always aligned on huge pages */
+void cpool_set_align(size_t align);
+
+/* return the pool for clusters of cluster_size bytes, creating it if needed.
+ * Return NULL if the pool can't be created */
+cluster_pool_t *cpool_get(size_t cluster_size);
+
+/* return a cluster buffer of the pool size, or NULL if it can't be allocated */
+void *cpool_alloc(cluster_pool_t *pool);
+
+/* give a cluster buffer back to its pool */
+void cpool_free(cluster_pool_t *pool, void *cbuf);
+
+/* return the size of the clusters of the pool */
+size_t cpool_cluster_size(cluster_pool_t *pool);
+
+/* fill stats with the state of the pool. Clusters cached in magazines are
+ * counted as used */
+void cpool_stats(cluster_pool_t *pool, cpool_stats_t *stats);
+
+/* free all the pools and their cached clusters. Clusters handed out must have
+ * been given back, and no other thread may be using the pools */
+void cpool_destroy_all(void);
+
+#endif
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "dir_sink.h"
+
+static int _dir_sink_push(void *arg, cache_ino_t ino, size_t cidx,
+			  const void *buf, size_t nbytes)
+{
+	const char *dir = (const char *) arg;
+	char path[PATH_MAX];
+	size_t nwritten = 0;
+	int fd, rc = 0;
+
+	if (snprintf(path, sizeof(path), "%s/%llu.%lu", dir, ino, cidx) >= sizeof(path))
+		return -ENAMETOOLONG;
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (!buf) {
+		if (ftruncate(fd, nbytes))
+			rc = -errno;
+	}
+	while (buf && nwritten < nbytes) {
+		ssize_t n = write(fd, buf + nwritten, nbytes - nwritten);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			rc = -errno;
+			break;
+		}
+		nwritten += n;
+	}
+	if (close(fd) && !rc)
+		rc = -errno;
+	return rc;
+}
+
+int dir_sink_init(fdc_sink_t *sink, const char *dir)
+{
+	sink->push = _dir_sink_push;
+	sink->arg = strdup(dir);
+	return sink->arg ? 0 : -ENOMEM;
+}
+
+void dir_sink_destroy(fdc_sink_t *sink)
+{
+	free(sink->arg);
+	sink->arg = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef DIR_SINK_H
+#define DIR_SINK_H
+
+#include "fdcache.h"
+
+/* local directory sink, mostly for testing: cluster cidx of entry ino is
+ * written to the file <dir>/<ino>.<cidx>, holes are written as sparse files */
+
+/* initialize sink to write to dir, which must exist. Return 0 on success,
+ * -ENOMEM on allocation failure */
+int dir_sink_init(fdc_sink_t *sink, const char *dir);
+
+/* free the resources of a sink initialized by dir_sink_init */
+void dir_sink_destroy(fdc_sink_t *sink);
+
+#endif
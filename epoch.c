@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "epoch.h"
+
+/* number of retired pointers after which we try to advance the global epoch
+ * and free what can be */
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+/* retired memory is kept in 3 lists: memory retired during epoch e can be freed
+ * as soon as the global epoch reaches e + 2 */
+#define EPOCH_NLISTS 3
+
+typedef struct epoch_thread_ {
+	/* 0 when outside a read section, (observed epoch << 1) | 1 inside */
+	unsigned long state;
+	unsigned int nesting;
+	int in_use;
+} __attribute__((aligned(64))) epoch_thread_t;
+
+typedef struct epoch_retired_ {
+	void *ptr;
+	void (*free_fn)(void *);
+	void (*free_arg_fn)(void *, void *);	/* used if free_fn is NULL */
+	void *arg;
+	struct epoch_retired_ *next;
+} epoch_retired_t;
+
+static unsigned long _global_epoch;
+static epoch_thread_t _threads[EPOCH_MAX_THREADS];
+static unsigned int _nthreads;		/* high-water mark of used records */
+
+static pthread_mutex_t _retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_retired_t *_retired[EPOCH_NLISTS];
+static size_t _nretired;
+
+static __thread epoch_thread_t *_self;
+static pthread_key_t _self_key;
+static pthread_once_t _self_key_once = PTHREAD_ONCE_INIT;
+
+static void _thread_exit(void *arg)
+{
+	epoch_thread_t *rec = (epoch_thread_t *) arg;
+	__atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+	rec->nesting = 0;
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _make_key(void)
+{
+	pthread_key_create(&_self_key, _thread_exit);
+}
+
+/* find a free record, NULL if there's none */
+static epoch_thread_t *_alloc_record(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < EPOCH_MAX_THREADS; ++i) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&_threads[i].in_use, &expected, 1,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			unsigned int n = __atomic_load_n(&_nthreads, __ATOMIC_RELAXED);
+			while (n < i + 1 &&
+			       !__atomic_compare_exchange_n(&_nthreads, &n, i + 1,
+							    false, __ATOMIC_RELEASE,
+							    __ATOMIC_RELAXED))
+				;
+			return &_threads[i];
+		}
+	}
+	return NULL;
+}
+
+/* find a free thread record for the calling thread */
+static epoch_thread_t *_register(void)
+{
+	epoch_thread_t *rec;
+	pthread_once(&_self_key_once, _make_key);
+
+	rec = _alloc_record();
+	if (!rec)
+		return NULL;
+	pthread_setspecific(_self_key, rec);
+	_self = rec;
+	return _self;
+}
+
+/* enter a read section on record rec, which isn't in one */
+static void _enter(epoch_thread_t *rec)
+{
+	unsigned long e = __atomic_load_n(&_global_epoch, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&rec->state, (e << 1) | 1, __ATOMIC_RELAXED);
+	/* the record must be visible to reclaimers before we read any
+	 * protected pointer */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+bool epoch_enter(void)
+{
+	epoch_thread_t *self = _self;
+	if (!self && !(self = _register()))
+		return false;
+
+	if (self->nesting++ == 0)
+		_enter(self);
+	return true;
+}
+
+void epoch_exit(void)
+{
+	epoch_thread_t *self = _self;
+	if (--self->nesting == 0)
+		__atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+epoch_pin_t *epoch_pin(void)
+{
+	epoch_thread_t *rec = _alloc_record();
+	if (rec)
+		_enter(rec);
+	return rec;
+}
+
+void epoch_unpin(epoch_pin_t *pin)
+{
+	__atomic_store_n(&pin->state, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&pin->in_use, 0, __ATOMIC_RELEASE);
+	epoch_reclaim();
+}
+
+static void _free_list(epoch_retired_t *r)
+{
+	while (r) {
+		epoch_retired_t *next = r->next;
+		if (r->free_fn)
+			r->free_fn(r->ptr);
+		else
+			r->free_arg_fn(r->ptr, r->arg);
+		free(r);
+		r = next;
+	}
+}
+
+/* try to advance the global epoch, retire lock must be held. Return the list
+ * of memory that can be freed */
+static epoch_retired_t *_try_advance(void)
+{
+	unsigned long e = __atomic_load_n(&_global_epoch, __ATOMIC_RELAXED);
+	unsigned int i, n = __atomic_load_n(&_nthreads, __ATOMIC_ACQUIRE);
+	epoch_retired_t *reclaimable;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < n; ++i) {
+		unsigned long state = __atomic_load_n(&_threads[i].state, __ATOMIC_ACQUIRE);
+		if ((state & 1) && (state >> 1) != e)
+			return NULL;	/* a reader is still in an older epoch */
+	}
+
+	__atomic_store_n(&_global_epoch, e + 1, __ATOMIC_RELEASE);
+
+	/* the list of epoch e - 1 is the one which will receive epoch e + 2 */
+	reclaimable = _retired[(e + 2) % EPOCH_NLISTS];
+	_retired[(e + 2) % EPOCH_NLISTS] = NULL;
+	return reclaimable;
+}
+
+static void _retire(void *ptr,
+		    void (*free_fn)(void *),
+		    void (*free_arg_fn)(void *, void *),
+		    void *arg)
+{
+	epoch_retired_t *r = malloc(sizeof(epoch_retired_t));
+	epoch_retired_t *reclaimable = NULL;
+
+	if (!r) {
+		/* can't defer, wait until all current readers are gone */
+		pthread_mutex_lock(&_retire_lock);
+		unsigned long e = __atomic_load_n(&_global_epoch, __ATOMIC_RELAXED);
+		while (__atomic_load_n(&_global_epoch, __ATOMIC_RELAXED) < e + 2) {
+			_free_list(_try_advance());
+			sched_yield();
+		}
+		pthread_mutex_unlock(&_retire_lock);
+		if (free_fn)
+			free_fn(ptr);
+		else
+			free_arg_fn(ptr, arg);
+		return;
+	}
+	r->ptr = ptr;
+	r->free_fn = free_fn;
+	r->free_arg_fn = free_arg_fn;
+	r->arg = arg;
+
+	pthread_mutex_lock(&_retire_lock);
+	unsigned long e = __atomic_load_n(&_global_epoch, __ATOMIC_RELAXED);
+	r->next = _retired[e % EPOCH_NLISTS];
+	_retired[e % EPOCH_NLISTS] = r;
+	if (++_nretired >= EPOCH_RECLAIM_THRESHOLD) {
+		_nretired = 0;
+		reclaimable = _try_advance();
+	}
+	pthread_mutex_unlock(&_retire_lock);
+
+	/* free outside of the lock */
+	_free_list(reclaimable);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *))
+{
+	_retire(ptr, free_fn, NULL, NULL);
+}
+
+void epoch_retire_arg(void *ptr, void (*free_fn)(void *, void *), void *arg)
+{
+	_retire(ptr, NULL, free_fn, arg);
+}
+
+void epoch_reclaim(void)
+{
+	epoch_retired_t *reclaimable[EPOCH_NLISTS - 1] = { NULL };
+	int i;
+
+	if (pthread_mutex_trylock(&_retire_lock))
+		return;
+	for (i = 0; i < EPOCH_NLISTS && !_retired[i]; ++i)
+		;
+	/* two epochs later, everything retired so far can be freed, unless
+	 * readers hold the epoch back */
+	if (i < EPOCH_NLISTS) {
+		for (i = 0; i < EPOCH_NLISTS - 1; ++i)
+			reclaimable[i] = _try_advance();
+		_nretired = 0;
+	}
+	pthread_mutex_unlock(&_retire_lock);
+
+	for (i = 0; i < EPOCH_NLISTS - 1; ++i)
+		_free_list(reclaimable[i]);
+}
+
+void epoch_drain(void)
+{
+	int i;
+	pthread_mutex_lock(&_retire_lock);
+	for (i = 0; i < EPOCH_NLISTS; ++i) {
+		_free_list(_retired[i]);
+		_retired[i] = NULL;
+	}
+	_nretired = 0;
+	pthread_mutex_unlock(&_retire_lock);
+}
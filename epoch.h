@@ -0,0 +1,55 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+
+/* Epoch-based reclamation.
+ *
+ * Lock-free readers bracket their accesses to shared memory with
+ * epoch_enter()/epoch_exit(). Writers that unlink a piece of memory hand it to
+ * epoch_retire() instead of freeing it: it is freed once every thread that was
+ * inside a read section at the time of the retirement has left it.
+ *
+ * Readers never write to memory shared with other threads, only to their own
+ * (cache line aligned) thread record.
+ **/
+
+/* maximum number of threads simultaneously registered as readers */
+#define EPOCH_MAX_THREADS 1024
+
+/* enter a read section. Sections can be nested. Return false if the calling
+ * thread could not be registered (too many threads), in which case the caller
+ * must not access memory protected by epochs, and must not call epoch_exit */
+bool epoch_enter(void);
+
+/* leave a read section */
+void epoch_exit(void);
+
+/* read section which isn't bound to a thread */
+typedef struct epoch_thread_ epoch_pin_t;
+
+/* enter a read section that may be left from any thread, by passing the
+ * returned pin to epoch_unpin(). No retired memory is freed while a pin is
+ * held, so pins must be short-lived. Return NULL if no record is available
+ * (too many threads and pins) */
+epoch_pin_t *epoch_pin(void);
+
+/* leave the read section of a pin, and free the retired memory it held back */
+void epoch_unpin(epoch_pin_t *pin);
+
+/* defer the call of free_fn(ptr) until no reader can access ptr anymore */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/* same as epoch_retire, for memory released with free_fn(ptr, arg) */
+void epoch_retire_arg(void *ptr, void (*free_fn)(void *, void *), void *arg);
+
+/* free the retired memory no reader can access anymore. epoch_retire only
+ * does it every EPOCH_RECLAIM_THRESHOLD calls, this is for the times the
+ * retirements stop. It doesn't wait if another thread is reclaiming */
+void epoch_reclaim(void);
+
+/* immediately free all the retired memory. Only to be called when there's no
+ * reader left, e.g. on library deinitialization */
+void epoch_drain(void);
+
+#endif
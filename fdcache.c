@@ -1,73 +1,373 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <jemalloc/jemalloc.h>
 #include <assert.h>
+#include <sched.h>
+#include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include "epoch.h"
+#include "hugepage.h"
+#include "trace.h"
 #include "fdcache_internal.h"
 
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
 
-// TODO: ADD LOCKING when touching at the cache entries!!!!
-#define FREE_INODE ((cache_ino_t)-1)
-#define IN_RAM_CACHE ((size_t)-1)
+/* word type allowed to alias any buffer */
+typedef uint64_t __attribute__((may_alias)) fdc_word_t;
 
 
-fd_cache_entry_t _fd_cache[MAX_CACHE_ENTRIES];
+fdc_stripe_t _fd_cache[FDC_TABLE_STRIPES];
 size_t _ram_fs_limit;
 
-void fdc_init(size_t ram_fs_limit)
+/* directory of the spool files of spilled entries */
+static char *_spool_dir;
+static fdc_spill_io_t _spill_io;
+static size_t _spool_align;	/* O_DIRECT alignment, 0 if buffered */
+
+/* background writes of spilled clusters, unless FDC_IO_SYNC */
+static spool_io_t _spool_io;
+static bool _spool_async;
+
+/* pools of the small entries size classes */
+static cluster_pool_t *_small_pools[FDC_SMALL_NCLASSES];
+
+/* background flush of fully written clusters, if a sink is set */
+static fdc_sink_t _sink;
+static fdc_flush_policy_t _flush_policy;
+static flusher_t _flusher;
+static bool _flushing;
+static int _flush_error;	/* first push error since fdc_flush_wait */
+
+/* cluster map value of clusters freed after being flushed */
+static char _fdc_evicted;
+#define FDC_EVICTED ((void *) &_fdc_evicted)
+
+static void _fdc_flush_cluster(flusher_job_t *fj, void *arg);
+static size_t _fdc_spool_probe_align(void);
+
+/* fdc_stats counters, one set per CPU. A thread keeps using the set of the
+ * CPU it ran on when it last looked, sharing one after a migration is only
+ * slower */
+static fdc_counters_t _counters[FDC_STATS_SLOTS];
+static __thread unsigned int _counters_slot;
+static __thread unsigned int _counters_updates;
+
+static inline void _fdc_count(fdc_counter_t counter, int64_t n)
 {
-	memset(&_fd_cache, 0, sizeof(fd_cache_entry_t));
-	int i = 0;
-	for (; i < MAX_CACHE_ENTRIES; i++)
-		_fd_cache[i].ino = FREE_INODE;
-	_ram_fs_limit = ram_fs_limit;
+	if (!(_counters_updates++ % FDC_STATS_SLOT_REFRESH))
+		_counters_slot = (unsigned int) sched_getcpu() % FDC_STATS_SLOTS;
+	__atomic_add_fetch(&_counters[_counters_slot].v[counter], n, __ATOMIC_RELAXED);
 }
 
-gboolean _buf_map_free_cluster(gpointer cidx,
-			       gpointer cbuf,
-			       gpointer data)
+static bool _latency;
+static unsigned long _latency_generation;
+static fdc_latency_rec_t *_latency_recs;
+static pthread_mutex_t _latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread fdc_latency_rec_t *_latency_self;
+static pthread_key_t _latency_key;
+static pthread_once_t _latency_key_once = PTHREAD_ONCE_INIT;
+
+static void _fdc_latency_thread_exit(void *arg)
 {
-	/* free the cluster */
-	free((void*) cbuf);
-	return FALSE;
+	fdc_latency_rec_t *rec = (fdc_latency_rec_t *) arg;
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
 }
 
-void fdc_deinit()
+static void _fdc_latency_make_key(void)
+{
+	pthread_key_create(&_latency_key, _fdc_latency_thread_exit);
+}
+
+/* find a record for the calling thread, NULL if it can't be mapped */
+static fdc_latency_rec_t *_fdc_latency_register(void)
+{
+	fdc_latency_rec_t *rec;
+	int i;
+
+	pthread_once(&_latency_key_once, _fdc_latency_make_key);
+	pthread_mutex_lock(&_latency_lock);
+	for (rec = _latency_recs; rec; rec = rec->next) {
+		if (!__atomic_load_n(&rec->in_use, __ATOMIC_ACQUIRE))
+			break;
+	}
+	if (!rec) {
+		/* mapped, not to show up in the memory used by the cache */
+		rec = mmap(NULL, sizeof(fdc_latency_rec_t), PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (rec == MAP_FAILED) {
+			pthread_mutex_unlock(&_latency_lock);
+			return NULL;
+		}
+		for (i = 0; i < FDC_LATENCY_NOPS; ++i)
+			hist_reset(&rec->hists[i]);
+		rec->generation = _latency_generation;
+		rec->next = _latency_recs;
+		__atomic_store_n(&_latency_recs, rec, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&rec->in_use, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&_latency_lock);
+	pthread_setspecific(_latency_key, rec);
+	_latency_self = rec;
+	return rec;
+}
+
+/* start time of an operation whose latency is measured, 0 if disabled */
+static inline uint64_t _fdc_latency_start(void)
+{
+	struct timespec ts;
+
+	if (!__atomic_load_n(&_latency, __ATOMIC_RELAXED))
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _fdc_latency_end(fdc_latency_op_t op, uint64_t start)
+{
+	fdc_latency_rec_t *rec = _latency_self;
+	unsigned long generation;
+	struct timespec ts;
+	int i;
+
+	if (!start)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (!rec && !(rec = _fdc_latency_register()))
+		return;
+	generation = __atomic_load_n(&_latency_generation, __ATOMIC_ACQUIRE);
+	if (rec->generation != generation) {
+		for (i = 0; i < FDC_LATENCY_NOPS; ++i)
+			hist_reset(&rec->hists[i]);
+		__atomic_store_n(&rec->generation, generation, __ATOMIC_RELEASE);
+	}
+	hist_record(&rec->hists[op], ts.tv_sec * 1000000000ULL + ts.tv_nsec - start);
+}
+
+/* record the first flush (or background spill) error since the last fdc_flush_wait */
+static void _fdc_flush_error(int rc)
+{
+	int expected = 0;
+	__atomic_compare_exchange_n(&_flush_error, &expected, rc, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static inline fdc_stripe_t *_fdc_stripe(cache_ino_t ino)
+{
+	return &_fd_cache[ino % FDC_TABLE_STRIPES];
+}
+
+void fdc_options_init(fdc_options_t *opts)
+{
+	memset(opts, 0, sizeof(fdc_options_t));
+	opts->ram_fs_limit = (size_t) -1;
+	opts->pool_limit = FDC_DEFAULT_POOL_LIMIT;
+	opts->backend = FDC_BACKEND_MALLOC;
+	opts->sink = NULL;
+	opts->flush_threads = FDC_DEFAULT_FLUSH_THREADS;
+	opts->flush_policy = FDC_FLUSH_KEEP;
+	opts->spool_dir = NULL;
+	opts->spill_io = FDC_SPILL_PREAD;
+	opts->spool_direct = false;
+	opts->io_engine = FDC_IO_SYNC;
+}
+
+int fdc_init_opts(const fdc_options_t *opts)
 {
 	int i = 0;
-	for (; i < MAX_CACHE_ENTRIES; i++) {
-		fd_cache_entry_t *ent = &_fd_cache[i];
-		if (ent->ino != FREE_INODE) {
-			if (ent->location == IN_RAM_CACHE) {
-				if (ent->bitmap)
-					bitmap_free(ent->bitmap);
-
-				/* free allocated clusters */
-				g_tree_foreach(ent->u.ram.buf_map,
-					       _buf_map_free_cluster,
-					       NULL);
-				g_tree_destroy(ent->u.ram.buf_map);
-				ent->u.ram.buf_map = NULL;
-			} else {
-				/* TODO: to implement */
-			}
+	memset(_counters, 0, sizeof(_counters));
+	fdc_latency_reset();
+	for (; i < FDC_TABLE_STRIPES; i++) {
+		if (htable_init(&_fd_cache[i].table, FDC_INITIAL_ENTRIES)) {
+			while (--i >= 0)
+				htable_destroy(&_fd_cache[i].table);
+			return -ENOMEM;
+		}
+		pthread_mutex_init(&_fd_cache[i].lock, NULL);
+	}
+	_ram_fs_limit = opts->ram_fs_limit;
+	_spill_io = opts->spill_io;
+	if (opts->spool_dir)
+		_spool_dir = strdup(opts->spool_dir);
+	else if (getenv("TMPDIR"))
+		_spool_dir = strdup(getenv("TMPDIR"));
+	else
+		_spool_dir = strdup(FDC_DEFAULT_SPOOL_DIR);
+	if (!_spool_dir) {
+		fdc_deinit();
+		return -ENOMEM;
+	}
+	_spool_align = opts->spool_direct ? _fdc_spool_probe_align() : 0;
+	cpool_set_limit(opts->pool_limit);
+	cpool_set_align(_spool_align);
+	cpool_set_backend(opts->backend == FDC_BACKEND_HUGEPAGE ?
+			  CPOOL_BACKEND_HUGEPAGE : CPOOL_BACKEND_MALLOC);
+	for (i = 0; i < FDC_SMALL_NCLASSES; i++) {
+		_small_pools[i] = cpool_get(1UL << (i + FDC_SMALL_MIN_SHIFT));
+		if (!_small_pools[i]) {
+			fdc_deinit();
+			return -ENOMEM;
+		}
+	}
+	if (opts->io_engine != FDC_IO_SYNC) {
+		int rc = spool_io_init(&_spool_io, opts->io_engine == FDC_IO_URING ?
+				       SPOOL_IO_URING : SPOOL_IO_THREADS_ONLY);
+		if (rc) {
+			fdc_deinit();
+			return rc;
 		}
+		_spool_async = true;
+	}
+	if (opts->sink) {
+		int rc = -EINVAL;
+		if (opts->sink->push && opts->flush_threads)
+			rc = flusher_init(&_flusher, opts->flush_threads,
+					  _fdc_flush_cluster, NULL);
+		if (rc) {
+			fdc_deinit();
+			return rc;
+		}
+		_sink = *opts->sink;
+		_flush_policy = opts->flush_policy;
+		_flush_error = 0;
+		_flushing = true;
+	}
+	return 0;
+}
+
+void fdc_init(size_t ram_fs_limit)
+{
+	fdc_options_t opts;
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = ram_fs_limit;
+	int rc = fdc_init_opts(&opts);
+	assert(rc == 0);
+	(void) rc;
+}
+
+/* number of bytes allocated for cluster cidx, provided it's allocated. The
+ * first cluster of a small entry may be smaller than the cluster size */
+static inline size_t _fdc_ram_cluster_capacity(fd_cache_entry_t *ent, size_t cidx)
+{
+	/* clusters of spilled entries are all full size */
+	if (cidx == 0 && ent->location == IN_RAM_CACHE)
+		return ent->u.ram.cap0;
+	return ent->block_size * ent->blocks_per_cluster;
+}
+
+/* pool of the cluster buffers of `capacity` bytes, not for inline data */
+static inline cluster_pool_t *_fdc_ram_cluster_pool(fd_cache_entry_t *ent, size_t capacity)
+{
+	if (capacity == ent->block_size * ent->blocks_per_cluster)
+		return ent->pool;
+	return _small_pools[__builtin_ctzl(capacity) - FDC_SMALL_MIN_SHIFT];
+}
+
+/* allocate a cluster buffer from pool, accounted in the statistics */
+static void *_fdc_cbuf_alloc(cluster_pool_t *pool)
+{
+	const uint64_t start = _fdc_latency_start();
+	void *cbuf = cpool_alloc(pool);
+
+	_fdc_latency_end(FDC_LATENCY_ALLOC, start);
+	if (cbuf) {
+		_fdc_count(FDC_STAT_CLUSTERS_ALLOCATED, 1);
+		_fdc_count(FDC_STAT_RESIDENT, cpool_cluster_size(pool));
+	}
+	return cbuf;
+}
+
+static void _fdc_cbuf_free(cluster_pool_t *pool, void *cbuf)
+{
+	_fdc_count(FDC_STAT_CLUSTERS_FREED, 1);
+	_fdc_count(FDC_STAT_RESIDENT, -(int64_t) cpool_cluster_size(pool));
+	cpool_free(pool, cbuf);
+}
+
+/* epoch_retire_arg callback */
+static void _fdc_cbuf_release(void *cbuf, void *pool)
+{
+	_fdc_cbuf_free((cluster_pool_t *) pool, cbuf);
+}
+
+static void _fdc_ram_cluster_free(size_t cidx, void *cbuf, void *arg)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) arg;
+	if (cbuf != ent->u.ram.inline_data && cbuf != FDC_EVICTED)
+		_fdc_cbuf_free(_fdc_ram_cluster_pool(ent, _fdc_ram_cluster_capacity(ent, cidx)), cbuf);
+}
+
+/* epoch_retire callback */
+static void _fdc_spool_unmap(void *arg)
+{
+	fdc_spool_map_t *map = (fdc_spool_map_t *) arg;
+	munmap(map->addr, map->len);
+	free(map);
+}
+
+static void _fdc_entry_free(cache_ino_t ino, void *val, void *arg)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) val;
+	if (ent->bitmap)
+		bitmap_free(ent->bitmap);
+	if (ent->location == IN_FS_CACHE) {
+		if (ent->u.fs.map)
+			_fdc_spool_unmap(ent->u.fs.map);
+		/* spool I/O has been drained, there's no job left */
+		cmap_destroy(&ent->u.fs.pending, NULL);
+		close(ent->u.fs.fd);
 	}
-	memset(&_fd_cache, 0, sizeof(fd_cache_entry_t));
+
+	/* free allocated clusters, spilled entries only have evicted ones */
+	cmap_foreach(&ent->clusters, _fdc_ram_cluster_free, ent);
+	cmap_destroy(&ent->clusters, NULL);
+	pthread_rwlock_destroy(&ent->lock);
+	free(ent);
 }
 
-fd_cache_entry_t * __fdc_lookup(cache_ino_t ino, int *free_idx)
+void fdc_deinit()
 {
 	int i = 0;
-	*free_idx = -1;
-	for (; i < MAX_CACHE_ENTRIES; i++) {
-		if (_fd_cache[i].ino == ino)
-			return &_fd_cache[i];
-		else if (*free_idx == -1 && _fd_cache[i].ino == FREE_INODE)
-			*free_idx = i;
+	if (_flushing) {
+		flusher_destroy(&_flusher);
+		_flushing = false;
 	}
-	return NULL;
+	/* completions need the entries */
+	if (_spool_async) {
+		spool_io_destroy(&_spool_io);
+		_spool_async = false;
+	}
+	for (; i < FDC_TABLE_STRIPES; i++) {
+		htable_foreach(&_fd_cache[i].table, _fdc_entry_free, NULL);
+		htable_destroy(&_fd_cache[i].table);
+		pthread_mutex_destroy(&_fd_cache[i].lock);
+	}
+	/* no reader left, free retired cluster buffers */
+	epoch_drain();
+	cpool_destroy_all();
+	memset(_small_pools, 0, sizeof(_small_pools));
+	cpool_set_align(0);
+	free(_spool_dir);
+	_spool_dir = NULL;
+}
+
+fd_cache_entry_t * __fdc_lookup(cache_ino_t ino)
+{
+	fdc_stripe_t *stripe = _fdc_stripe(ino);
+	fd_cache_entry_t *ent;
+
+	_fdc_count(FDC_STAT_LOOKUPS, 1);
+	pthread_mutex_lock(&stripe->lock);
+	ent = (fd_cache_entry_t *) htable_lookup(&stripe->table, ino);
+	pthread_mutex_unlock(&stripe->lock);
+	return ent;
 }
 
 int fdc_get_or_create(
@@ -82,27 +382,37 @@ int fdc_get_or_create(
 	}
 
 	/* look for existing cache entry */
+	fdc_stripe_t *stripe = _fdc_stripe(ino);
 	fd_cache_entry_t * ent;
-	int free_idx = -1;
-	ent = __fdc_lookup(ino, &free_idx);
+
+	_fdc_count(FDC_STAT_LOOKUPS, 1);
+	pthread_mutex_lock(&stripe->lock);
+	ent = (fd_cache_entry_t *) htable_lookup(&stripe->table, ino);
 	if (ent) {
-		 *fd = (fd_cache_t) ent;
+		pthread_mutex_unlock(&stripe->lock);
+		*fd = (fd_cache_t) ent;
 		return 0;
 	}
 
-	/* create cache entry at the first free entry */
-	if (free_idx == -1)
-		return -ENFILE;
-
 	/* create new cache entry, in ram and empty */
-	ent = &_fd_cache[free_idx];
+	cluster_pool_t *pool = cpool_get(block_size * blocks_per_cluster);
+	ent = pool ? calloc(1, sizeof(fd_cache_entry_t)) : NULL;
+	if (!ent || htable_insert(&stripe->table, ino, ent)) {
+		pthread_mutex_unlock(&stripe->lock);
+		free(ent);
+		return -ENOMEM;
+	}
+	pthread_rwlock_init(&ent->lock, NULL);
 	ent->ino = ino;
 	ent->total_size = 0;
 	ent->location = IN_RAM_CACHE;
 	ent->block_size = block_size;
 	ent->blocks_per_cluster = blocks_per_cluster;
-	ent->u.ram.buf_map = g_tree_new (_key_cmp);
+	ent->pool = pool;
+	cmap_init(&ent->clusters);
 	ent->bitmap = 0; /* bitmap will be allocated at first write */
+	ent->pblock = (size_t) -1;
+	pthread_mutex_unlock(&stripe->lock);
 
 	*fd = (fd_cache_t) ent;
 	return 0;
@@ -112,11 +422,10 @@ int fdc_entry_size(cache_ino_t ino, size_t *nbytes)
 {
 	/* look for existing cache entry */
 	fd_cache_entry_t * ent;
-	int free_idx = -1;
-	ent = __fdc_lookup(ino, &free_idx);
+	ent = __fdc_lookup(ino);
 	if (!ent)
 		return -EFAULT;
-	*nbytes = ent->total_size;
+	*nbytes = __atomic_load_n(&ent->total_size, __ATOMIC_ACQUIRE);
 	return 0;
 }
 
@@ -124,29 +433,136 @@ int fdc_entry_mem(cache_ino_t ino, size_t *nbytes)
 {
 	/* look for existing cache entry */
 	fd_cache_entry_t * ent;
-	int free_idx = -1;
-	ent = __fdc_lookup(ino, &free_idx);
+	ent = __fdc_lookup(ino);
 	if (!ent)
 		return -EFAULT;
 
+	pthread_rwlock_rdlock(&ent->lock);
 	if (ent->location == IN_RAM_CACHE) {
 		const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
 		if (ent->total_size <= cluster_size) {
-			/* special case, entry holds on a single cluster */
-			*nbytes = ent->total_size;
+			/* special case, entry holds on a single cluster, which
+			 * may be a hole */
+			*nbytes = cmap_count(&ent->clusters) > ent->nevicted ?
+				  ent->total_size : 0;
 		} else {
 			/* count the number of allocated clusters */
-			size_t nclusters = g_tree_nnodes(ent->u.ram.buf_map);
+			size_t nclusters = cmap_count(&ent->clusters) - ent->nevicted;
 			*nbytes = nclusters * ent->block_size * ent->blocks_per_cluster;
 		}
 	} else {
-		/* Not implemented ! */
-		assert(0);
+		/* blocks allocated to the spool file, and resident clusters */
+		struct stat st;
+		*nbytes = fstat(ent->u.fs.fd, &st) ? 0 : st.st_blocks * 512;
+		*nbytes += (cmap_count(&ent->clusters) - ent->nevicted) *
+			   ent->block_size * ent->blocks_per_cluster;
 	}
+	pthread_rwlock_unlock(&ent->lock);
+
+	return 0;
+}
 
+int fdc_entry_stats(cache_ino_t ino, fdc_entry_stats_t *stats)
+{
+	fd_cache_entry_t *ent = __fdc_lookup(ino);
+	if (!ent)
+		return -EFAULT;
+	stats->bytes_written = __atomic_load_n(&ent->bytes_written, __ATOMIC_RELAXED);
+	stats->flushes = __atomic_load_n(&ent->flushes, __ATOMIC_RELAXED);
 	return 0;
 }
 
+static inline void _fdc_seq_write_begin(fd_cache_entry_t *ent)
+{
+	__atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void _fdc_seq_write_end(fd_cache_entry_t *ent)
+{
+	__atomic_store_n(&ent->seq, ent->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* allocate a buffer for cluster cidx holding at least `required` bytes, and
+ * set capacity to its actual size. The first cluster is stored inline, then in
+ * a small size class, before becoming a full cluster */
+static void *_fdc_ram_cluster_alloc(fd_cache_entry_t *ent,
+				    size_t cidx,
+				    size_t required,
+				    size_t *capacity)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+
+	if (cidx == 0 && required <= FDC_INLINE_SIZE) {
+		*capacity = FDC_INLINE_SIZE;
+		return ent->u.ram.inline_data;
+	}
+	if (cidx == 0 && required < cluster_size) {
+		/* round up to the next power of two */
+		unsigned int shift = 64 - __builtin_clzl(required - 1);
+		if (shift < FDC_SMALL_MIN_SHIFT)
+			shift = FDC_SMALL_MIN_SHIFT;
+		if (shift <= FDC_SMALL_MAX_SHIFT && (1UL << shift) < cluster_size) {
+			*capacity = 1UL << shift;
+			return _fdc_cbuf_alloc(_small_pools[shift - FDC_SMALL_MIN_SHIFT]);
+		}
+	}
+	*capacity = cluster_size;
+	return _fdc_cbuf_alloc(ent->pool);
+}
+
+/* make sure cluster cidx is allocated with at least `required` bytes, return
+ * its buffer or NULL if it can't be allocated. When the cluster grows, its
+ * current content is copied and the previous buffer is retired. The new bytes
+ * are zeroed, except in [wstart, wend) which the caller is about to write */
+static void *_fdc_ram_cluster_reserve(fd_cache_entry_t *ent,
+				      size_t cidx,
+				      size_t required,
+				      size_t wstart,
+				      size_t wend)
+{
+	void *cbuf = cmap_lookup(&ent->clusters, cidx);
+	const bool evicted = cbuf == FDC_EVICTED;
+	size_t capacity, newcapacity;
+	void *newcbuf;
+
+	if (evicted)
+		cbuf = NULL;
+	capacity = cbuf ? _fdc_ram_cluster_capacity(ent, cidx) : 0;
+	if (capacity >= required)
+		return cbuf;
+
+	newcbuf = _fdc_ram_cluster_alloc(ent, cidx, required, &newcapacity);
+	if (!newcbuf)
+		return NULL;
+	if (cbuf)
+		memcpy(newcbuf, cbuf, capacity);
+	/* holes read as zeros */
+	if (wstart < capacity)
+		wstart = capacity;
+	if (wend < wstart)
+		wend = wstart;
+	memset(newcbuf + capacity, 0, wstart - capacity);
+	memset(newcbuf + wend, 0, newcapacity - wend);
+	if (cmap_set(&ent->clusters, cidx, newcbuf)) {
+		if (newcbuf != ent->u.ram.inline_data)
+			_fdc_cbuf_free(_fdc_ram_cluster_pool(ent, newcapacity), newcbuf);
+		return NULL;
+	}
+	/* optimistic readers may still be copying from the inline data, but
+	 * it's never reused */
+	if (cbuf && cbuf != ent->u.ram.inline_data)
+		epoch_retire_arg(cbuf, _fdc_cbuf_release,
+				 _fdc_ram_cluster_pool(ent, capacity));
+	if (cbuf)
+		_fdc_count(FDC_STAT_REALLOCS, 1);
+	if (cidx == 0)
+		ent->u.ram.cap0 = newcapacity;
+	if (evicted)
+		ent->nevicted--;
+	return newcbuf;
+}
+
 ssize_t _fdc_ram_cluster_write(fd_cache_entry_t *ent,
 			       size_t cidx,
 			       const void *buf,
@@ -160,187 +576,1851 @@ ssize_t _fdc_ram_cluster_write(fd_cache_entry_t *ent,
 		return -EINVAL;
 	if (count + coff > cluster_size)
 		return -EOVERFLOW;
+	/* flushed and freed cluster, its content is gone unless it's entirely
+	 * rewritten */
+	if (count != cluster_size &&
+	    cmap_lookup(&ent->clusters, cidx) == FDC_EVICTED)
+		return -ENODATA;
 
-	/* retrieve the memory region corresponding to the cluster */
-	void *cbuf = g_tree_lookup(ent->u.ram.buf_map, (gpointer*) cidx);
-	if (cbuf == NULL) {
-		/* allocate the cluster memory. If the entry is made of a single
-		 * cluster, we just allocate the required memory, and not the
-		 * whole cluster */
-		cbuf = malloc(unique_cluster ? last_coff : cluster_size);
-		if (!cbuf)
-			return -ENOMEM;
-		g_tree_insert(ent->u.ram.buf_map, (gpointer*) cidx, cbuf);
-	}
-	if (unique_cluster && last_coff > ent->total_size) {
-		/* in case of single cluster entry, we may need to realloc if
-		 * not enough memory was allocated in previous writes */
-		void *newcbuf = realloc(cbuf, last_coff);
-		if (newcbuf != cbuf) {
-			/* memory was moved, update the buffer tree */
-			g_tree_insert(ent->u.ram.buf_map, (gpointer*) cidx, newcbuf);
-		}
-	}
+	/* retrieve the memory region corresponding to the cluster, allocate
+	 * or grow it if needed. If the entry is made of a single cluster, we
+	 * just reserve the required memory (see _fdc_ram_cluster_alloc), and
+	 * not the whole cluster */
+	void *cbuf = _fdc_ram_cluster_reserve(ent, cidx,
+					      unique_cluster ? last_coff : cluster_size,
+					      coff, last_coff);
+	if (!cbuf)
+		return -ENOMEM;
 	memcpy(cbuf + coff, buf, count);
 	return count;
 }
 
-ssize_t fdc_write(fd_cache_t fd,
-		  const void *buf,
-		  size_t count,
-		  off_t offset,
-		  ssize_t *full_cluster)
+/* return true if the count bytes starting at buf are all zeros. The bulk is
+ * checked a cache line at a time, OR-ing words together so that the compiler
+ * can vectorize the loop */
+static bool _fdc_is_zero(const void *buf, size_t count)
 {
-	fd_cache_entry_t *ent = (fd_cache_entry_t*)fd;
+	const unsigned char *p = buf;
+	const fdc_word_t *w;
 
-	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
-	const size_t last_offset = offset + count;
-	ssize_t rc;
-	size_t nwritten = 0;
+	for (; count && ((uintptr_t) p & (sizeof(fdc_word_t) - 1)); --count)
+		if (*p++)
+			return false;
+
+	for (w = (const fdc_word_t *) p; count >= 64; count -= 64, w += 8) {
+		if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+			return false;
+	}
+
+	for (p = (const unsigned char *) w; count; --count)
+		if (*p++)
+			return false;
+	return true;
+}
 
-	/* if it's the first write, we must allocate the bitmap */
+/* unmap cluster cidx, turning it into a hole */
+static void _fdc_ram_cluster_punch(fd_cache_entry_t *ent, size_t cidx)
+{
+	void *cbuf = cmap_lookup(&ent->clusters, cidx);
+	size_t capacity = _fdc_ram_cluster_capacity(ent, cidx);
+
+	if (!cbuf)
+		return;
+	/* unmapping never allocates, it can't fail */
+	cmap_set(&ent->clusters, cidx, NULL);
+	if (cbuf == FDC_EVICTED)
+		ent->nevicted--;
+	else if (cbuf != ent->u.ram.inline_data)
+		epoch_retire_arg(cbuf, _fdc_cbuf_release,
+				 _fdc_ram_cluster_pool(ent, capacity));
+	if (cidx == 0)
+		ent->u.ram.cap0 = 0;
+}
+
+/* make sure the written blocks bitmap holds at least nblocks bits. It grows
+ * geometrically, in whole clusters so that _fdc_full_clusters can check the
+ * last one, and new bits are reset */
+static int _fdc_bitmap_reserve(fd_cache_entry_t *ent, size_t nblocks)
+{
+	const size_t bpc = ent->blocks_per_cluster;
+	size_t len = bitmap_length(ent->bitmap);
+	size_t newlen;
+
+	if (len >= nblocks)
+		return 0;
+	newlen = len * 2 > nblocks ? len * 2 : nblocks;
+	newlen = DIV_ROUND_UP(newlen, bpc) * bpc;
 	if (!ent->bitmap) {
-		ent->bitmap = bitmap_alloc(DIV_ROUND_UP(last_offset, ent->block_size));
+		ent->bitmap = bitmap_alloc(newlen);
+		if (!ent->bitmap)
+			return -ENOMEM;
 		bitmap_zero(ent->bitmap);
+		return 0;
 	}
+	return bitmap_realloc(ent->bitmap, newlen);
+}
 
-	if (ent->location == IN_RAM_CACHE) {
-		/* compute indices of first and last clusters to write to */
-		size_t cidx = offset / cluster_size;
-		const size_t last_cidx = last_offset / cluster_size;
+/* account bytes [lo, hi) of block blk as written. Partially written blocks
+ * are tracked one at a time, which is enough to catch a block filled by
+ * consecutive unaligned writes, e.g. small appends */
+static void _fdc_bitmap_mark_partial(fd_cache_entry_t *ent, size_t blk,
+				     size_t lo, size_t hi)
+{
+	if (ent->pblock == blk && lo <= ent->pblock_hi && hi >= ent->pblock_lo) {
+		lo = lo < ent->pblock_lo ? lo : ent->pblock_lo;
+		hi = hi > ent->pblock_hi ? hi : ent->pblock_hi;
+	}
+	if (lo == 0 && hi == ent->block_size) {
+		bitmap_set(ent->bitmap, blk);
+		ent->pblock = (size_t) -1;
+		return;
+	}
+	ent->pblock = blk;
+	ent->pblock_lo = lo;
+	ent->pblock_hi = hi;
+}
 
-		/* compute offset for first cluster to write to */
-		off_t coff = offset % cluster_size;
+/* mark the blocks of [offset, offset + count) as written, count must not be
+ * 0 */
+static void _fdc_bitmap_mark(fd_cache_entry_t *ent, size_t offset, size_t count)
+{
+	const size_t bs = ent->block_size;
+	const size_t end = offset + count;
+	const size_t hblk = offset / bs;		/* head block */
+	const size_t tblk = (end - 1) / bs;		/* tail block */
+	size_t first = hblk, last = tblk;	/* fully written blocks */
 
-		/* number of bytes remaining to be written */
-		size_t nremain = count;
-		size_t ccount; /* number of bytes to write to current cluster */
+	if (offset % bs || (hblk == tblk && end - hblk * bs < bs)) {
+		_fdc_bitmap_mark_partial(ent, hblk, offset % bs,
+					 hblk == tblk ? end - hblk * bs : bs);
+		first++;
+	}
+	if (tblk != hblk && end % bs) {
+		_fdc_bitmap_mark_partial(ent, tblk, 0, end % bs);
+		last--;
+	}
+	if (first <= last)
+		bitmap_set_range(ent->bitmap, first, last - first + 1);
+}
 
-		for (; cidx <= last_cidx; ++cidx) {
+/* report the clusters touched by [offset, offset + count) which are now
+ * fully written. They are consecutive, since the clusters in between the
+ * first and the last one have just been entirely written */
+static void _fdc_full_clusters(fd_cache_entry_t *ent, size_t offset,
+			       size_t count, ssize_t *full_cluster,
+			       size_t *nfull)
+{
+	const size_t bpc = ent->blocks_per_cluster;
+	const size_t cluster_size = ent->block_size * bpc;
+	size_t first = offset / cluster_size;
+	size_t last = (offset + count - 1) / cluster_size;
 
-			/* compute count for current cluster */
-			ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+	if (!bitmap_get_range(ent->bitmap, first * bpc, bpc))
+		first++;
+	if (last >= first && !bitmap_get_range(ent->bitmap, last * bpc, bpc))
+		last--;
+	if (last + 1 > first) {
+		if (full_cluster)
+			*full_cluster = first;
+		if (nfull)
+			*nfull = last - first + 1;
+	}
+}
 
-			printf("_fdc_ram_cluster_write: cidx=%lu buf=buf+0x%lu ccount=%lu coff=%lu\n",
-			       cidx, last_offset - nremain, ccount, coff);
+/* create a spool file, unlinked right away, opened with O_DIRECT if align
+ * isn't 0. Return its descriptor or a negative errno value */
+static int _fdc_spool_open(size_t align)
+{
+	char path[PATH_MAX];
+	int fd;
 
-			rc = _fdc_ram_cluster_write(ent, cidx, buf + (count - nremain), ccount, coff, last_cidx == 0);
-			if (rc < 0)
-				return rc;
-			nwritten += rc;
+	fd = open(_spool_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		/* O_TMPFILE isn't supported by every filesystem */
+		if (snprintf(path, sizeof(path), "%s/fdcache.XXXXXX", _spool_dir) >= sizeof(path))
+			return -ENAMETOOLONG;
+		fd = mkostemp(path, O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+		unlink(path);
+	}
+	if (align && fcntl(fd, F_SETFL, O_DIRECT)) {
+		int rc = -errno;
+		close(fd);
+		return rc;
+	}
+	return fd;
+}
 
-			/* prepare for writing to next cluster */
-			coff = 0;
-			nremain -= ccount;
+/* O_DIRECT alignment of spool files, the largest of the memory and file offset
+ * alignments, or 0 if the spool filesystem doesn't support O_DIRECT */
+static size_t _fdc_spool_probe_align(void)
+{
+	size_t align = 0;
+	int fd = _fdc_spool_open(1);
 
-			if (nremain == 0)
-				break;
-		}
-		/* update total size */
-		if (ent->total_size < last_offset)
-			ent->total_size = last_offset;
-	} else {
-		/* directly write to filesystem */
+	if (fd < 0)
+		return 0;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+	if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) &&
+	    (stx.stx_mask & STATX_DIOALIGN)) {
+		/* 0 if O_DIRECT isn't supported after all */
+		align = stx.stx_dio_mem_align > stx.stx_dio_offset_align ?
+			stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+		close(fd);
+		return align;
 	}
-
-	return nwritten;
+#endif
+	/* no way to know, the page size fits every common device */
+	align = sysconf(_SC_PAGESIZE);
+	close(fd);
+	return align;
 }
 
-ssize_t _fdc_ram_cluster_read(fd_cache_entry_t *ent,
-		              size_t cidx,
-			      void *buf,
-			      size_t count,
-			      off_t coff)
+/* write count bytes at offset of a spool file, return 0 or a negative errno
+ * value */
+static int _fdc_spool_pwrite_all(int fd, const void *buf, size_t count, off_t offset)
 {
-	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
-	if (coff < 0 || coff > cluster_size)
-		return -EINVAL;
-	if (count + coff > cluster_size)
-		return -EOVERFLOW;
+	while (count) {
+		ssize_t n = pwrite(fd, buf, count, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		buf += n;
+		count -= n;
+		offset += n;
+	}
+	return 0;
+}
 
-	/* retrieve the memory region corresponding to the cluster */
-	void *clusterbuf = g_tree_lookup(ent->u.ram.buf_map, (gpointer*) cidx);
-	if (clusterbuf == NULL) {
-		return -EFAULT;
+/* read count bytes at offset of a spool file, what's past its end reads as
+ * zeros. With O_DIRECT (align isn't 0), a transfer ending off a block boundary
+ * is the end of the file. Return 0 or a negative errno value */
+static int _fdc_spool_pread_all(int fd, size_t align, void *buf, size_t count, off_t offset)
+{
+	while (count) {
+		ssize_t n = pread(fd, buf, count, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0 || (align && n % align)) {
+			memset(buf + n, 0, count - n);
+			break;
+		}
+		buf += n;
+		count -= n;
+		offset += n;
 	}
-	memcpy(buf, clusterbuf + coff, count);
-	return count;
+	return 0;
 }
 
-ssize_t fdc_read(fd_cache_t fd,
-		 void *buf,
-		 size_t count,
-		 off_t offset)
+/* allocate the bounce buffer of an O_DIRECT transfer, its size is returned in
+ * size */
+static void *_fdc_spool_bounce(size_t align, size_t *size)
 {
-	fd_cache_entry_t *ent = (fd_cache_entry_t*)fd;
+	void *bounce;
 
-	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
-	const size_t last_offset = offset + count > ent->total_size ?
-				   ent->total_size : offset + count;
-	size_t nread = 0;
-	ssize_t rc;
+	*size = align > FDC_SPOOL_BOUNCE_SIZE ? align : FDC_SPOOL_BOUNCE_SIZE;
+	if (posix_memalign(&bounce, align, *size))
+		return NULL;
+	return bounce;
+}
 
-	if (offset < 0 || offset > ent->total_size)
-		return -EINVAL;
+/* write count bytes at offset of a spool file opened with O_DIRECT if align
+ * isn't 0. Aligned parts go straight from buf, partial blocks are
+ * read-modified-written through a bounce buffer, as well as parts of buf that
+ * aren't aligned in memory. Return 0 or a negative errno value */
+static int _fdc_spool_pwrite(int fd, size_t align, const void *buf, size_t count, off_t offset)
+{
+	void *bounce = NULL;
+	size_t bounce_size = 0;
+	int rc = 0;
 
-	if (count + offset > ent->total_size)
-		return -EOVERFLOW;
+	if (!align)
+		return _fdc_spool_pwrite_all(fd, buf, count, offset);
 
-	if (ent->location == IN_RAM_CACHE) {
-		if (offset < ent->total_size) {
-			/* compute indices of first and last clusters to read from */
-			size_t cidx = offset / cluster_size;
-			const size_t last_cidx = last_offset / cluster_size;
+	while (!rc && count) {
+		const size_t head = offset % align;
+		size_t span, len;
 
-			/* compute offset for first cluster to read from */
-			off_t coff = offset % cluster_size;
+		if (!head && count >= align && !((uintptr_t) buf % align)) {
+			len = count - count % align;
+			rc = _fdc_spool_pwrite_all(fd, buf, len, offset);
+			buf += len;
+			count -= len;
+			offset += len;
+			continue;
+		}
 
-			/* number of bytes remaining to read */
-			size_t nremain = count;
-			size_t ccount; /* number of bytes to read from current cluster */
+		if (!bounce && !(bounce = _fdc_spool_bounce(align, &bounce_size)))
+			return -ENOMEM;
+		len = bounce_size - head > count ? count : bounce_size - head;
+		span = DIV_ROUND_UP(head + len, align) * align;
+		/* only the edge blocks have to be read */
+		if (head)
+			rc = _fdc_spool_pread_all(fd, align, bounce, align, offset - head);
+		if (!rc && (head + len) % align && (span > align || !head))
+			rc = _fdc_spool_pread_all(fd, align, bounce + span - align,
+						  align, offset - head + span - align);
+		if (rc)
+			break;
+		memcpy(bounce + head, buf, len);
+		rc = _fdc_spool_pwrite_all(fd, bounce, span, offset - head);
+		buf += len;
+		count -= len;
+		offset += len;
+	}
+	free(bounce);
+	return rc;
+}
 
-			for (; cidx <= last_cidx; ++cidx) {
+/* read count bytes at offset of a spool file opened with O_DIRECT if align
+ * isn't 0, what's past its end reads as zeros. Partial blocks and parts of buf
+ * that aren't aligned in memory go through a bounce buffer. Return 0 or a
+ * negative errno value */
+static int _fdc_spool_pread(int fd, size_t align, void *buf, size_t count, off_t offset)
+{
+	void *bounce = NULL;
+	size_t bounce_size = 0;
+	int rc = 0;
 
-				/* compute count for current cluster */
-				ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+	if (!align)
+		return _fdc_spool_pread_all(fd, 0, buf, count, offset);
 
-				printf("_fdc_ram_cluster_read: cidx=%lu buf=buf+0x%lu ccount=%lu coff=%lu\n",
-				       cidx, last_offset - nremain, ccount, coff);
+	while (!rc && count) {
+		const size_t head = offset % align;
+		size_t span, len;
 
-				rc = _fdc_ram_cluster_read(ent, cidx, buf + (count - nremain), ccount, coff);
-				if (rc < 0)
-					return rc;
-				nread += rc;
+		if (!head && count >= align && !((uintptr_t) buf % align)) {
+			len = count - count % align;
+			rc = _fdc_spool_pread_all(fd, align, buf, len, offset);
+		} else {
+			if (!bounce && !(bounce = _fdc_spool_bounce(align, &bounce_size)))
+				return -ENOMEM;
+			len = bounce_size - head > count ? count : bounce_size - head;
+			span = DIV_ROUND_UP(head + len, align) * align;
+			rc = _fdc_spool_pread_all(fd, align, bounce, span, offset - head);
+			if (!rc)
+				memcpy(buf, bounce + head, len);
+		}
+		buf += len;
+		count -= len;
+		offset += len;
+	}
+	free(bounce);
+	return rc;
+}
 
-				/* prepare for writing to next cluster */
-				coff = 0;
-				nremain -= ccount;
+/* turn count bytes at offset of a spool file into a hole */
+static int _fdc_spool_punch(int fd, size_t align, size_t count, off_t offset)
+{
+	static const char zeros[4096];
+	int rc;
 
-				if (nremain == 0)
-					break;
-			}
+	if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, count))
+		return 0;
+	if (errno != EOPNOTSUPP)
+		return -errno;
+	/* no hole punching, at least it reads as zeros */
+	for (rc = 0; !rc && count; ) {
+		size_t n = count > sizeof(zeros) ? sizeof(zeros) : count;
+		rc = _fdc_spool_pwrite(fd, align, zeros, n, offset);
+		count -= n;
+		offset += n;
+	}
+	return rc;
+}
 
-		} else if (offset == ent->total_size) {
-			/* as pread, 0 means end-of-file and is not an error */
-			return 0;
+/* spool I/O completion of a resident cluster. Once it's safely in the spool
+ * file, its buffer is released, unless it was written meanwhile in which case
+ * it's written again */
+static void _fdc_spill_done(spool_io_req_t *req, int res)
+{
+	fdc_spill_job_t *job = (fdc_spill_job_t *) req;
+	fd_cache_entry_t *ent = job->ent;
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	void *cbuf;
 
-		} else if (offset > ent->total_size) {
-			/* offset out of bounds */
-			return -EFAULT;
-		}
+	pthread_rwlock_wrlock(&ent->lock);
+	cbuf = cmap_lookup(&ent->clusters, job->cidx);
+	if (!res && job->dirty) {
+		job->dirty = false;
+		job->req.buf = cbuf;
+		job->req.len = cluster_size;
+		job->req.off = job->cidx * cluster_size;
+		spool_io_submit(&_spool_io, &job->req);
+		pthread_rwlock_unlock(&ent->lock);
+		return;
+	}
+	cmap_set(&ent->u.fs.pending, job->cidx, NULL);
+	if (res) {
+		/* it stays in RAM */
+		_fdc_flush_error(res);
 	} else {
-		/* not implemented */
-		assert(0);
+		/* readers now find the same data in the spool file */
+		cmap_set(&ent->clusters, job->cidx, NULL);
+		epoch_retire_arg(cbuf, _fdc_cbuf_release, ent->pool);
 	}
-	return nread;
+	pthread_rwlock_unlock(&ent->lock);
+	free(job);
 }
 
-gint _key_cmp (gconstpointer a, gconstpointer b)
+/* background write of resident cluster cidx of a spilled entry to its spool
+ * file. job may be NULL, to be allocated here. If anything fails, the cluster
+ * just stays in RAM. Entry lock must be held for writing */
+static void _fdc_spill_submit(fd_cache_entry_t *ent, size_t cidx, fdc_spill_job_t *job)
 {
-	if (a < b)
-		return -1;
-	else if (a > b)
-		return 1;
-	return 0;
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+
+	if (!job)
+		job = malloc(sizeof(fdc_spill_job_t));
+	if (!job || cmap_set(&ent->u.fs.pending, cidx, job)) {
+		free(job);
+		return;
+	}
+	job->ent = ent;
+	job->cidx = cidx;
+	job->dirty = false;
+	job->req.op = SPOOL_IO_WRITE;
+	job->req.fd = ent->u.fs.fd;
+	job->req.buf = cmap_lookup(&ent->clusters, cidx);
+	job->req.len = cluster_size;
+	job->req.off = cidx * cluster_size;
+	job->req.buf_index = -1;
+	job->req.done = _fdc_spill_done;
+	spool_io_submit(&_spool_io, &job->req);
 }
 
+typedef struct fdc_spill_state_ {
+	size_t *cidxs;
+	size_t n;
+} fdc_spill_state_t;
+
+static void _fdc_spill_collect(size_t cidx, void *cbuf, void *arg)
+{
+	fdc_spill_state_t *st = (fdc_spill_state_t *) arg;
+	if (cbuf != FDC_EVICTED)
+		st->cidxs[st->n++] = cidx;
+}
+
+/* make sure the mapping of the spool file of a spilled entry covers `size`
+ * bytes. Mappings grow geometrically, the previous one is retired since
+ * optimistic readers may still be copying from it. If the file can't be
+ * mapped, the entry falls back to pread */
+static void _fdc_spool_map(fd_cache_entry_t *ent, size_t size)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	fdc_spool_map_t *map = ent->u.fs.map, *newmap;
+	size_t len;
+
+	if (map && map->len >= size)
+		return;
+	len = map && map->len * 2 > size ? map->len * 2 : size;
+	len = DIV_ROUND_UP(len, page_size) * page_size;
+
+	newmap = malloc(sizeof(fdc_spool_map_t));
+	if (newmap) {
+		/* pages past the end of the file are never accessed */
+		newmap->addr = mmap(NULL, len, PROT_READ, MAP_SHARED, ent->u.fs.fd, 0);
+		newmap->len = len;
+		if (newmap->addr == MAP_FAILED) {
+			free(newmap);
+			newmap = NULL;
+		} else {
+			madvise(newmap->addr, len, MADV_SEQUENTIAL);
+		}
+	}
+	__atomic_store_n(&ent->u.fs.map, newmap, __ATOMIC_RELEASE);
+	if (map)
+		epoch_retire(map, _fdc_spool_unmap);
+}
+
+/* move a RAM entry to a spool file, entry lock must be held for writing. Its
+ * clusters are written (holes are left as holes) and retired, evicted clusters
+ * stay in the cluster map. On error the entry is left in RAM */
+static int _fdc_spill(fd_cache_entry_t *ent)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const size_t nclusters = cmap_count(&ent->clusters) - ent->nevicted;
+	const size_t align = _spool_align && cluster_size % _spool_align == 0 ? _spool_align : 0;
+	size_t *cidxs = malloc((nclusters ? nclusters : 1) * sizeof(size_t));
+	fdc_spill_job_t **jobs = calloc(nclusters ? nclusters : 1, sizeof(fdc_spill_job_t *));
+	fdc_spill_state_t st = { .cidxs = cidxs, .n = 0 };
+	size_t i, n;
+	int fd = -ENOMEM, rc = 0;
+
+	if (cidxs && jobs)
+		fd = _fdc_spool_open(align);
+	if (fd < 0) {
+		free(cidxs);
+		free(jobs);
+		return fd;
+	}
+
+	/* the cluster map can't be modified while it's walked, collect the
+	 * indices of the clusters to move first */
+	cmap_foreach(&ent->clusters, _fdc_spill_collect, &st);
+	n = st.n;
+	for (i = 0; !rc && i < n; ++i) {
+		const size_t capacity = _fdc_ram_cluster_capacity(ent, cidxs[i]);
+		size_t nbytes = ent->total_size - cidxs[i] * cluster_size;
+
+		/* full clusters are written in the background, they stay in
+		 * RAM meanwhile */
+		if (_spool_async && capacity == cluster_size) {
+			jobs[i] = malloc(sizeof(fdc_spill_job_t));
+			if (jobs[i])
+				continue;
+		}
+		if (nbytes > capacity)
+			nbytes = capacity;
+		rc = _fdc_spool_pwrite(fd, align, cmap_lookup(&ent->clusters, cidxs[i]),
+				       nbytes, cidxs[i] * cluster_size);
+	}
+	if (!rc && ftruncate(fd, ent->total_size))
+		rc = -errno;
+	FDC_TRACE(TRACE_INFO, TRACE_SPILL, ent->ino, ent->total_size, rc, 0);
+	if (rc) {
+		close(fd);
+		for (i = 0; i < n; ++i)
+			free(jobs[i]);
+		free(jobs);
+		free(cidxs);
+		return rc;
+	}
+
+	/* written clusters go before the RAM part of the entry is overwritten,
+	 * the capacity of the first one depends on it */
+	for (i = 0; i < n; ++i) {
+		void *cbuf = cmap_lookup(&ent->clusters, cidxs[i]);
+		if (jobs[i])
+			continue;
+		cmap_set(&ent->clusters, cidxs[i], NULL);
+		if (cbuf != ent->u.ram.inline_data)
+			epoch_retire_arg(cbuf, _fdc_cbuf_release,
+					 _fdc_ram_cluster_pool(ent, _fdc_ram_cluster_capacity(ent, cidxs[i])));
+	}
+	ent->u.fs.fd = fd;
+	ent->u.fs.map = NULL;
+	cmap_init(&ent->u.fs.pending);
+	ent->u.fs.tail = (size_t) -1;
+	ent->u.fs.align = align;
+	for (i = 0; i < n; ++i) {
+		if (jobs[i])
+			_fdc_spill_submit(ent, cidxs[i], jobs[i]);
+	}
+	free(jobs);
+	free(cidxs);
+	/* a mapping would bring the page cache back */
+	if (_spill_io == FDC_SPILL_MMAP && !align && ent->total_size)
+		_fdc_spool_map(ent, ent->total_size);
+	__atomic_store_n(&ent->location, IN_FS_CACHE, __ATOMIC_RELEASE);
+	/* the entry went over the RAM limit, give its clusters back now */
+	epoch_reclaim();
+	return 0;
+}
+
+/* write-back of a cluster past the end of a spilled entry, it's made resident
+ * in a fresh buffer and written to the spool file in the background once the
+ * writer moves on to another cluster. Return NULL if it can't be allocated */
+static void *_fdc_fs_resident(fd_cache_entry_t *ent,
+			      size_t cidx,
+			      const void *buf,
+			      size_t count,
+			      off_t coff)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	void *cbuf = _fdc_cbuf_alloc(ent->pool);
+
+	if (!cbuf)
+		return NULL;
+	memset(cbuf, 0, coff);
+	memcpy(cbuf + coff, buf, count);
+	memset(cbuf + coff + count, 0, cluster_size - coff - count);
+	if (cmap_set(&ent->clusters, cidx, cbuf)) {
+		_fdc_cbuf_free(ent->pool, cbuf);
+		return NULL;
+	}
+	if (ent->u.fs.tail != (size_t) -1)
+		_fdc_spill_submit(ent, ent->u.fs.tail, NULL);
+	ent->u.fs.tail = cidx;
+	return cbuf;
+}
+
+/* fdc_write body for spilled entries. Evicted clusters can only be entirely
+ * rewritten, zeros covering a whole cluster are punched out of the spool file,
+ * and zeros past its end are not written at all */
+static ssize_t _fdc_fs_write(fd_cache_entry_t *ent,
+			     const void *buf,
+			     size_t count,
+			     off_t offset)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const size_t last_offset = offset + count;
+	size_t cidx = offset / cluster_size;
+	off_t coff = offset % cluster_size;
+	size_t nremain = count;
+	bool extend = false;
+	int rc;
+
+	FDC_TRACE(TRACE_DEBUG, TRACE_FS_WRITE, ent->ino, offset, count, 0);
+
+	for (; nremain; ++cidx) {
+		const size_t ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+		const void *cdata = buf + (count - nremain);
+		const off_t pos = offset + (count - nremain);
+		void *cbuf = cmap_lookup(&ent->clusters, cidx);
+		const bool evicted = cbuf == FDC_EVICTED;
+
+		if (evicted && ccount != cluster_size)
+			return -ENODATA;
+
+		if (cbuf && !evicted) {
+			/* resident cluster, its pending spool write has to be
+			 * done again */
+			fdc_spill_job_t *job = cmap_lookup(&ent->u.fs.pending, cidx);
+			memcpy(cbuf + coff, cdata, ccount);
+			if (job)
+				job->dirty = true;
+			extend = true;
+			rc = 0;
+		} else if (pos >= ent->total_size && _fdc_is_zero(cdata, ccount)) {
+			extend = true;
+			rc = 0;
+		} else if (_spool_async && !evicted && cidx * cluster_size >= ent->total_size &&
+			   _fdc_fs_resident(ent, cidx, cdata, ccount, coff)) {
+			extend = true;
+			rc = 0;
+		} else if (ccount == cluster_size && _fdc_is_zero(cdata, ccount)) {
+			/* the hole is punched without changing the file size */
+			if (pos + ccount > ent->total_size)
+				extend = true;
+			rc = _fdc_spool_punch(ent->u.fs.fd, ent->u.fs.align, ccount, pos);
+		} else {
+			extend = false;
+			rc = _fdc_spool_pwrite(ent->u.fs.fd, ent->u.fs.align, cdata, ccount, pos);
+		}
+		if (rc)
+			return rc;
+		if (evicted) {
+			cmap_set(&ent->clusters, cidx, NULL);
+			ent->nevicted--;
+		}
+		coff = 0;
+		nremain -= ccount;
+	}
+	/* trailing zeros were skipped, or the tail is still in RAM, the file
+	 * must cover total_size anyway */
+	if (extend && ent->total_size < last_offset &&
+	    ftruncate(ent->u.fs.fd, last_offset))
+		return -errno;
+	return count;
+}
+
+/* copy count bytes at offset of the spool file to buf, from map if it's not
+ * NULL */
+static int _fdc_fs_copy_file(fd_cache_entry_t *ent,
+			     const fdc_spool_map_t *map,
+			     void *buf,
+			     size_t count,
+			     off_t offset)
+{
+	if (!count)
+		return 0;
+	if (map) {
+		memcpy(buf, map->addr + offset, count);
+		return 0;
+	}
+	return _fdc_spool_pread(ent->u.fs.fd, ent->u.fs.align, buf, count, offset);
+}
+
+/* fdc_read body for spilled entries, arguments have been checked. Resident
+ * clusters are copied from their buffer, the rest from the spool file, through
+ * map if it's not NULL. With a mapping, it can run in an epoch read section */
+static ssize_t _fdc_fs_read(fd_cache_entry_t *ent,
+			    const fdc_spool_map_t *map,
+			    void *buf,
+			    size_t count,
+			    off_t offset)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const size_t end = offset + count;
+	size_t pos = offset;
+	size_t run = offset;	/* start of the range to read from the file */
+	int rc;
+
+	FDC_TRACE(TRACE_DEBUG, TRACE_FS_READ, ent->ino, offset, count, 0);
+
+	while (pos < end) {
+		const size_t coff = pos % cluster_size;
+		const size_t ccount = cluster_size - coff > end - pos ? end - pos : cluster_size - coff;
+		const void *cbuf = cmap_lookup(&ent->clusters, pos / cluster_size);
+
+		if (cbuf == FDC_EVICTED)
+			return -ENODATA;
+		if (cbuf) {
+			rc = _fdc_fs_copy_file(ent, map, buf + (run - offset), pos - run, run);
+			if (rc)
+				return rc;
+			memcpy(buf + (pos - offset), cbuf + coff, ccount);
+			run = pos + ccount;
+		}
+		pos += ccount;
+	}
+	rc = _fdc_fs_copy_file(ent, map, buf + (run - offset), end - run, run);
+	return rc ? rc : count;
+}
+
+/* replace the buffer of flushed cluster cidx with FDC_EVICTED, or punch it out
+ * of the spool file of a spilled entry. Holes in RAM stay holes, they don't
+ * hold memory anyway */
+static void _fdc_cluster_evict(fd_cache_entry_t *ent, size_t cidx)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	void *cbuf = cmap_lookup(&ent->clusters, cidx);
+	size_t capacity;
+
+	FDC_TRACE(TRACE_DEBUG, TRACE_EVICT, ent->ino, cidx, 0, 0);
+	if (ent->location == IN_FS_CACHE) {
+		/* resident clusters aren't in the spool file yet. On failure,
+		 * the cluster simply stays in the spool file */
+		if (cbuf || cmap_set(&ent->clusters, cidx, FDC_EVICTED))
+			return;
+		_fdc_spool_punch(ent->u.fs.fd, ent->u.fs.align, cluster_size, cidx * cluster_size);
+		ent->nevicted++;
+		return;
+	}
+
+	capacity = _fdc_ram_cluster_capacity(ent, cidx);
+	if (!cbuf || cbuf == FDC_EVICTED)
+		return;
+	/* the slot exists, this can't fail */
+	cmap_set(&ent->clusters, cidx, FDC_EVICTED);
+	if (cbuf != ent->u.ram.inline_data)
+		epoch_retire_arg(cbuf, _fdc_cbuf_release,
+				 _fdc_ram_cluster_pool(ent, capacity));
+	if (cidx == 0)
+		ent->u.ram.cap0 = 0;
+	ent->nevicted++;
+}
+
+/* queue nclusters clusters starting at cidx for flushing. Entry lock must be
+ * held for writing */
+static void _fdc_flush_queue(fd_cache_entry_t *ent, size_t cidx, size_t nclusters)
+{
+	for (; nclusters; --nclusters, ++cidx) {
+		fdc_flush_job_t *job = malloc(sizeof(fdc_flush_job_t));
+		if (!job) {
+			/* the cluster stays in RAM */
+			_fdc_flush_error(-ENOMEM);
+			return;
+		}
+		job->ent = ent;
+		job->cidx = cidx;
+		job->dirty = false;
+		if (_flush_policy == FDC_FLUSH_FREE) {
+			job->next = ent->flushing;
+			ent->flushing = job;
+		}
+		flusher_submit(&_flusher, &job->job);
+	}
+}
+
+/* mark queued jobs of clusters first to last as dirty. Entry lock must be held
+ * for writing */
+static void _fdc_flush_dirty(fd_cache_entry_t *ent, size_t first, size_t last)
+{
+	fdc_flush_job_t *job;
+	for (job = ent->flushing; job; job = job->next) {
+		if (job->cidx >= first && job->cidx <= last)
+			job->dirty = true;
+	}
+}
+
+/* push cluster cidx of a spilled entry to the sink, entry lock must be held */
+static int _fdc_flush_spilled(fd_cache_entry_t *ent, size_t cidx)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	void *cbuf = cpool_alloc(ent->pool);
+	int rc;
+
+	if (!cbuf)
+		return -ENOMEM;
+	rc = _fdc_spool_pread(ent->u.fs.fd, ent->u.fs.align, cbuf, cluster_size,
+			      cidx * cluster_size);
+	if (!rc)
+		rc = _sink.push(_sink.arg, ent->ino, cidx,
+				_fdc_is_zero(cbuf, cluster_size) ? NULL : cbuf,
+				cluster_size);
+	cpool_free(ent->pool, cbuf);
+	return rc;
+}
+
+/* flusher handler, push a cluster to the sink, then free it if required */
+static void _fdc_flush_cluster(flusher_job_t *fj, void *arg)
+{
+	fdc_flush_job_t *job = (fdc_flush_job_t *) fj;
+	fd_cache_entry_t *ent = job->ent;
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const uint64_t start = _fdc_latency_start();
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&ent->lock);
+	const void *cbuf = cmap_lookup(&ent->clusters, job->cidx);
+	if (cbuf == FDC_EVICTED)
+		;
+	else if (ent->location == IN_RAM_CACHE || cbuf)
+		rc = _sink.push(_sink.arg, ent->ino, job->cidx, cbuf, cluster_size);
+	else
+		rc = _fdc_flush_spilled(ent, job->cidx);
+	pthread_rwlock_unlock(&ent->lock);
+	FDC_TRACE(rc ? TRACE_ERROR : TRACE_DEBUG, TRACE_FLUSH, ent->ino, job->cidx, rc, 0);
+	if (cbuf != FDC_EVICTED) {
+		_fdc_count(rc ? FDC_STAT_FLUSH_ERRORS : FDC_STAT_FLUSHES, 1);
+		if (!rc)
+			__atomic_add_fetch(&ent->flushes, 1, __ATOMIC_RELAXED);
+		_fdc_latency_end(FDC_LATENCY_FLUSH, start);
+	}
+	if (rc)
+		_fdc_flush_error(rc);
+
+	if (_flush_policy == FDC_FLUSH_FREE) {
+		fdc_flush_job_t **pp;
+
+		pthread_rwlock_wrlock(&ent->lock);
+		for (pp = &ent->flushing; *pp != job; pp = &(*pp)->next)
+			;
+		*pp = job->next;
+		if (!rc && !job->dirty)
+			_fdc_cluster_evict(ent, job->cidx);
+		pthread_rwlock_unlock(&ent->lock);
+		/* the evicted cluster goes back to the pool even if writes
+		 * have stopped */
+		epoch_reclaim();
+	}
+	free(job);
+}
+
+int fdc_flush_wait(void)
+{
+	if (_flushing)
+		flusher_drain(&_flusher);
+	if (_spool_async)
+		spool_io_drain(&_spool_io);
+	epoch_reclaim();
+	return __atomic_exchange_n(&_flush_error, 0, __ATOMIC_RELAXED);
+}
+
+/* total length of iovcnt segments, -1 if iovcnt is invalid or the total
+ * overflows */
+static ssize_t _fdc_iov_count(const struct iovec *iov, int iovcnt)
+{
+	size_t count = 0;
+	int i;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -1;
+	for (i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len > SSIZE_MAX - count)
+			return -1;
+		count += iov[i].iov_len;
+	}
+	return count;
+}
+
+/* fdc_write body, entry lock must be held for writing */
+static ssize_t _fdc_write(fd_cache_entry_t *ent,
+			  const struct iovec *iov,
+			  int iovcnt,
+			  off_t offset,
+			  ssize_t *full_cluster,
+			  size_t *nfull)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const ssize_t count = _fdc_iov_count(iov, iovcnt);
+	const size_t last_offset = offset + count;
+	ssize_t rc;
+	size_t nwritten = 0;
+	int seg;
+
+	if (full_cluster)
+		*full_cluster = -1;
+	if (nfull)
+		*nfull = 0;
+	if (offset < 0 || count < 0)
+		return -EINVAL;
+	if (count == 0)
+		return 0;
+
+	/* the bitmap covers the entry up to the end of this write */
+	if (_fdc_bitmap_reserve(ent, DIV_ROUND_UP(last_offset, ent->block_size)))
+		return -ENOMEM;
+
+	/* the entry grows over the RAM limit, move it to the filesystem, unless
+	 * views point to its inline data */
+	if (ent->location == IN_RAM_CACHE && last_offset > _ram_fs_limit &&
+	    !__atomic_load_n(&ent->npins, __ATOMIC_ACQUIRE)) {
+		const uint64_t start = _fdc_latency_start();
+		rc = _fdc_spill(ent);
+		_fdc_latency_end(FDC_LATENCY_SPILL, start);
+		if (rc)
+			return rc;
+		_fdc_count(FDC_STAT_SPILLS, 1);
+	}
+
+	/* queued clusters must not be freed once flushed, they're about to
+	 * change */
+	if (ent->flushing)
+		_fdc_flush_dirty(ent, offset / cluster_size, (last_offset - 1) / cluster_size);
+
+	if (ent->location == IN_RAM_CACHE) {
+		/* compute indices of first and last clusters to write to */
+		size_t cidx = offset / cluster_size;
+		const size_t last_cidx = last_offset / cluster_size;
+
+		/* the entry won't hold on a single cluster anymore, the first
+		 * cluster must be fully allocated */
+		if (ent->total_size < cluster_size && last_offset > cluster_size &&
+		    cmap_lookup(&ent->clusters, 0) &&
+		    !_fdc_ram_cluster_reserve(ent, 0, cluster_size, 0, 0))
+			return -ENOMEM;
+
+		/* compute offset for first cluster to write to */
+		off_t coff = offset % cluster_size;
+
+		/* number of bytes remaining to be written */
+		size_t nremain = count;
+		size_t ccount; /* number of bytes to write to current cluster */
+
+		/* position in the segments */
+		size_t segoff = 0;
+		seg = 0;
+
+		for (; cidx <= last_cidx; ++cidx) {
+
+			/* compute count for current cluster */
+			ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+
+			FDC_TRACE(TRACE_DEBUG, TRACE_RAM_WRITE, ent->ino, cidx, ccount, coff);
+
+			/* the cluster range may be spread over several
+			 * segments */
+			while (ccount) {
+				size_t scount;
+				while (segoff == iov[seg].iov_len) {
+					seg++;
+					segoff = 0;
+				}
+				scount = iov[seg].iov_len - segoff > ccount ? ccount : iov[seg].iov_len - segoff;
+
+				const void *cdata = iov[seg].iov_base + segoff;
+				const bool mapped = cmap_lookup(&ent->clusters, cidx) != NULL;
+
+				if ((!mapped || scount == cluster_size) && _fdc_is_zero(cdata, scount)) {
+					/* zeros over a hole, or over a whole cluster:
+					 * the cluster is (or becomes) a hole which
+					 * reads as zeros, nothing to allocate */
+					_fdc_ram_cluster_punch(ent, cidx);
+					rc = scount;
+				} else {
+					rc = _fdc_ram_cluster_write(ent, cidx, cdata, scount, coff,
+								    last_cidx == 0 && ent->total_size <= cluster_size);
+					if (rc < 0)
+						return rc;
+				}
+				nwritten += rc;
+				segoff += scount;
+				coff += scount;
+				ccount -= scount;
+				nremain -= scount;
+			}
+
+			/* prepare for writing to next cluster */
+			coff = 0;
+
+			if (nremain == 0)
+				break;
+		}
+		/* update total size, after the clusters have been published to
+		 * optimistic readers */
+		if (ent->total_size < last_offset)
+			__atomic_store_n(&ent->total_size, last_offset, __ATOMIC_RELEASE);
+	} else {
+		/* directly write to filesystem */
+		for (seg = 0; seg < iovcnt; ++seg) {
+			if (!iov[seg].iov_len)
+				continue;
+			rc = _fdc_fs_write(ent, iov[seg].iov_base, iov[seg].iov_len,
+					   offset + nwritten);
+			if (rc < 0)
+				return rc;
+			nwritten += rc;
+		}
+		if (ent->total_size < last_offset) {
+			/* readers of the mapping rely on it covering
+			 * total_size. An entry spilled before its first
+			 * write is mapped once the file has been extended */
+			if (ent->u.fs.map ||
+			    (_spill_io == FDC_SPILL_MMAP && !ent->u.fs.align))
+				_fdc_spool_map(ent, last_offset);
+			__atomic_store_n(&ent->total_size, last_offset, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (nwritten) {
+		ssize_t first_full = -1;
+		size_t nfull_clusters = 0;
+
+		_fdc_count(FDC_STAT_BYTES_WRITTEN, nwritten);
+		__atomic_add_fetch(&ent->bytes_written, nwritten, __ATOMIC_RELAXED);
+		_fdc_bitmap_mark(ent, offset, nwritten);
+		_fdc_full_clusters(ent, offset, nwritten, &first_full, &nfull_clusters);
+		if (_flushing && nfull_clusters)
+			_fdc_flush_queue(ent, first_full, nfull_clusters);
+		if (full_cluster)
+			*full_cluster = first_full;
+		if (nfull)
+			*nfull = nfull_clusters;
+	}
+
+	return nwritten;
+}
+
+ssize_t fdc_write(fd_cache_t fd,
+		  const void *buf,
+		  size_t count,
+		  off_t offset,
+		  ssize_t *full_cluster,
+		  size_t *nfull)
+{
+	const struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+	return fdc_writev(fd, &iov, 1, offset, full_cluster, nfull);
+}
+
+ssize_t fdc_writev(fd_cache_t fd,
+		   const struct iovec *iov,
+		   int iovcnt,
+		   off_t offset,
+		   ssize_t *full_cluster,
+		   size_t *nfull)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t*)fd;
+	const uint64_t start = _fdc_latency_start();
+	ssize_t rc;
+
+	pthread_rwlock_wrlock(&ent->lock);
+	_fdc_seq_write_begin(ent);
+	rc = _fdc_write(ent, iov, iovcnt, offset, full_cluster, nfull);
+	_fdc_seq_write_end(ent);
+	pthread_rwlock_unlock(&ent->lock);
+	_fdc_latency_end(FDC_LATENCY_WRITE, start);
+	return rc;
+}
+
+/* write count bytes at buf to offset of an entry, taking its lock */
+static ssize_t _fdc_import_write(fd_cache_entry_t *ent,
+				 void *buf,
+				 size_t count,
+				 off_t offset)
+{
+	const struct iovec iov = { .iov_base = buf, .iov_len = count };
+	ssize_t rc;
+
+	pthread_rwlock_wrlock(&ent->lock);
+	_fdc_seq_write_begin(ent);
+	rc = _fdc_write(ent, &iov, 1, offset, NULL, NULL);
+	_fdc_seq_write_end(ent);
+	pthread_rwlock_unlock(&ent->lock);
+	return rc;
+}
+
+/* fdc_import from the file offset of in_fd, a cluster at a time */
+static ssize_t _fdc_import_read(fd_cache_entry_t *ent,
+				int in_fd,
+				size_t count,
+				off_t offset)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	void *buf = malloc(cluster_size);
+	size_t nimported = 0;
+	ssize_t rc = 0;
+
+	if (!buf)
+		return -ENOMEM;
+	while (nimported < count) {
+		/* up to the end of the destination cluster, so that whole
+		 * clusters of zeros stay holes */
+		const size_t pos = offset + nimported;
+		size_t len = cluster_size - pos % cluster_size;
+		size_t n = 0;
+
+		if (len > count - nimported)
+			len = count - nimported;
+		while (n < len) {
+			rc = read(in_fd, buf + n, len - n);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc <= 0)
+				break;
+			n += rc;
+		}
+		if (rc < 0)
+			rc = -errno;
+		if (n) {
+			ssize_t wrc = _fdc_import_write(ent, buf, n, pos);
+			if (wrc < 0)
+				rc = wrc;
+			else
+				nimported += n;
+		}
+		if (rc <= 0)
+			break;
+	}
+	free(buf);
+	return nimported ? nimported : rc;
+}
+
+ssize_t fdc_import(fd_cache_t fd,
+		   int in_fd,
+		   off_t in_offset,
+		   size_t count,
+		   off_t offset)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) fd;
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t nimported = 0;
+	struct stat st;
+	ssize_t rc = 0;
+
+	if (offset < 0 || count > SSIZE_MAX)
+		return -EINVAL;
+	if (fstat(in_fd, &st))
+		return -errno;
+	if (in_offset < 0 || !S_ISREG(st.st_mode))
+		return _fdc_import_read(ent, in_fd, count, offset);
+
+	/* what's past the end of the source isn't imported, as with read */
+	if (in_offset >= st.st_size)
+		return 0;
+	if (count > st.st_size - in_offset)
+		count = st.st_size - in_offset;
+
+	/* the source is mapped a window at a time, and copied straight to
+	 * the clusters by the regular write path */
+	while (nimported < count) {
+		const off_t pos = in_offset + nimported;
+		const off_t map_offset = pos - pos % page_size;
+		const size_t skip = pos - map_offset;
+		const size_t len = count - nimported > FDC_IMPORT_WINDOW ?
+				   FDC_IMPORT_WINDOW : count - nimported;
+		void *addr = mmap(NULL, skip + len, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+				  in_fd, map_offset);
+
+		if (addr == MAP_FAILED) {
+			/* e.g. a filesystem without mmap support */
+			if (!nimported && (errno == ENODEV || errno == EACCES) &&
+			    lseek(in_fd, pos, SEEK_SET) == pos)
+				return _fdc_import_read(ent, in_fd, count, offset);
+			rc = -errno;
+			break;
+		}
+		madvise(addr, skip + len, MADV_SEQUENTIAL);
+		rc = _fdc_import_write(ent, addr + skip, len, offset + nimported);
+		munmap(addr, skip + len);
+		if (rc < 0)
+			break;
+		nimported += len;
+	}
+	return nimported ? nimported : rc;
+}
+
+ssize_t _fdc_ram_cluster_read(fd_cache_entry_t *ent,
+		              size_t cidx,
+			      void *buf,
+			      size_t count,
+			      off_t coff)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	if (coff < 0 || coff > cluster_size)
+		return -EINVAL;
+	if (count + coff > cluster_size)
+		return -EOVERFLOW;
+
+	/* retrieve the memory region corresponding to the cluster, holes read
+	 * as zeros */
+	void *clusterbuf = cmap_lookup(&ent->clusters, cidx);
+	if (clusterbuf == FDC_EVICTED)
+		return -ENODATA;
+	if (clusterbuf == NULL)
+		memset(buf, 0, count);
+	else
+		memcpy(buf, clusterbuf + coff, count);
+	return count;
+}
+
+/* fdc_read body for count bytes at offset of a RAM entry, the range has been
+ * checked. Entry lock must be held */
+static ssize_t _fdc_ram_read(fd_cache_entry_t *ent,
+			     void *buf,
+			     size_t count,
+			     off_t offset)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const size_t last_offset = offset + count;
+	size_t nread = 0;
+	ssize_t rc;
+
+	/* compute indices of first and last clusters to read from */
+	size_t cidx = offset / cluster_size;
+	const size_t last_cidx = last_offset / cluster_size;
+
+	/* compute offset for first cluster to read from */
+	off_t coff = offset % cluster_size;
+
+	/* number of bytes remaining to read */
+	size_t nremain = count;
+	size_t ccount; /* number of bytes to read from current cluster */
+
+	for (; cidx <= last_cidx; ++cidx) {
+
+		/* compute count for current cluster */
+		ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+
+		FDC_TRACE(TRACE_DEBUG, TRACE_RAM_READ, ent->ino, cidx, ccount, coff);
+
+		rc = _fdc_ram_cluster_read(ent, cidx, buf + (count - nremain), ccount, coff);
+		if (rc < 0)
+			return rc;
+		nread += rc;
+
+		/* prepare for writing to next cluster */
+		coff = 0;
+		nremain -= ccount;
+
+		if (nremain == 0)
+			break;
+	}
+	return nread;
+}
+
+/* fdc_read body, entry lock must be held */
+static ssize_t _fdc_read(fd_cache_entry_t *ent,
+			 const struct iovec *iov,
+			 int iovcnt,
+			 off_t offset)
+{
+	const ssize_t count = _fdc_iov_count(iov, iovcnt);
+	size_t nread = 0;
+	ssize_t rc;
+	int seg;
+
+	if (count < 0 || offset < 0 || offset > ent->total_size)
+		return -EINVAL;
+
+	if (count + offset > ent->total_size)
+		return -EOVERFLOW;
+
+	/* as pread, reading at the end of the entry is not an error */
+	for (seg = 0; seg < iovcnt; ++seg) {
+		if (!iov[seg].iov_len)
+			continue;
+		if (ent->location == IN_RAM_CACHE)
+			rc = _fdc_ram_read(ent, iov[seg].iov_base, iov[seg].iov_len,
+					   offset + nread);
+		else
+			/* read from the spool file */
+			rc = _fdc_fs_read(ent, ent->u.fs.map, iov[seg].iov_base,
+					  iov[seg].iov_len, offset + nread);
+		if (rc < 0)
+			return rc;
+		nread += rc;
+	}
+	return nread;
+}
+
+/* one lock-free fdc_read attempt, from a snapshot of the entry. Must be called
+ * inside an epoch read section. Return false if the snapshot was inconsistent
+ * (a write happened meanwhile), otherwise set *rc to fdc_read return code */
+static bool _fdc_read_optimistic(fd_cache_entry_t *ent,
+				 const struct iovec *iov,
+				 int iovcnt,
+				 size_t count,
+				 off_t offset,
+				 ssize_t *rc)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	unsigned long seq = __atomic_load_n(&ent->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return false;
+
+	/* total size is read before the cluster buffers, which are published
+	 * first by writers, so that every buffer we'll find is large enough */
+	const size_t total_size = __atomic_load_n(&ent->total_size, __ATOMIC_ACQUIRE);
+
+	const size_t location = __atomic_load_n(&ent->location, __ATOMIC_ACQUIRE);
+	const fdc_spool_map_t *map = NULL;
+	size_t pos = offset;
+	int seg;
+
+	if (location != IN_RAM_CACHE) {
+		map = __atomic_load_n(&ent->u.fs.map, __ATOMIC_ACQUIRE);
+		if (!map)
+			return false;
+	}
+
+	if (offset < 0 || offset > total_size) {
+		*rc = -EINVAL;
+	} else if (count + offset > total_size) {
+		*rc = -EOVERFLOW;
+	} else {
+		*rc = count;
+		for (seg = 0; seg < iovcnt && *rc >= 0; ++seg) {
+			void *buf = iov[seg].iov_base;
+			size_t cidx = pos / cluster_size;
+			off_t coff = pos % cluster_size;
+			size_t nremain = iov[seg].iov_len;
+
+			if (map && nremain) {
+				/* spilled entry, the map covers total_size */
+				ssize_t n = _fdc_fs_read(ent, map, buf, nremain, pos);
+				if (n < 0)
+					*rc = n;
+				pos += nremain;
+				continue;
+			}
+			while (nremain) {
+				size_t ccount = cluster_size - coff > nremain ? nremain : cluster_size - coff;
+				const void *cbuf = cmap_lookup(&ent->clusters, cidx);
+				if (cbuf == FDC_EVICTED) {
+					*rc = -ENODATA;
+					break;
+				}
+				if (!cbuf)
+					memset(buf, 0, ccount);
+				else
+					memcpy(buf, cbuf + coff, ccount);
+				buf += ccount;
+				pos += ccount;
+				coff = 0;
+				nremain -= ccount;
+				cidx++;
+			}
+		}
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ent->seq, __ATOMIC_RELAXED) == seq;
+}
+
+ssize_t fdc_read(fd_cache_t fd,
+		 void *buf,
+		 size_t count,
+		 off_t offset)
+{
+	const struct iovec iov = { .iov_base = buf, .iov_len = count };
+	return fdc_readv(fd, &iov, 1, offset);
+}
+
+static ssize_t _fdc_readv(fd_cache_entry_t *ent,
+			  const struct iovec *iov,
+			  int iovcnt,
+			  off_t offset)
+{
+	const ssize_t count = _fdc_iov_count(iov, iovcnt);
+	ssize_t rc;
+	int i;
+
+	if (count < 0)
+		return -EINVAL;
+
+	/* spilled entries are read under the lock, unless they're mapped */
+	if ((__atomic_load_n(&ent->location, __ATOMIC_ACQUIRE) == IN_RAM_CACHE ||
+	     __atomic_load_n(&ent->u.fs.map, __ATOMIC_ACQUIRE)) &&
+	    epoch_enter()) {
+		for (i = 0; i < FDC_OPTIMISTIC_READ_RETRIES; i++) {
+			if (_fdc_read_optimistic(ent, iov, iovcnt, count, offset, &rc)) {
+				epoch_exit();
+				return rc;
+			}
+		}
+		epoch_exit();
+	}
+
+	/* too much write activity on this entry, wait for our turn */
+	pthread_rwlock_rdlock(&ent->lock);
+	rc = _fdc_read(ent, iov, iovcnt, offset);
+	pthread_rwlock_unlock(&ent->lock);
+	return rc;
+}
+
+ssize_t fdc_readv(fd_cache_t fd,
+		  const struct iovec *iov,
+		  int iovcnt,
+		  off_t offset)
+{
+	const uint64_t start = _fdc_latency_start();
+	ssize_t rc;
+
+	rc = _fdc_readv((fd_cache_entry_t *) fd, iov, iovcnt, offset);
+	if (rc > 0)
+		_fdc_count(FDC_STAT_BYTES_READ, rc);
+	_fdc_latency_end(FDC_LATENCY_READ, start);
+	return rc;
+}
+
+/* fdc_batch order: by entry, then by offset, then in submission order */
+static int _fdc_op_cmp(const void *a, const void *b)
+{
+	const fdc_op_t *x = *(const fdc_op_t **) a, *y = *(const fdc_op_t **) b;
+
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	return x < y ? -1 : x > y;
+}
+
+/* fdc_batch submission order */
+static int _fdc_op_cmp_index(const void *a, const void *b)
+{
+	const fdc_op_t *x = *(const fdc_op_t **) a, *y = *(const fdc_op_t **) b;
+	return x < y ? -1 : x > y;
+}
+
+/* run the n operations of an entry, sorted by offset */
+static void _fdc_batch_entry(fdc_op_t **ops, size_t n)
+{
+	fd_cache_entry_t *ent = __fdc_lookup(ops[0]->ino);
+	bool write = false, overlap = false;
+	size_t i, end = 0;
+
+	for (i = 0; i < n; ++i) {
+		if (!ent) {
+			ops[i]->result = -EFAULT;
+			continue;
+		}
+		write |= ops[i]->op == FDC_OP_WRITE;
+		if (i && ops[i]->off >= 0 && (size_t) ops[i]->off < end)
+			overlap = true;
+		if (ops[i]->off >= 0 && ops[i]->off + ops[i]->len > end)
+			end = ops[i]->off + ops[i]->len;
+	}
+	if (!ent)
+		return;
+	/* sorting must not reorder a write and an overlapping operation */
+	if (overlap && write)
+		qsort(ops, n, sizeof(fdc_op_t *), _fdc_op_cmp_index);
+
+	if (write) {
+		pthread_rwlock_wrlock(&ent->lock);
+		_fdc_seq_write_begin(ent);
+	} else {
+		pthread_rwlock_rdlock(&ent->lock);
+	}
+	for (i = 0; i < n; ++i) {
+		const struct iovec iov = { .iov_base = ops[i]->buf, .iov_len = ops[i]->len };
+		if (ops[i]->op == FDC_OP_WRITE)
+			ops[i]->result = _fdc_write(ent, &iov, 1, ops[i]->off, NULL, NULL);
+		else if (ops[i]->op == FDC_OP_READ) {
+			ops[i]->result = _fdc_read(ent, &iov, 1, ops[i]->off);
+			if (ops[i]->result > 0)
+				_fdc_count(FDC_STAT_BYTES_READ, ops[i]->result);
+		}
+		else
+			ops[i]->result = -EINVAL;
+	}
+	if (write)
+		_fdc_seq_write_end(ent);
+	pthread_rwlock_unlock(&ent->lock);
+}
+
+int fdc_batch(fdc_op_t *ops, size_t nops)
+{
+	fdc_op_t **sorted = malloc((nops ? nops : 1) * sizeof(fdc_op_t *));
+	size_t i, first;
+
+	if (!sorted)
+		return -ENOMEM;
+	for (i = 0; i < nops; ++i)
+		sorted[i] = &ops[i];
+	qsort(sorted, nops, sizeof(fdc_op_t *), _fdc_op_cmp);
+
+	for (first = 0; first < nops; first = i) {
+		for (i = first + 1; i < nops && sorted[i]->ino == sorted[first]->ino; ++i)
+			;
+		_fdc_batch_entry(sorted + first, i - first);
+	}
+	free(sorted);
+	return 0;
+}
+
+/* holes of views */
+static const char _fdc_zeros[FDC_VIEW_ZEROS_SIZE];
+
+/* append count bytes at buf to a view, extending its last buffer if they
+ * follow it. A NULL buf stands for bytes of the spool file */
+static int _fdc_view_add(fdc_view_t *view, const void *buf, size_t count)
+{
+	struct iovec *last = view->iovcnt ? &view->iov[view->iovcnt - 1] : NULL;
+
+	if (last && (buf ? last->iov_base && last->iov_base + last->iov_len == buf :
+		     !last->iov_base)) {
+		last->iov_len += count;
+		return 0;
+	}
+	if (view->iovcnt == view->iovcap) {
+		int newcap = view->iovcap ? view->iovcap * 2 : 8;
+		struct iovec *newiov = realloc(view->iov, newcap * sizeof(struct iovec));
+		if (!newiov)
+			return -ENOMEM;
+		view->iov = newiov;
+		view->iovcap = newcap;
+	}
+	view->iov[view->iovcnt].iov_base = (void *) buf;
+	view->iov[view->iovcnt].iov_len = count;
+	view->iovcnt++;
+	return 0;
+}
+
+/* fdc_pin body, entry lock must be held. Unless copy is set, ranges of a
+ * spilled entry that has to be read from its spool file are left as NULL
+ * buffers */
+static ssize_t _fdc_pin(fd_cache_entry_t *ent,
+			size_t count,
+			off_t offset,
+			fdc_view_t *view,
+			bool copy)
+{
+	const size_t cluster_size = ent->block_size * ent->blocks_per_cluster;
+	const bool spilled = ent->location == IN_FS_CACHE;
+	const fdc_spool_map_t *map = spilled ? ent->u.fs.map : NULL;
+	const size_t end = offset + count;
+	size_t pos = offset;
+	int rc = 0;
+
+	if (offset < 0 || offset > ent->total_size)
+		return -EINVAL;
+	if (count + offset > ent->total_size)
+		return -EOVERFLOW;
+
+	while (!rc && pos < end) {
+		const size_t coff = pos % cluster_size;
+		size_t ccount = cluster_size - coff > end - pos ? end - pos : cluster_size - coff;
+		const void *cbuf = cmap_lookup(&ent->clusters, pos / cluster_size);
+
+		if (cbuf == FDC_EVICTED)
+			return -ENODATA;
+		if (cbuf) {
+			rc = _fdc_view_add(view, cbuf + coff, ccount);
+		} else if (map) {
+			rc = _fdc_view_add(view, map->addr + pos, ccount);
+		} else if (spilled && !copy) {
+			rc = _fdc_view_add(view, NULL, ccount);
+		} else if (spilled) {
+			if (!view->copy && !(view->copy = malloc(count)))
+				return -ENOMEM;
+			rc = _fdc_fs_copy_file(ent, NULL, view->copy + (pos - offset), ccount, pos);
+			if (!rc)
+				rc = _fdc_view_add(view, view->copy + (pos - offset), ccount);
+		} else {
+			size_t n;
+			for (n = 0; !rc && n < ccount; n += FDC_VIEW_ZEROS_SIZE)
+				rc = _fdc_view_add(view, _fdc_zeros,
+						   ccount - n > FDC_VIEW_ZEROS_SIZE ?
+						   FDC_VIEW_ZEROS_SIZE : ccount - n);
+		}
+		pos += ccount;
+	}
+	return rc ? rc : count;
+}
+
+/* fdc_pin, leaving spool file ranges as NULL buffers unless copy is set */
+static ssize_t _fdc_view_pin(fd_cache_t fd,
+			     size_t count,
+			     off_t offset,
+			     fdc_view_t *view,
+			     bool copy)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) fd;
+	ssize_t rc;
+
+	memset(view, 0, sizeof(fdc_view_t));
+	view->fd = fd;
+	/* buffers retired from now on aren't freed until the view is
+	 * released */
+	view->pin = epoch_pin();
+	if (!view->pin)
+		return -EAGAIN;
+
+	pthread_rwlock_rdlock(&ent->lock);
+	rc = _fdc_pin(ent, count, offset, view, copy);
+	if (rc >= 0)
+		__atomic_add_fetch(&ent->npins, 1, __ATOMIC_RELAXED);
+	if (rc > 0)
+		_fdc_count(FDC_STAT_BYTES_READ, rc);
+	pthread_rwlock_unlock(&ent->lock);
+
+	if (rc < 0) {
+		epoch_unpin(view->pin);
+		free(view->iov);
+		free(view->copy);
+		memset(view, 0, sizeof(fdc_view_t));
+	}
+	return rc;
+}
+
+ssize_t fdc_pin(fd_cache_t fd, size_t count, off_t offset, fdc_view_t *view)
+{
+	return _fdc_view_pin(fd, count, offset, view, true);
+}
+
+void fdc_unpin(fdc_view_t *view)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) view->fd;
+
+	__atomic_sub_fetch(&ent->npins, 1, __ATOMIC_RELEASE);
+	epoch_unpin(view->pin);
+	free(view->iov);
+	free(view->copy);
+	memset(view, 0, sizeof(fdc_view_t));
+}
+
+/* write iovcnt buffers to out_fd, at *out_offset if it's not NULL. iov is
+ * consumed. Return the number of bytes written, which is less than the
+ * buffers size only on error, or a negative errno value if nothing could be
+ * written */
+static ssize_t _fdc_export_iov(int out_fd, off_t *out_offset, struct iovec *iov, int iovcnt)
+{
+	size_t nwritten = 0;
+
+	while (iovcnt) {
+		const int n = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+		ssize_t rc = out_offset ? pwritev(out_fd, iov, n, *out_offset) :
+					  writev(out_fd, iov, n);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return nwritten ? nwritten : -errno;
+		nwritten += rc;
+		if (out_offset)
+			*out_offset += rc;
+		/* skip what's been written */
+		while (iovcnt && (size_t) rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base += rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return nwritten;
+}
+
+/* copy count bytes at offset of the spool file of ent to out_fd, through a
+ * bounce buffer */
+static ssize_t _fdc_export_copy(fd_cache_entry_t *ent,
+				off_t offset,
+				size_t count,
+				int out_fd,
+				off_t *out_offset)
+{
+	const size_t align = ent->u.fs.align ? ent->u.fs.align : sizeof(void *);
+	size_t bounce_size, nwritten = 0;
+	void *bounce = _fdc_spool_bounce(align, &bounce_size);
+	ssize_t rc = 0;
+
+	if (!bounce)
+		return -ENOMEM;
+	while (count) {
+		const size_t n = count > bounce_size ? bounce_size : count;
+		struct iovec iov = { .iov_base = bounce, .iov_len = n };
+		rc = _fdc_spool_pread(ent->u.fs.fd, ent->u.fs.align, bounce, n, offset);
+		if (rc)
+			break;
+		rc = _fdc_export_iov(out_fd, out_offset, &iov, 1);
+		if (rc <= 0)
+			break;
+		nwritten += rc;
+		offset += rc;
+		count -= rc;
+		if ((size_t) rc < n)
+			break;		/* short write */
+		rc = 0;
+	}
+	free(bounce);
+	return nwritten ? nwritten : rc;
+}
+
+/* send count bytes at offset of the spool file of ent to out_fd without going
+ * through user space: splice to pipes, copy_file_range between files, sendfile
+ * to anything else. Fall back to a copy when the kernel can't do it */
+static ssize_t _fdc_export_file(fd_cache_entry_t *ent,
+				off_t offset,
+				size_t count,
+				int out_fd,
+				off_t *out_offset,
+				bool pipe)
+{
+	size_t nwritten = 0;
+
+	while (count) {
+		ssize_t rc;
+		if (pipe)
+			rc = splice(ent->u.fs.fd, &offset, out_fd, NULL, count, SPLICE_F_MOVE);
+		else if (out_offset)
+			rc = copy_file_range(ent->u.fs.fd, &offset, out_fd, out_offset, count, 0);
+		else
+			rc = sendfile(out_fd, ent->u.fs.fd, &offset, count);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && !nwritten &&
+		    (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP)) {
+			/* e.g. O_DIRECT spool files, or filesystems without
+			 * copy offload */
+			return _fdc_export_copy(ent, offset, count, out_fd, out_offset);
+		}
+		if (rc < 0)
+			return nwritten ? nwritten : -errno;
+		if (rc == 0) {
+			/* holes past the end of the spool file */
+			rc = _fdc_export_copy(ent, offset, count, out_fd, out_offset);
+			return rc < 0 ? (nwritten ? nwritten : rc) : nwritten + rc;
+		}
+		nwritten += rc;
+		count -= rc;
+	}
+	return nwritten;
+}
+
+ssize_t fdc_export(fd_cache_t fd,
+		   int out_fd,
+		   off_t *out_offset,
+		   size_t count,
+		   off_t offset)
+{
+	fd_cache_entry_t *ent = (fd_cache_entry_t *) fd;
+	size_t nwritten = 0;
+	fdc_view_t view;
+	struct stat st;
+	ssize_t rc;
+	bool pipe;
+	int i, j;
+
+	if (fstat(out_fd, &st))
+		return -errno;
+	pipe = S_ISFIFO(st.st_mode);
+	if (pipe && out_offset)
+		return -ESPIPE;
+
+	rc = _fdc_view_pin(fd, count, offset, &view, false);
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < view.iovcnt; i = j) {
+		size_t len = 0;
+		if (!view.iov[i].iov_base) {
+			len = view.iov[i].iov_len;
+			rc = _fdc_export_file(ent, offset + nwritten, len,
+					      out_fd, out_offset, pipe);
+			j = i + 1;
+		} else {
+			/* the buffers up to the next spool file range, in a
+			 * single pwritev */
+			for (j = i; j < view.iovcnt && view.iov[j].iov_base; ++j)
+				len += view.iov[j].iov_len;
+			rc = _fdc_export_iov(out_fd, out_offset, &view.iov[i], j - i);
+		}
+		if (rc > 0)
+			nwritten += rc;
+		if (rc < 0 || (size_t) rc < len)
+			break;
+	}
+	fdc_unpin(&view);
+	return nwritten ? nwritten : rc;
+}
+
+void fdc_stats(fdc_stats_t *stats)
+{
+	int64_t sum[FDC_NSTATS] = { 0 };
+	int i, j;
+
+	for (i = 0; i < FDC_STATS_SLOTS; ++i) {
+		for (j = 0; j < FDC_NSTATS; ++j)
+			sum[j] += __atomic_load_n(&_counters[i].v[j], __ATOMIC_RELAXED);
+	}
+	stats->bytes_written = sum[FDC_STAT_BYTES_WRITTEN];
+	stats->bytes_read = sum[FDC_STAT_BYTES_READ];
+	stats->clusters_allocated = sum[FDC_STAT_CLUSTERS_ALLOCATED];
+	stats->clusters_freed = sum[FDC_STAT_CLUSTERS_FREED];
+	stats->reallocs = sum[FDC_STAT_REALLOCS];
+	stats->lookups = sum[FDC_STAT_LOOKUPS];
+	stats->spills = sum[FDC_STAT_SPILLS];
+	stats->flushes = sum[FDC_STAT_FLUSHES];
+	stats->flush_errors = sum[FDC_STAT_FLUSH_ERRORS];
+	/* a snapshot racing with frees on other CPUs may see them first */
+	stats->resident = sum[FDC_STAT_RESIDENT] > 0 ? sum[FDC_STAT_RESIDENT] : 0;
+}
+
+void fdc_latency_enable(bool enable)
+{
+	__atomic_store_n(&_latency, enable, __ATOMIC_RELAXED);
+}
+
+int fdc_latency(fdc_latency_op_t op, fdc_latency_t *lat)
+{
+	const unsigned long generation = __atomic_load_n(&_latency_generation,
+							 __ATOMIC_ACQUIRE);
+	fdc_latency_rec_t *rec;
+	hist_t *hist;
+
+	if ((unsigned int) op >= FDC_LATENCY_NOPS)
+		return -EINVAL;
+	hist = malloc(sizeof(hist_t));
+	if (!hist)
+		return -ENOMEM;
+	hist_reset(hist);
+	/* records are never freed nor unlinked */
+	for (rec = __atomic_load_n(&_latency_recs, __ATOMIC_ACQUIRE); rec; rec = rec->next) {
+		if (__atomic_load_n(&rec->generation, __ATOMIC_ACQUIRE) == generation)
+			hist_merge(hist, &rec->hists[op]);
+	}
+
+	memset(lat, 0, sizeof(fdc_latency_t));
+	if (hist->count) {
+		lat->count = hist->count;
+		lat->min = hist->min;
+		lat->mean = hist->sum / hist->count;
+		lat->max = hist->max;
+		lat->p50 = hist_percentile(hist, 50);
+		lat->p90 = hist_percentile(hist, 90);
+		lat->p99 = hist_percentile(hist, 99);
+		lat->p999 = hist_percentile(hist, 99.9);
+	}
+	free(hist);
+	return 0;
+}
+
+void fdc_latency_reset(void)
+{
+	__atomic_add_fetch(&_latency_generation, 1, __ATOMIC_RELEASE);
+}
+
+long fdc_hugepages(void)
+{
+	return hpage_count();
+}
+
+int fdc_trace_save(int fd)
+{
+#if FDC_TRACE_LEVEL > 0
+	return trace_save(fd);
+#else
+	(void) fd;
+	return -ENOTSUP;
+#endif
+}
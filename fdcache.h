@@ -1,8 +1,11 @@
 #ifndef FDCACHE_H
 #define FDCACHE_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 
 /**
  * @brief cache_ino_t type of the client cached inode.
@@ -14,17 +17,145 @@ typedef unsigned long long int cache_ino_t;
  */
 typedef void* fd_cache_t;
 
+/* default maximum number of bytes of free clusters kept for reuse */
+#define FDC_DEFAULT_POOL_LIMIT (256 << 20)
+
+/**
+ * @brief fdc_backend_t where cluster buffers are allocated from.
+ */
+typedef enum fdc_backend_ {
+	FDC_BACKEND_MALLOC,	/* the regular allocator */
+	FDC_BACKEND_HUGEPAGE,	/* 2 MiB aligned mappings backed by transparent
+				 * huge pages when available, to save TLB misses
+				 * on large clusters. Falls back to regular pages
+				 * if the kernel can't provide huge pages */
+} fdc_backend_t;
+
+/* spool directory, when neither spool_dir nor $TMPDIR are set */
+#define FDC_DEFAULT_SPOOL_DIR "/tmp"
+
+/* default number of flusher threads, when a sink is set */
+#define FDC_DEFAULT_FLUSH_THREADS 2
+
+/**
+ * @brief fdc_sink_t destination of fully written clusters, see fdc_options_t.
+ */
+typedef struct fdc_sink_ {
+	/* push nbytes bytes of cluster cidx of entry ino. buf is NULL if the
+	 * cluster is a hole (all zeros). Called from flusher threads, possibly
+	 * concurrently, and again for a cluster rewritten after it was pushed.
+	 * Return 0 on success, a negative errno value on failure */
+	int (*push)(void *arg, cache_ino_t ino, size_t cidx,
+		    const void *buf, size_t nbytes);
+	void *arg;
+} fdc_sink_t;
+
+/**
+ * @brief fdc_flush_policy_t what becomes of clusters pushed to the sink.
+ */
+typedef enum fdc_flush_policy_ {
+	FDC_FLUSH_KEEP,		/* keep them in RAM */
+	FDC_FLUSH_FREE,		/* free them, reading them then fails with
+				 * -ENODATA */
+} fdc_flush_policy_t;
+
+/**
+ * @brief fdc_spill_io_t how entries moved to the filesystem are read.
+ */
+typedef enum fdc_spill_io_ {
+	FDC_SPILL_PREAD,	/* one pread per fdc_read */
+	FDC_SPILL_MMAP,		/* copy from a shared mapping of the spool
+				 * file, without any syscall once the pages are
+				 * in the page cache. Falls back to pread if
+				 * the file can't be mapped */
+} fdc_spill_io_t;
+
+/**
+ * @brief fdc_io_engine_t how data moved to the filesystem is written.
+ */
+typedef enum fdc_io_engine_ {
+	FDC_IO_SYNC,		/* pwrite from the writing thread */
+	FDC_IO_URING,		/* in the background, batched with io_uring.
+				 * Falls back to FDC_IO_THREADS if io_uring is
+				 * unavailable */
+	FDC_IO_THREADS,		/* in the background, from a thread pool */
+} fdc_io_engine_t;
+
+/**
+ * @brief fdc_options_t fdcache library options, see fdc_init_opts.
+ */
+typedef struct fdc_options_ {
+	size_t ram_fs_limit;	/* see fdc_init */
+	size_t pool_limit;	/* maximum number of bytes of free clusters kept
+				 * for reuse by other entries (all cluster
+				 * sizes together), once this limit is reached
+				 * freed clusters go back to the allocator */
+	fdc_backend_t backend;	/* cluster buffers backend */
+	const fdc_sink_t *sink;	/* if not NULL, clusters are pushed to this sink
+				 * in the background as soon as they are fully
+				 * written. The sink is copied */
+	unsigned int flush_threads;	/* number of flusher threads */
+	fdc_flush_policy_t flush_policy;
+	const char *spool_dir;	/* directory of the spool files of entries moved
+				 * to the filesystem, $TMPDIR or
+				 * FDC_DEFAULT_SPOOL_DIR if NULL. Spool files
+				 * are unlinked, nothing is left there once
+				 * the process exits */
+	fdc_spill_io_t spill_io;
+	bool spool_direct;	/* bypass the page cache for spool files
+				 * (O_DIRECT), cluster buffers are then
+				 * aligned on the logical block size of the
+				 * spool filesystem. Entries whose cluster size
+				 * isn't a multiple of it, or all of them if
+				 * the filesystem doesn't support O_DIRECT,
+				 * keep using the page cache. spill_io is
+				 * ignored for direct spool files, they're
+				 * always read with pread */
+	fdc_io_engine_t io_engine;	/* with a background engine, full
+					 * clusters of an entry moved to the
+					 * filesystem, and the clusters it's
+					 * extended with, are kept in RAM until
+					 * they're written */
+} fdc_options_t;
+
+/**
+ * @brief fdc_options_init set opts to the default options.
+ * @param opts [OUT] options to initialize
+ */
+void fdc_options_init(fdc_options_t *opts);
+
+/**
+ * @brief fdc_init_opts initialize fdcache library with the given options.
+ * @param opts [IN] library options, see fdc_options_init
+ * @return 0 on success, negative errno values on errors. Possible error codes:
+ *	* -ENOMEM if the cache can't be allocated
+ *	* -EINVAL if a sink is set without flusher threads
+ *	* -EAGAIN if the flusher or I/O threads can't be created
+ */
+int fdc_init_opts(const fdc_options_t *opts);
+
 /**
  * @brief fdc_init initialize fdcache library and set the RAM-filesystem limit.
+ *                 Other options are set to their default values.
  * @param ram_fs_limit [IN] maximum size (in bytes) of a cache entry in RAM, if
  *                          an entry grows over this size, it gets moved to the
  *                          filesystem.
  */
 void fdc_init(size_t ram_fs_limit);
 
-/* Clean resources allocated by fdcache library */
+/* Clean resources allocated by fdcache library, after pending flushes are done */
 void fdc_deinit();
 
+/**
+ * @brief fdc_flush_wait wait until all the clusters queued so far have been
+ *                       pushed to the sink, and the background writes to
+ *                       spool files are done.
+ * @return 0 if all the pushes and writes since the previous call succeeded,
+ *         otherwise the error code of the first failed one. Clusters which
+ *         failed to be pushed or written are kept in RAM
+ */
+int fdc_flush_wait(void);
+
 /**
  * @brief fdc_get_or_create create a new cache entry associated with the client
  *                        id `ino` or retrieve the entry if it already exists.
@@ -41,7 +172,7 @@ void fdc_deinit();
  *                        to the fd cache. On error, its value is undefined
  * @return 0 on success, negative errno values on errors. Possible error codes:
  *	* -EINVAL for invalid arguments
- *	* -ENFILE if the maximum number of cache entries has been reached.
+ *	* -ENOMEM if the cache entry can't be allocated
  */
 int fdc_get_or_create(cache_ino_t ino,
 		      size_t block_size,
@@ -61,33 +192,198 @@ int fdc_entry_size(cache_ino_t ino, size_t *nbytes);
  * @brief fdc_entry_mem get the total memory used by a client inode.
  * @param ino client inode number
  * @param nbytes on success, set to the number of bytes that are currently
- *                        allocated for this entry
+ *                        allocated for this entry, in RAM or, once it has
+ *                        been moved to the filesystem, on disk
  * @return 0 on success, -EFAULT if cache entry was not found
  */
 int fdc_entry_mem(cache_ino_t ino, size_t *nbytes);
 
+/* cache statistics, see fdc_stats */
+typedef struct fdc_stats_ {
+	uint64_t bytes_written;
+	uint64_t bytes_read;
+	uint64_t clusters_allocated;	/* cluster buffers, including the
+					 * smaller first clusters of small
+					 * entries */
+	uint64_t clusters_freed;
+	uint64_t reallocs;		/* first clusters moved to a larger
+					 * buffer as they grow */
+	uint64_t lookups;		/* entry lookups by inode number */
+	uint64_t spills;		/* entries moved to the filesystem */
+	uint64_t flushes;		/* clusters pushed to the sink */
+	uint64_t flush_errors;
+	uint64_t resident;		/* bytes of cluster buffers currently
+					 * allocated, waiting for readers to
+					 * be done with them included */
+} fdc_stats_t;
+
+/**
+ * @brief fdc_stats get a snapshot of the cache statistics, counted since
+ *                           fdc_init. Counters are updated without any
+ *                           synchronization with the snapshot, which may
+ *                           miss operations in progress.
+ * @param stats set to the statistics
+ */
+void fdc_stats(fdc_stats_t *stats);
+
+/* statistics of an entry, see fdc_entry_stats */
+typedef struct fdc_entry_stats_ {
+	uint64_t bytes_written;
+	uint64_t flushes;		/* its clusters pushed to the sink */
+} fdc_entry_stats_t;
+
+/**
+ * @brief fdc_entry_stats get the statistics of a client inode, counted since
+ *                           its entry was created
+ * @param ino client inode number
+ * @param stats on success, set to the statistics of the entry
+ * @return 0 on success, -EFAULT if cache entry was not found
+ */
+int fdc_entry_stats(cache_ino_t ino, fdc_entry_stats_t *stats);
+
+/* operations whose latency is measured, see fdc_latency */
+typedef enum fdc_latency_op_ {
+	FDC_LATENCY_WRITE,	/* fdc_write, fdc_writev */
+	FDC_LATENCY_READ,	/* fdc_read, fdc_readv */
+	FDC_LATENCY_ALLOC,	/* cluster buffer allocations */
+	FDC_LATENCY_SPILL,	/* moves of entries to the filesystem */
+	FDC_LATENCY_FLUSH,	/* pushes of clusters to the sink */
+	FDC_LATENCY_NOPS
+} fdc_latency_op_t;
+
+/* latency distribution of an operation, in nanoseconds. Percentiles are
+ * within 1/16th of the actual values */
+typedef struct fdc_latency_ {
+	uint64_t count;
+	uint64_t min;
+	uint64_t mean;
+	uint64_t max;
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t p999;
+} fdc_latency_t;
+
+/**
+ * @brief fdc_latency_enable starts or stops measuring the latency of the cache
+ *                           operations, from any thread. It's disabled by
+ *                           default. Latencies are recorded per thread, in
+ *                           histograms that are only merged by fdc_latency.
+ * @param enable true to start measuring
+ */
+void fdc_latency_enable(bool enable);
+
+/**
+ * @brief fdc_latency get the latency distribution of an operation, measured
+ *                           since fdc_init or the last fdc_latency_reset.
+ * @param op operation
+ * @param lat set to the distribution, all zeros if nothing was measured
+ * @return 0 on success, negative errno values on errors:
+ *	* -EINVAL if op is invalid
+ *	* -ENOMEM if the histograms can't be merged
+ */
+int fdc_latency(fdc_latency_op_t op, fdc_latency_t *lat);
+
+/**
+ * @brief fdc_latency_reset forgets the latencies measured so far.
+ *                           Latencies being recorded meanwhile may be kept.
+ */
+void fdc_latency_reset(void);
+
+/**
+ * @brief fdc_hugepages get the number of huge pages the process actually got
+ *                      for its huge page advised mappings, see
+ *                      FDC_BACKEND_HUGEPAGE.
+ * @return the number of 2 MiB huge pages, negative errno values if it can't be
+ *         read from /proc/self/smaps
+ */
+long fdc_hugepages(void);
+
 /**
  * @brief fdc_write writes up to count bytes from the buffer starting at
  *                         buf to the cache entry fd, at offset offset. Required
- *                         number of clusters will be allocated.
+ *                         number of clusters will be allocated, except for
+ *                         all-zero data which leaves (or turns) clusters into
+ *                         holes.
  * @param fd cache entry opaque pointer
  * @param buf buffer to write
  * @param count number of bytes to write.
  * @param off offset from the cache entry start
+ * @param full_cluster [OUT] if not NULL, set to the index of the first cluster
+ *                         touched by this write which is now fully written
+ *                         (all of its blocks have been written, by this write
+ *                         or previous ones), -1 if there's none
+ * @param nfull [OUT] if not NULL, set to the number of consecutive fully
+ *                         written clusters starting at full_cluster, 0 if
+ *                         there's none
  * @return the number of bytes written or a negative errno value to indicate an
  *                         error. Possible error codes:
  *	* -ENOMEM cluster can't be allocated
  *      * -EINVAL negative offset
+ *	* -ENODATA partial write to a cluster freed after it was flushed
+ *	* other negative errno values if the entry can't be moved to, or written
+ *	  to, its spool file (e.g. -ENOSPC, -EIO)
  */
 ssize_t fdc_write(fd_cache_t fd,
 		  const void *buf,
 		  size_t count,
 		  off_t offset,
-		  ssize_t *full_cluster);
+		  ssize_t *full_cluster,
+		  size_t *nfull);
+
+/**
+ * @brief fdc_writev writes iovcnt buffers, as fdc_write would write a single
+ *                         buffer holding their concatenation: the entry is
+ *                         locked once and its clusters are walked once,
+ *                         whatever the number of segments.
+ * @param fd cache entry opaque pointer
+ * @param iov buffers to write
+ * @param iovcnt number of buffers, at most IOV_MAX
+ * @param off offset from the cache entry start
+ * @param full_cluster [OUT] see fdc_write
+ * @param nfull [OUT] see fdc_write
+ * @return the number of bytes written or a negative errno value, see
+ *         fdc_write. -EINVAL is also returned for an invalid iovcnt, or if the
+ *         total size overflows
+ */
+ssize_t fdc_writev(fd_cache_t fd,
+		   const struct iovec *iov,
+		   int iovcnt,
+		   off_t offset,
+		   ssize_t *full_cluster,
+		   size_t *nfull);
+
+/**
+ * @brief fdc_import fills the cache entry fd at offset offset with count bytes
+ *                          of the file descriptor in_fd. Regular files are
+ *                          mapped and copied straight to the clusters, a
+ *                          64 MiB window at a time, other file descriptors are
+ *                          read a cluster at a time. As with fdc_write, the
+ *                          written blocks are recorded, zeros leave holes and
+ *                          full clusters are flushed to the sink, if any.
+ * @param fd cache entry opaque pointer
+ * @param in_fd file descriptor to import from
+ * @param in_offset offset of in_fd to import from, or -1 to read from its file
+ *                          offset, as with pipes and sockets. The source must
+ *                          not be truncated meanwhile
+ * @param count number of bytes to import
+ * @param offset offset from the cache entry start
+ * @return the number of bytes imported, less than count if the end of in_fd
+ *         is reached first, or a negative errno value if nothing could be
+ *         imported. Possible error codes are the ones of fdc_write and of
+ *         read(2)
+ */
+ssize_t fdc_import(fd_cache_t fd,
+		   int in_fd,
+		   off_t in_offset,
+		   size_t count,
+		   off_t offset);
 
 /**
  * @brief fdc_read reads up to count bytes from the cache entry fd, at offset
- *                           offset, into the buffer starting at buf.
+ *                           offset, into the buffer starting at buf. Holes
+ *                           (ranges never written or written with zeros) read
+ *                           as zeros.
  * @param ent cache entry
  * @param cidx index of the cache entry cluster
  * @param buf buffer to read
@@ -97,8 +393,145 @@ ssize_t fdc_write(fd_cache_t fd,
  *         error. Possible error codes:
  *	* -EINVAL negative offset
  *	* -EOVERFLOW trying to read past the cluster end
- *	* -EFAULT trying to read unset memory (no such cluster was allocated)
+ *	* -ENODATA the range holds a cluster freed after it was flushed
+ *	* other negative errno values if the spool file of an entry moved to the
+ *	  filesystem can't be read (e.g. -EIO)
  */
 ssize_t fdc_read(fd_cache_t fd, void *buf, size_t count, off_t offset);
 
+/**
+ * @brief fdc_readv reads into iovcnt buffers, as fdc_read would into a single
+ *                           buffer of their total size. The range is read at
+ *                           once, not segment by segment.
+ * @param fd cache entry opaque pointer
+ * @param iov buffers to read into
+ * @param iovcnt number of buffers, at most IOV_MAX
+ * @param offset offset from the cache entry start
+ * @return the number of bytes read or a negative errno value, see fdc_read.
+ *         -EINVAL is also returned for an invalid iovcnt, or if the total
+ *         size overflows
+ */
+ssize_t fdc_readv(fd_cache_t fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+/**
+ * @brief fdc_op_type_t type of a batched operation, see fdc_batch.
+ */
+typedef enum fdc_op_type_ {
+	FDC_OP_READ,		/* fdc_read */
+	FDC_OP_WRITE,		/* fdc_write */
+} fdc_op_type_t;
+
+/**
+ * @brief fdc_op_t an operation of a batch, see fdc_batch.
+ */
+typedef struct fdc_op_ {
+	cache_ino_t ino;	/* entry, created with fdc_get_or_create */
+	fdc_op_type_t op;
+	void *buf;		/* buffer to read into, or to write */
+	off_t off;
+	size_t len;
+	ssize_t result;		/* [OUT] return code of the fdc_read or
+				 * fdc_write call, -EFAULT if there's no such
+				 * entry */
+} fdc_op_t;
+
+/**
+ * @brief fdc_batch runs nops operations, possibly on different entries. They
+ *                           are grouped by entry, each entry being looked up
+ *                           and locked once, and run by increasing offset
+ *                           within an entry. Operations on overlapping ranges
+ *                           of an entry keep their submission order, and are
+ *                           seen by readers of the entry as a whole.
+ * @param ops operations, their result field is set
+ * @param nops number of operations
+ * @return 0 once all the operations have been run, whatever their result, or
+ *         -ENOMEM if the batch can't be sorted, in which case none has been
+ *         run
+ */
+int fdc_batch(fdc_op_t *ops, size_t nops);
+
+/**
+ * @brief fdc_view_t read-only view of a range of a cache entry, see fdc_pin.
+ */
+typedef struct fdc_view_ {
+	struct iovec *iov;	/* buffers holding the range, in order */
+	int iovcnt;
+	/* private */
+	fd_cache_t fd;
+	struct epoch_thread_ *pin;
+	int iovcap;
+	void *copy;		/* data read from a spool file */
+} fdc_view_t;
+
+/**
+ * @brief fdc_pin returns the buffers holding count bytes of the cache entry
+ *                           fd at offset offset, without copying them. The
+ *                           buffers can't be freed or reallocated until the
+ *                           view is released with fdc_unpin, but writes to
+ *                           the range show through. Holes point to a shared
+ *                           zero buffer. An entry isn't moved to the
+ *                           filesystem while it's pinned, and ranges of a
+ *                           spilled entry that isn't mapped (see
+ *                           FDC_SPILL_MMAP) are copied into a buffer owned by
+ *                           the view. No memory is reclaimed while a view is
+ *                           held, views must be released quickly.
+ * @param fd cache entry opaque pointer
+ * @param count number of bytes to pin
+ * @param offset offset from the cache entry start
+ * @param view [OUT] on success, the view to read from and then release
+ * @return count or a negative errno value to indicate an error, in which case
+ *         there's nothing to release. Possible error codes are the ones of
+ *         fdc_read, and:
+ *	* -ENOMEM the view can't be allocated
+ *	* -EAGAIN too many views and threads reading at the same time
+ */
+ssize_t fdc_pin(fd_cache_t fd, size_t count, off_t offset, fdc_view_t *view);
+
+/**
+ * @brief fdc_unpin releases a view returned by fdc_pin, from any thread.
+ * @param view view to release
+ */
+void fdc_unpin(fdc_view_t *view);
+
+/**
+ * @brief fdc_export writes count bytes of the cache entry fd at offset offset
+ *                           to the file descriptor out_fd, without copying
+ *                           them to an intermediate buffer: the buffers
+ *                           holding them are written with a single pwritev
+ *                           (writev for pipes and sockets), and ranges of an
+ *                           entry moved to the filesystem are spliced,
+ *                           copied with copy_file_range or sent with sendfile
+ *                           from its spool file. The range is pinned (see
+ *                           fdc_pin) meanwhile.
+ * @param fd cache entry opaque pointer
+ * @param out_fd file descriptor to write to
+ * @param out_offset if not NULL, offset of out_fd to write at, which is
+ *                           advanced by the number of bytes written. If NULL,
+ *                           out_fd is written at its file offset
+ * @param count number of bytes to export
+ * @param offset offset from the cache entry start
+ * @return the number of bytes written, which may be less than count if out_fd
+ *         is non-blocking or full, or a negative errno value if nothing could
+ *         be written. Possible error codes are the ones of fdc_pin, the ones of
+ *         write(2), and:
+ *	* -ESPIPE out_offset is set but out_fd is a pipe
+ */
+ssize_t fdc_export(fd_cache_t fd,
+		   int out_fd,
+		   off_t *out_offset,
+		   size_t count,
+		   off_t offset);
+
+/**
+ * @brief fdc_trace_save writes the trace records of all threads to fd, to be
+ *                           decoded with fdc_trace_dump. Records are only
+ *                           taken when the cache is built with
+ *                           FDC_TRACE_LEVEL above 0 (see trace.h).
+ * @param fd file descriptor to write to
+ * @return 0 or a negative errno value:
+ *	* -ENOTSUP tracing is compiled out
+ *	* the ones of write(2)
+ */
+int fdc_trace_save(int fd);
+
 #endif
@@ -1,64 +1,238 @@
 #ifndef FDCACHE_INTERNAL_H
 #define FDCACHE_INTERNAL_H
 
-#include <glib.h>
+#include <pthread.h>
 #include "bitmap.h"
+#include "cluster_map.h"
+#include "cluster_pool.h"
+#include "flusher.h"
+#include "spool_io.h"
+#include "htable.h"
+#include "histogram.h"
 #include "fdcache.h"
 
-/* for now this is quick and very dirty cache
- * TODO: should be dynamic
- */
-#define MAX_CACHE_ENTRIES 20
+/* initial capacity of each stripe of the cache entry table, it grows on
+ * demand */
+#define FDC_INITIAL_ENTRIES 64
+
+/* number of independently locked stripes of the cache entry table. Entries are
+ * spread among stripes by inode number */
+#define FDC_TABLE_STRIPES 64
+
+#define FDC_CACHELINE_SIZE 64
+
+/* Locking:
+ *  - a stripe lock protects the hash table of its stripe, it is only held while
+ *    looking up or inserting an entry.
+ *  - each entry has a reader/writer lock protecting its content (size, bitmap,
+ *    clusters). It's taken for writing by fdc_write, for reading by fdc_read
+ *    and the other accessors.
+ * Entries are never freed before fdc_deinit, so an entry pointer obtained
+ * under a stripe lock remains valid after the stripe lock is released.
+ *
+ * Optimistic reads:
+ *  - writers also bump the entry sequence counter `seq` (odd while a write is
+ *    in progress), readers snapshot total_size and the cluster index without
+ *    taking any lock, copy the data, and retry if `seq` changed meanwhile.
+ *    After a few failed attempts they fall back to the reader lock.
+ *  - cluster buffers replaced by writers are handed to epoch_retire(), so
+ *    that they remain readable until every optimistic reader that may have
+ *    seen them is done. The cluster map frees none of its nodes before it's
+ *    destroyed, so it doesn't need to.
+ *
+ * Spilling:
+ *  - an entry is spilled by the write making it grow over ram_fs_limit: its
+ *    clusters are copied to the spool file and retired, the cluster map only
+ *    keeps the evicted ones. Spilled entries are read and written with
+ *    pread/pwrite under the entry lock. With FDC_SPILL_MMAP, reads
+ *    copy from a mapping of the spool file instead, optimistically like RAM
+ *    entries. Writers still use pwrite, and publish a larger mapping before
+ *    growing total_size.
+ *  - with an asynchronous spool I/O engine, full clusters of a spilling entry,
+ *    and clusters written past the end of a spilled entry, stay resident in
+ *    RAM and are written to the spool file in the background. Readers copy
+ *    them from RAM meanwhile, writers update them and mark their job `dirty`
+ *    so that it's written again. The buffer is only retired once the write
+ *    completed.
+ *
+ * Flushing:
+ *  - fully written clusters are queued to flusher threads, which push them to
+ *    the sink under the entry reader lock. With FDC_FLUSH_FREE, they then take
+ *    the writer lock and replace the cluster buffer with FDC_EVICTED (punching
+ *    the cluster out of the spool file of spilled entries), unless
+ *    the cluster was written since it was queued (the job is then `dirty`,
+ *    and the write queued it again).
+ **/
+
+/* number of optimistic read attempts before falling back to the entry lock */
+#define FDC_OPTIMISTIC_READ_RETRIES 8
+
+/* Small entries: the first cluster of an entry is stored in the entry itself
+ * up to FDC_INLINE_SIZE bytes, then in buffers of power of two size classes,
+ * from (1 << FDC_SMALL_MIN_SHIFT) up to (1 << FDC_SMALL_MAX_SHIFT) bytes, which
+ * are shared by all entries through cluster pools. It's only moved to a full
+ * cluster once it outgrows the largest class or the cluster size.
+ **/
+#define FDC_INLINE_SIZE 64
+#define FDC_SMALL_MIN_SHIFT 7
+#define FDC_SMALL_MAX_SHIFT 16
+#define FDC_SMALL_NCLASSES (FDC_SMALL_MAX_SHIFT - FDC_SMALL_MIN_SHIFT + 1)
+
+
+/* entry location. Entries start in RAM, and are spilled to an unlinked sparse
+ * spool file once they grow over ram_fs_limit, they never come back */
+#define IN_RAM_CACHE ((size_t)-1)
+#define IN_FS_CACHE ((size_t)-2)
+
+/* size of the windows of the source file mapped by fdc_import */
+#define FDC_IMPORT_WINDOW (64 << 20)
+
+/* size of the zero buffer holes of views point to */
+#define FDC_VIEW_ZEROS_SIZE (64 << 10)
 
-//
-// TODO: ADD LOCKING when touching at the cache entries!!!!
+/* size of the bounce buffer of O_DIRECT spool I/O, through which partial
+ * blocks and unaligned memory go */
+#define FDC_SPOOL_BOUNCE_SIZE (64 << 10)
+
+/* statistics counters, see fdc_stats(). They're kept in FDC_STATS_SLOTS sets
+ * indexed by CPU: an update is a relaxed atomic add to the set of the CPU the
+ * thread ran on when it last looked, whose cache line is rarely shared, and
+ * fdc_stats() sums all the sets */
+#define FDC_STATS_SLOTS 64
+
+/* number of counter updates after which a thread looks up its CPU again */
+#define FDC_STATS_SLOT_REFRESH 256
+
+typedef enum fdc_counter_ {
+	FDC_STAT_BYTES_WRITTEN,
+	FDC_STAT_BYTES_READ,
+	FDC_STAT_CLUSTERS_ALLOCATED,
+	FDC_STAT_CLUSTERS_FREED,
+	FDC_STAT_REALLOCS,
+	FDC_STAT_LOOKUPS,
+	FDC_STAT_SPILLS,
+	FDC_STAT_FLUSHES,
+	FDC_STAT_FLUSH_ERRORS,
+	FDC_STAT_RESIDENT,
+	FDC_NSTATS
+} fdc_counter_t;
+
+typedef struct fdc_counters_ {
+	int64_t v[FDC_NSTATS];
+} __attribute__((aligned(FDC_CACHELINE_SIZE))) fdc_counters_t;
+
+/* latency histograms of a thread, see fdc_latency(). Records are mapped the
+ * first time a thread measures a latency, handed over to new threads once
+ * their owner exits, and never freed. fdc_latency_reset() only bumps a
+ * generation: owners empty their histograms the next time they record, and
+ * fdc_latency() skips histograms of previous generations */
+typedef struct fdc_latency_rec_ {
+	struct fdc_latency_rec_ *next;
+	int in_use;
+	unsigned long generation;	/* of the histograms */
+	hist_t hists[FDC_LATENCY_NOPS];
+} fdc_latency_rec_t;
+
+/* shared mapping of a spool file. It's replaced by a larger one as the entry
+ * grows, and the previous one is retired through epoch_retire() */
+typedef struct fdc_spool_map_ {
+	void *addr;
+	size_t len;
+} fdc_spool_map_t;
+
+typedef struct fdc_stripe_ {
+	pthread_mutex_t lock;
+	htable_t table;
+} __attribute__((aligned(FDC_CACHELINE_SIZE))) fdc_stripe_t;
+
+/* background write of a resident cluster to the spool file */
+typedef struct fdc_spill_job_ {
+	spool_io_req_t req;
+	struct fd_cache_entry_ *ent;
+	size_t cidx;
+	bool dirty;			/* cluster written since submitted */
+} fdc_spill_job_t;
+
+/* a cluster queued for flushing to the sink */
+typedef struct fdc_flush_job_ {
+	flusher_job_t job;
+	struct fd_cache_entry_ *ent;
+	size_t cidx;
+	bool dirty;			/* cluster written since it was queued */
+	struct fdc_flush_job_ *next;	/* next job of the same entry */
+} fdc_flush_job_t;
 
 typedef struct fd_cache_entry_ {
+	pthread_rwlock_t lock;
+	unsigned long seq;		/* odd while a write is in progress */
 	cache_ino_t ino;
 	size_t total_size;
 	size_t block_size;
 	size_t blocks_per_cluster;
-	bitmap_hdl bitmap;
-	size_t location;		/* RAM or filesystem */
+	cluster_pool_t *pool;		/* full clusters allocator */
+	bitmap_hdl bitmap;		/* written blocks */
+	size_t pblock;			/* partially written block, or -1 */
+	size_t pblock_lo;		/* its written range */
+	size_t pblock_hi;
+	fdc_flush_job_t *flushing;	/* queued jobs, with FDC_FLUSH_FREE */
+	size_t nevicted;		/* clusters freed after being flushed */
+	size_t location;		/* IN_RAM_CACHE or IN_FS_CACHE */
+	unsigned int npins;		/* views (fdc_pin) not released */
+	uint64_t bytes_written;		/* see fdc_entry_stats, only
+					 * updated by writers and flushers,
+					 * readers don't write to the entry */
+	uint64_t flushes;
+	cluster_map_t clusters;		/* cluster index -> buffer, or
+					 * FDC_EVICTED. Once spilled, only
+					 * evicted and resident clusters are
+					 * left */
 	union {
 		struct {
-			size_t bla1;
-			size_t bla2;
+			int fd;			/* spool file */
+			fdc_spool_map_t *map;	/* its mapping with
+						 * FDC_SPILL_MMAP, covering at
+						 * least total_size bytes */
+			cluster_map_t pending;	/* cluster index ->
+						 * fdc_spill_job_t */
+			size_t tail;		/* resident cluster written
+						 * past the end, or -1 */
+			size_t align;		/* O_DIRECT alignment, 0 if
+						 * the file is buffered */
 		} fs;
 		struct {
-			GTree *buf_map;	/* key: cluster index value: cluster buffer */
+			size_t cap0;		/* first cluster capacity */
+			char inline_data[FDC_INLINE_SIZE];
 		} ram;
 	} u;
 
 } fd_cache_entry_t;
 
-gint _key_cmp (gconstpointer a, gconstpointer b);
-
 /**
  * @brief __fdc_lookup look for a specific client inode
  * @param ino
- * @param free_idx set to the first free index if found, or negative if no
- *                   free cache entry has been found during the lookup
  * @return the cache entry or NULL if not found
  */
-fd_cache_entry_t * __fdc_lookup(cache_ino_t ino, int *free_idx);
+fd_cache_entry_t * __fdc_lookup(cache_ino_t ino);
 
 /**
  * @brief _fdc_ram_cluster_write writes up to count bytes from the buffer
  *                         starting at buf to the cluster represented by cidx,
  *                         at offset coff. Only for entries located in RAM.
+ *                         Entry lock must be held for writing.
  * @param ent cache entry
  * @param cidx index of the cache entry cluster. Allocate the whole cluster if
  *                         it's not allocated yet
  * @param buf buffer to write
  * @param count number of bytes to write
  * @param coff offset from the cluster start
- * @param unique_cluster the whole entry holds on a single cluster
+ * @param unique_cluster the whole entry holds on a single cluster, the first
+ *                       cluster is then only allocated up to coff + count
  * @return the number of bytes written or a negative errno value to indicate an
  *                         error. Possible error codes:
  *	* -ENOMEM cluster can't be allocated
  *      * -EINVAL invalid offset (negative or greater than cluster size)
  *	* -EOVERFLOW trying to write past the cluster end
+ *	* -ENODATA partial write to a cluster freed after being flushed
  */
 ssize_t _fdc_ram_cluster_write(fd_cache_entry_t *ent,
 			       size_t cidx,
@@ -70,17 +244,18 @@ ssize_t _fdc_ram_cluster_write(fd_cache_entry_t *ent,
 /**
  * @brief _fdc_ram_cluster_read reads up to count bytes from the cluster
  *                           represented by cid, at offset coff, into the buffer
- *                           starting at buf.
+ *                           starting at buf. Entry lock must be held.
  * @param ent cache entry
- * @param cidx index of the cache entry cluster
+ * @param cidx index of the cache entry cluster, unallocated clusters are holes
+ *             which read as zeros
  * @param buf buffer to read
  * @param count number of bytes to read
  * @param coff offset from the cluster start
  * @return the number of bytes read or a negative errno value to indicate an
  *         error. Possible error codes:
- *	* -EFAULT cluster not allocated/not found
  *      * -EINVAL invalid offset (negative or greater than cluster size)
  *	* -EOVERFLOW trying to read past the cluster end
+ *	* -ENODATA the cluster was freed after being flushed
  */
 ssize_t _fdc_ram_cluster_read(fd_cache_entry_t *ent,
 		              size_t cidx,
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "flusher.h"
+
+static void *_flusher_worker(void *arg)
+{
+	flusher_t *fl = (flusher_t *) arg;
+	flusher_job_t *job;
+
+	pthread_mutex_lock(&fl->lock);
+	for (;;) {
+		while (!fl->head && !fl->stop)
+			pthread_cond_wait(&fl->work, &fl->lock);
+		if (!fl->head)
+			break;	/* stopping, and nothing left to do */
+
+		job = fl->head;
+		fl->head = job->next;
+		if (!fl->head)
+			fl->tail = NULL;
+		fl->nqueued--;
+		fl->nrunning++;
+		pthread_mutex_unlock(&fl->lock);
+
+		fl->handler(job, fl->arg);
+
+		pthread_mutex_lock(&fl->lock);
+		fl->nrunning--;
+		if (!fl->nqueued && !fl->nrunning)
+			pthread_cond_broadcast(&fl->idle);
+	}
+	pthread_mutex_unlock(&fl->lock);
+	return NULL;
+}
+
+int flusher_init(flusher_t *fl, unsigned int nthreads,
+		 flusher_handler_t handler, void *arg)
+{
+	unsigned int i;
+	int rc;
+
+	fl->head = fl->tail = NULL;
+	fl->nqueued = fl->nrunning = 0;
+	fl->stop = false;
+	fl->handler = handler;
+	fl->arg = arg;
+	fl->nthreads = 0;
+	fl->threads = malloc(nthreads * sizeof(pthread_t));
+	if (!fl->threads)
+		return -ENOMEM;
+	pthread_mutex_init(&fl->lock, NULL);
+	pthread_cond_init(&fl->work, NULL);
+	pthread_cond_init(&fl->idle, NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		rc = pthread_create(&fl->threads[i], NULL, _flusher_worker, fl);
+		if (rc) {
+			flusher_destroy(fl);
+			return -rc;
+		}
+		fl->nthreads++;
+	}
+	return 0;
+}
+
+void flusher_submit(flusher_t *fl, flusher_job_t *job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&fl->lock);
+	if (fl->tail)
+		fl->tail->next = job;
+	else
+		fl->head = job;
+	fl->tail = job;
+	fl->nqueued++;
+	pthread_cond_signal(&fl->work);
+	pthread_mutex_unlock(&fl->lock);
+}
+
+size_t flusher_pending(flusher_t *fl)
+{
+	size_t n;
+	pthread_mutex_lock(&fl->lock);
+	n = fl->nqueued + fl->nrunning;
+	pthread_mutex_unlock(&fl->lock);
+	return n;
+}
+
+void flusher_drain(flusher_t *fl)
+{
+	pthread_mutex_lock(&fl->lock);
+	while (fl->nqueued || fl->nrunning)
+		pthread_cond_wait(&fl->idle, &fl->lock);
+	pthread_mutex_unlock(&fl->lock);
+}
+
+void flusher_destroy(flusher_t *fl)
+{
+	unsigned int i;
+
+	/* workers only exit once the queue is empty */
+	pthread_mutex_lock(&fl->lock);
+	fl->stop = true;
+	pthread_cond_broadcast(&fl->work);
+	pthread_mutex_unlock(&fl->lock);
+	for (i = 0; i < fl->nthreads; ++i)
+		pthread_join(fl->threads[i], NULL);
+
+	free(fl->threads);
+	fl->threads = NULL;
+	fl->nthreads = 0;
+	pthread_cond_destroy(&fl->idle);
+	pthread_cond_destroy(&fl->work);
+	pthread_mutex_destroy(&fl->lock);
+}
@@ -0,0 +1,54 @@
+#ifndef FLUSHER_H
+#define FLUSHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* flusher, a pool of worker threads processing a FIFO of jobs.
+ *
+ * Jobs are embedded in caller structures (see flusher_job_t) and handed to a
+ * single handler, which owns them from then on. flusher_drain() waits for the
+ * queue to be empty and the workers idle, so that the caller knows every job
+ * submitted before has been handled.
+ **/
+
+typedef struct flusher_job_ {
+	struct flusher_job_ *next;
+} flusher_job_t;
+
+typedef void (*flusher_handler_t)(flusher_job_t *job, void *arg);
+
+typedef struct flusher_ {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		/* jobs queued, or stopping */
+	pthread_cond_t idle;		/* no job queued nor running */
+	flusher_job_t *head;
+	flusher_job_t *tail;
+	size_t nqueued;
+	size_t nrunning;
+	bool stop;
+	unsigned int nthreads;
+	pthread_t *threads;
+	flusher_handler_t handler;
+	void *arg;
+} flusher_t;
+
+/* start nthreads workers calling handler(job, arg) on each submitted job.
+ * Return 0 on success, -ENOMEM or -EAGAIN if the workers can't be created */
+int flusher_init(flusher_t *fl, unsigned int nthreads,
+		 flusher_handler_t handler, void *arg);
+
+/* queue a job */
+void flusher_submit(flusher_t *fl, flusher_job_t *job);
+
+/* return the number of jobs queued or being handled */
+size_t flusher_pending(flusher_t *fl);
+
+/* wait until every submitted job has been handled */
+void flusher_drain(flusher_t *fl);
+
+/* drain the queue and stop the workers */
+void flusher_destroy(flusher_t *fl);
+
+#endif
@@ -0,0 +1,96 @@
+#include <string.h>
+#include "histogram.h"
+
+static inline unsigned int _bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB_COUNT + ((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/* highest value of a bucket */
+static inline uint64_t _bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+	shift = idx / HIST_SUB_COUNT - 1;
+	return ((uint64_t) (HIST_SUB_COUNT + idx % HIST_SUB_COUNT) << shift) +
+	       ((1ULL << shift) - 1);
+}
+
+void hist_reset(hist_t *hist)
+{
+	memset(hist, 0, sizeof(hist_t));
+	hist->min = UINT64_MAX;
+}
+
+/* counters are stored whole, so that concurrent merges don't see torn
+ * values */
+static inline void _add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+void hist_record(hist_t *hist, uint64_t value)
+{
+	_add(&hist->buckets[_bucket(value)], 1);
+	_add(&hist->sum, value);
+	if (value < hist->min)
+		__atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+	/* last, so that a merge doesn't count more values than buckets hold
+	 * (as long as it reads count first) */
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+	uint64_t count = __atomic_load_n(&src->count, __ATOMIC_ACQUIRE);
+	uint64_t min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	unsigned int i;
+
+	if (!count)
+		return;
+	dst->count += count;
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	if (min < dst->min)
+		dst->min = min;
+	if (max > dst->max)
+		dst->max = max;
+	for (i = 0; i < HIST_NBUCKETS; ++i)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+uint64_t hist_percentile(const hist_t *hist, double p)
+{
+	uint64_t rank, seen = 0, total = 0;
+	unsigned int i;
+
+	/* buckets may hold a few more values than count while recorded to */
+	for (i = 0; i < HIST_NBUCKETS; ++i)
+		total += hist->buckets[i];
+	if (!total)
+		return 0;
+	if (p < 0)
+		p = 0;
+	if (p > 100)
+		p = 100;
+	rank = (uint64_t) (p / 100 * total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_NBUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == HIST_NBUCKETS)
+		return hist->max;
+	return _bucket_max(i) < hist->max ? _bucket_max(i) : hist->max;
+}
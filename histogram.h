@@ -0,0 +1,44 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* log-bucketed histograms of 64 bits values, e.g. latencies in ns.
+ *
+ * Values below 2^HIST_SUB_BITS have a bucket of their own, above that each
+ * power of two range is split into 2^HIST_SUB_BITS buckets, so that a value is
+ * known within 1/2^HIST_SUB_BITS of its magnitude whatever it is (as in HDR
+ * histograms).
+ *
+ * A histogram has a single writer, which never uses atomic read-modify-write
+ * operations. Others may merge it while it's being recorded to, missing the
+ * values being recorded.
+ **/
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_NBUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct hist_ {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_NBUCKETS];
+} hist_t;
+
+/* empty a histogram */
+void hist_reset(hist_t *hist);
+
+/* record a value, only from the writer of hist */
+void hist_record(hist_t *hist, uint64_t value);
+
+/* add the values of src to dst. src may be recorded to meanwhile, dst may not */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* return the value below which lie p percent of the values, that is the
+ * highest value of its bucket (capped to the maximum value), or 0 if hist is
+ * empty */
+uint64_t hist_percentile(const hist_t *hist, double p);
+
+#endif
@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "htable.h"
+
+#define HTABLE_TOMBSTONE ((void *) &_htable_tombstone)
+#define HTABLE_MIN_BUCKETS 16
+
+/* number of old buckets migrated at each table operation during a resize */
+#define HTABLE_MIGRATE_STEP 16
+
+static char _htable_tombstone;
+
+static inline size_t _hash(cache_ino_t key)
+{
+	/* splitmix64 finalizer, inode numbers are often sequential */
+	uint64_t h = key;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return (size_t) h;
+}
+
+static int _array_alloc(htable_array_t *a, size_t nbuckets)
+{
+	a->buckets = calloc(nbuckets, sizeof(htable_bucket_t));
+	if (!a->buckets)
+		return -ENOMEM;
+	a->mask = nbuckets - 1;
+	a->used = 0;
+	a->live = 0;
+	return 0;
+}
+
+static void _array_free(htable_array_t *a)
+{
+	free(a->buckets);
+	a->buckets = NULL;
+	a->mask = a->used = a->live = 0;
+}
+
+/* return the bucket holding key, or NULL */
+static htable_bucket_t *_array_find(htable_array_t *a, cache_ino_t key)
+{
+	size_t i;
+	if (!a->buckets)
+		return NULL;
+	for (i = _hash(key) & a->mask; a->buckets[i].val; i = (i + 1) & a->mask) {
+		if (a->buckets[i].val != HTABLE_TOMBSTONE && a->buckets[i].key == key)
+			return &a->buckets[i];
+	}
+	return NULL;
+}
+
+/* insert key, known to be absent, in a. Tombstones are reused */
+static void _array_put(htable_array_t *a, cache_ino_t key, void *val)
+{
+	size_t i = _hash(key) & a->mask;
+	while (a->buckets[i].val && a->buckets[i].val != HTABLE_TOMBSTONE)
+		i = (i + 1) & a->mask;
+	if (!a->buckets[i].val)
+		a->used++;
+	a->buckets[i].key = key;
+	a->buckets[i].val = val;
+	a->live++;
+}
+
+/* migrate up to n buckets from the old table to the current one */
+static void _migrate(htable_t *ht, size_t n)
+{
+	htable_array_t *old = &ht->old;
+	if (!old->buckets)
+		return;
+
+	for (; n && ht->migrate_pos <= old->mask; ht->migrate_pos++, n--) {
+		htable_bucket_t *b = &old->buckets[ht->migrate_pos];
+		if (b->val && b->val != HTABLE_TOMBSTONE) {
+			_array_put(&ht->cur, b->key, b->val);
+			/* leave a tombstone, so that the probe sequences of
+			 * not yet migrated keys remain valid */
+			b->val = HTABLE_TOMBSTONE;
+			old->live--;
+		}
+	}
+	if (ht->migrate_pos > old->mask)
+		_array_free(old);
+}
+
+/* make room for one more entry in the current table */
+static int _reserve(htable_t *ht)
+{
+	htable_array_t *cur = &ht->cur;
+	size_t nbuckets = HTABLE_MIN_BUCKETS;
+
+	/* keep load factor (tombstones and entries still to be migrated
+	 * included) under 3/4 */
+	if ((cur->used + ht->old.live + 1) * 4 <= (cur->mask + 1) * 3)
+		return 0;
+
+	/* finish any pending resize before starting a new one */
+	_migrate(ht, (size_t) -1);
+
+	/* new table is sized from live entries only, dropping tombstones */
+	while (nbuckets < (cur->live + 1) * 2)
+		nbuckets <<= 1;
+
+	htable_array_t fresh;
+	if (_array_alloc(&fresh, nbuckets))
+		return -ENOMEM;
+	ht->old = *cur;
+	ht->cur = fresh;
+	ht->migrate_pos = 0;
+	_migrate(ht, HTABLE_MIGRATE_STEP);
+	return 0;
+}
+
+int htable_init(htable_t *ht, size_t capacity)
+{
+	size_t nbuckets = HTABLE_MIN_BUCKETS;
+	while (nbuckets * 3 < capacity * 4)
+		nbuckets <<= 1;
+
+	ht->old.buckets = NULL;
+	_array_free(&ht->old);
+	ht->migrate_pos = 0;
+	return _array_alloc(&ht->cur, nbuckets);
+}
+
+void htable_destroy(htable_t *ht)
+{
+	_array_free(&ht->cur);
+	_array_free(&ht->old);
+}
+
+void *htable_lookup(htable_t *ht, cache_ino_t key)
+{
+	htable_bucket_t *b = _array_find(&ht->cur, key);
+	if (!b)
+		b = _array_find(&ht->old, key);
+	return b ? b->val : NULL;
+}
+
+int htable_insert(htable_t *ht, cache_ino_t key, void *val)
+{
+	if (htable_lookup(ht, key))
+		return -EEXIST;
+	if (_reserve(ht))
+		return -ENOMEM;
+	_array_put(&ht->cur, key, val);
+	_migrate(ht, HTABLE_MIGRATE_STEP);
+	return 0;
+}
+
+void *htable_remove(htable_t *ht, cache_ino_t key)
+{
+	void *val = NULL;
+	htable_array_t *a = &ht->cur;
+	htable_bucket_t *b = _array_find(a, key);
+	if (!b) {
+		a = &ht->old;
+		b = _array_find(a, key);
+	}
+	if (b) {
+		val = b->val;
+		b->val = HTABLE_TOMBSTONE;
+		a->live--;
+	}
+	_migrate(ht, HTABLE_MIGRATE_STEP);
+	return val;
+}
+
+size_t htable_count(const htable_t *ht)
+{
+	return ht->cur.live + ht->old.live;
+}
+
+static void _array_foreach(htable_array_t *a,
+			   void (*fn)(cache_ino_t key, void *val, void *arg),
+			   void *arg)
+{
+	size_t i;
+	if (!a->buckets)
+		return;
+	for (i = 0; i <= a->mask; ++i) {
+		htable_bucket_t *b = &a->buckets[i];
+		if (b->val && b->val != HTABLE_TOMBSTONE)
+			fn(b->key, b->val, arg);
+	}
+}
+
+void htable_foreach(htable_t *ht,
+		    void (*fn)(cache_ino_t key, void *val, void *arg),
+		    void *arg)
+{
+	_array_foreach(&ht->cur, fn, arg);
+	_array_foreach(&ht->old, fn, arg);
+}
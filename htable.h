@@ -0,0 +1,56 @@
+#ifndef HTABLE_H
+#define HTABLE_H
+
+#include <stddef.h>
+#include "fdcache.h"
+
+/* open-addressing (linear probing) hash table, mapping a cache inode number to
+ * a non-NULL pointer. When the table grows, buckets are migrated incrementally
+ * from the old table to the new one, a few at each operation, so that no
+ * single operation pays for the whole rehash.
+ **/
+
+typedef struct htable_bucket_ {
+	cache_ino_t key;
+	void *val;		/* NULL if empty, HTABLE_TOMBSTONE if deleted */
+} htable_bucket_t;
+
+typedef struct htable_array_ {
+	htable_bucket_t *buckets;
+	size_t mask;		/* number of buckets - 1 */
+	size_t used;		/* live buckets + tombstones */
+	size_t live;		/* live buckets */
+} htable_array_t;
+
+typedef struct htable_ {
+	htable_array_t cur;	/* table receiving insertions */
+	htable_array_t old;	/* table being migrated, if buckets != NULL */
+	size_t migrate_pos;	/* next old bucket to migrate */
+} htable_t;
+
+/* initialize an empty table, able to hold at least capacity entries without
+ * resizing. Return 0 on success, -ENOMEM on allocation failure */
+int htable_init(htable_t *ht, size_t capacity);
+
+/* free the memory used by the table (not the stored values) */
+void htable_destroy(htable_t *ht);
+
+/* return the value associated with key, or NULL if not found */
+void *htable_lookup(htable_t *ht, cache_ino_t key);
+
+/* insert key/val (val must not be NULL). Return 0 on success, -EEXIST if key
+ * is already present, -ENOMEM if the table can't grow */
+int htable_insert(htable_t *ht, cache_ino_t key, void *val);
+
+/* remove key from the table. Return the removed value, or NULL if not found */
+void *htable_remove(htable_t *ht, cache_ino_t key);
+
+/* return the number of entries in the table */
+size_t htable_count(const htable_t *ht);
+
+/* call fn on each entry of the table. fn must not modify the table */
+void htable_foreach(htable_t *ht,
+		    void (*fn)(cache_ino_t key, void *val, void *arg),
+		    void *arg);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "hugepage.h"
+
+static inline size_t _hpage_round(size_t size)
+{
+	return (size + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+}
+
+void *hpage_alloc(size_t size)
+{
+	const size_t len = _hpage_round(size);
+	uintptr_t addr, aligned;
+	void *map;
+
+	/* over-map by one huge page, then trim both ends to get an aligned
+	 * range */
+	map = mmap(NULL, len + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	addr = (uintptr_t) map;
+	aligned = (addr + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+	if (aligned > addr)
+		munmap(map, aligned - addr);
+	munmap((void *) (aligned + len), addr + HPAGE_SIZE - aligned);
+
+#ifdef MADV_HUGEPAGE
+	/* fails with EINVAL if THP is not available, regular pages then */
+	madvise((void *) aligned, len, MADV_HUGEPAGE);
+#endif
+	return (void *) aligned;
+}
+
+void hpage_free(void *buf, size_t size)
+{
+	if (buf)
+		munmap(buf, _hpage_round(size));
+}
+
+long hpage_count(void)
+{
+	FILE *smaps = fopen("/proc/self/smaps", "r");
+	unsigned long anon_kb = 0, huge_kb = 0, kb;
+	char line[512];
+
+	if (!smaps)
+		return -errno;
+
+	/* AnonHugePages comes before VmFlags in each mapping block, only count
+	 * it for mappings flagged hg (MADV_HUGEPAGE) */
+	while (fgets(line, sizeof(line), smaps)) {
+		if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			anon_kb = kb;
+		else if (!strncmp(line, "VmFlags:", 8)) {
+			if (strstr(line, " hg"))
+				huge_kb += anon_kb;
+			anon_kb = 0;
+		}
+	}
+	fclose(smaps);
+	return huge_kb / (HPAGE_SIZE >> 10);
+}
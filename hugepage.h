@@ -0,0 +1,29 @@
+#ifndef HUGEPAGE_H
+#define HUGEPAGE_H
+
+#include <stddef.h>
+
+/* huge page backed buffers.
+ *
+ * Buffers are mapped with mmap(), aligned on HPAGE_SIZE and advised with
+ * MADV_HUGEPAGE, so that the kernel backs them with transparent huge pages when
+ * it can, saving TLB entries when copying in and out of large clusters. If
+ * transparent huge pages are disabled, buffers silently fall back to regular
+ * pages.
+ **/
+
+/* size and alignment of a huge page */
+#define HPAGE_SIZE (2UL << 20)
+
+/* return a buffer of at least size bytes, aligned on HPAGE_SIZE, or NULL if it
+ * can't be mapped. The size is rounded up to a multiple of HPAGE_SIZE */
+void *hpage_alloc(size_t size);
+
+/* unmap a buffer returned by hpage_alloc(size) */
+void hpage_free(void *buf, size_t size);
+
+/* return the number of huge pages currently backing the mappings advised with
+ * MADV_HUGEPAGE in the process, -errno if it can't be known */
+long hpage_count(void);
+
+#endif
@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "spool_io.h"
+
+struct spool_io_ring_ {
+	int fd;
+	/* submission ring, only written by the submitter thread */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	/* completion ring, only read by the reaper thread */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	/* protected by the engine lock */
+	spool_io_req_t *head;		/* requests waiting for the ring */
+	spool_io_req_t *tail;
+	unsigned int inflight;		/* in the ring, the completion ring
+					 * is twice as large so it can't
+					 * overflow */
+	bool stop;
+	pthread_cond_t work;		/* requests queued, ring space
+					 * released, or stopping */
+	pthread_t submitter;
+	pthread_t reaper;
+};
+
+static int _uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int _uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			unsigned int flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			     flags, NULL, 0);
+}
+
+static int _uring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/* request done (or failed), account it */
+static void _spool_io_complete(spool_io_t *io, spool_io_req_t *req, int res)
+{
+	req->done(req, res);
+	pthread_mutex_lock(&io->lock);
+	if (!--io->npending)
+		pthread_cond_broadcast(&io->idle);
+	pthread_mutex_unlock(&io->lock);
+}
+
+/* thread pool backend, synchronous transfer */
+static void _spool_io_worker(flusher_job_t *job, void *arg)
+{
+	spool_io_req_t *req = (spool_io_req_t *) job;
+	void *buf = req->buf;
+	size_t len = req->len;
+	off_t off = req->off;
+	int res = 0;
+
+	while (len) {
+		ssize_t n = req->op == SPOOL_IO_READ ? pread(req->fd, buf, len, off) :
+						       pwrite(req->fd, buf, len, off);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n < 0) {
+			res = -errno;
+			break;
+		}
+		if (n == 0 && req->op == SPOOL_IO_READ) {
+			memset(buf, 0, len);
+			break;
+		}
+		if (n == 0) {
+			res = -EIO;
+			break;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	_spool_io_complete((spool_io_t *) arg, req, res);
+}
+
+/* queue req for the submitter thread, engine lock must be held */
+static void _ring_queue(spool_io_ring_t *ring, spool_io_req_t *req)
+{
+	req->next = NULL;
+	if (ring->tail)
+		ring->tail->next = req;
+	else
+		ring->head = req;
+	ring->tail = req;
+	pthread_cond_signal(&ring->work);
+}
+
+static void _ring_fill(spool_io_ring_t *ring, struct io_uring_sqe *sqe,
+		       spool_io_req_t *req)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	if (req->buf_index >= 0) {
+		sqe->opcode = req->op == SPOOL_IO_READ ? IORING_OP_READ_FIXED :
+							 IORING_OP_WRITE_FIXED;
+		sqe->buf_index = req->buf_index;
+	} else {
+		sqe->opcode = req->op == SPOOL_IO_READ ? IORING_OP_READ :
+							 IORING_OP_WRITE;
+	}
+	sqe->fd = req->fd;
+	sqe->addr = (unsigned long) req->buf;
+	sqe->len = req->len;
+	sqe->off = req->off;
+	sqe->user_data = (unsigned long) req;
+}
+
+/* take back the entries of the submission ring the kernel hasn't consumed, and
+ * fail their requests with res. Only the submitter thread produces entries, and
+ * the kernel only consumes them when it enters the ring */
+static void _ring_abort(spool_io_t *io, int res)
+{
+	spool_io_ring_t *ring = io->ring;
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *ring->sq_tail, idx;
+	spool_io_req_t *failed = NULL, *req;
+
+	for (idx = head; idx != tail; ++idx) {
+		const struct io_uring_sqe *sqe = &ring->sqes[ring->sq_array[idx & *ring->sq_mask]];
+		req = (spool_io_req_t *) (unsigned long) sqe->user_data;
+		if (!req)
+			continue;	/* the NOP stopping the reaper */
+		req->next = failed;
+		failed = req;
+	}
+	__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&io->lock);
+	ring->inflight -= tail - head;
+	pthread_mutex_unlock(&io->lock);
+	while ((req = failed)) {
+		failed = req->next;
+		_spool_io_complete(io, req, res);
+	}
+}
+
+/* submit n entries of the submission ring, retrying while the kernel is busy.
+ * On other errors, the entries left are failed */
+static void _ring_submit(spool_io_t *io, unsigned int n)
+{
+	spool_io_ring_t *ring = io->ring;
+
+	while (n) {
+		int rc = _uring_enter(ring->fd, n, 0, 0);
+		if (rc < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+			sched_yield();
+			continue;
+		}
+		if (rc <= 0) {
+			_ring_abort(io, rc < 0 ? -errno : -EIO);
+			break;
+		}
+		n -= rc;
+	}
+}
+
+/* move queued requests to the submission ring, in batches */
+static void *_ring_submitter(void *arg)
+{
+	spool_io_t *io = (spool_io_t *) arg;
+	spool_io_ring_t *ring = io->ring;
+
+	pthread_mutex_lock(&io->lock);
+	for (;;) {
+		unsigned int tail = *ring->sq_tail, n = 0;
+
+		while ((!ring->head || ring->inflight == ring->sq_entries) && !ring->stop)
+			pthread_cond_wait(&ring->work, &io->lock);
+		if (!ring->head)
+			break;	/* stopping, and nothing left to submit */
+
+		while (ring->head && ring->inflight < ring->sq_entries) {
+			spool_io_req_t *req = ring->head;
+			unsigned int idx = tail & *ring->sq_mask;
+
+			ring->head = req->next;
+			if (!ring->head)
+				ring->tail = NULL;
+			_ring_fill(ring, &ring->sqes[idx], req);
+			ring->sq_array[idx] = idx;
+			tail++;
+			n++;
+			ring->inflight++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&io->lock);
+
+		_ring_submit(io, n);
+
+		pthread_mutex_lock(&io->lock);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+/* handle a completion, retrying short or interrupted transfers */
+static void _ring_complete(spool_io_t *io, spool_io_req_t *req, int res)
+{
+	spool_io_ring_t *ring = io->ring;
+
+	if (res == 0 && req->len && req->op == SPOOL_IO_READ) {
+		/* end of file */
+		memset(req->buf, 0, req->len);
+	} else if (res == 0 && req->len) {
+		res = -EIO;
+	} else if (res == -EINTR || res == -EAGAIN || (res > 0 && res < req->len)) {
+		if (res > 0) {
+			req->buf += res;
+			req->len -= res;
+			req->off += res;
+		}
+		pthread_mutex_lock(&io->lock);
+		_ring_queue(ring, req);
+		pthread_mutex_unlock(&io->lock);
+		return;
+	}
+	_spool_io_complete(io, req, res < 0 ? res : 0);
+}
+
+/* wait for completions, a NOP without request tells it to stop */
+static void *_ring_reaper(void *arg)
+{
+	spool_io_t *io = (spool_io_t *) arg;
+	spool_io_ring_t *ring = io->ring;
+	bool stop = false;
+
+	while (!stop) {
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			spool_io_req_t *req = (spool_io_req_t *) (unsigned long) cqe->user_data;
+			int res = cqe->res;
+
+			/* the slot can be reused as soon as it's consumed */
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			if (!req) {
+				stop = true;
+				continue;
+			}
+			pthread_mutex_lock(&io->lock);
+			ring->inflight--;
+			pthread_cond_signal(&ring->work);
+			pthread_mutex_unlock(&io->lock);
+			_ring_complete(io, req, res);
+		}
+	}
+	return NULL;
+}
+
+static void _ring_unmap(spool_io_ring_t *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+		munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/* the read/write opcodes came with Linux 5.6, older rings can't be used */
+static bool _ring_supported(spool_io_ring_t *ring)
+{
+	const size_t len = sizeof(struct io_uring_probe) +
+			   256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	bool ok;
+
+	if (!probe)
+		return false;
+	ok = !_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) &&
+	     probe->last_op >= IORING_OP_WRITE &&
+	     (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	     (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+/* set an io_uring instance up, NULL if it's unavailable */
+static spool_io_ring_t *_ring_create(void)
+{
+	struct io_uring_params p;
+	spool_io_ring_t *ring = calloc(1, sizeof(spool_io_ring_t));
+
+	if (!ring)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	ring->fd = _uring_setup(SPOOL_IO_DEPTH, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ptr == MAP_FAILED)
+		goto err;
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err;
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+	if (!_ring_supported(ring))
+		goto err;
+	pthread_cond_init(&ring->work, NULL);
+	return ring;
+err:
+	_ring_unmap(ring);
+	free(ring);
+	return NULL;
+}
+
+/* stop the ring threads once everything has completed */
+static void _ring_destroy(spool_io_t *io)
+{
+	spool_io_ring_t *ring = io->ring;
+	unsigned int tail, idx;
+
+	pthread_mutex_lock(&io->lock);
+	ring->stop = true;
+	pthread_cond_broadcast(&ring->work);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(ring->submitter, NULL);
+
+	/* the submitter is gone, wake the reaper up with a NOP */
+	tail = *ring->sq_tail;
+	idx = tail & *ring->sq_mask;
+	memset(&ring->sqes[idx], 0, sizeof(struct io_uring_sqe));
+	ring->sqes[idx].opcode = IORING_OP_NOP;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	_ring_submit(io, 1);
+	pthread_join(ring->reaper, NULL);
+
+	pthread_cond_destroy(&ring->work);
+	_ring_unmap(ring);
+	free(ring);
+	io->ring = NULL;
+}
+
+int spool_io_init(spool_io_t *io, spool_io_backend_t backend)
+{
+	int rc;
+
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->idle, NULL);
+	io->npending = 0;
+	io->ring = backend == SPOOL_IO_URING ? _ring_create() : NULL;
+	if (!io->ring) {
+		rc = flusher_init(&io->pool, SPOOL_IO_THREADS, _spool_io_worker, io);
+		goto out;
+	}
+
+	rc = -pthread_create(&io->ring->submitter, NULL, _ring_submitter, io);
+	if (rc) {
+		pthread_cond_destroy(&io->ring->work);
+		_ring_unmap(io->ring);
+		free(io->ring);
+		goto out;
+	}
+	rc = -pthread_create(&io->ring->reaper, NULL, _ring_reaper, io);
+	if (rc) {
+		pthread_mutex_lock(&io->lock);
+		io->ring->stop = true;
+		pthread_cond_broadcast(&io->ring->work);
+		pthread_mutex_unlock(&io->lock);
+		pthread_join(io->ring->submitter, NULL);
+		pthread_cond_destroy(&io->ring->work);
+		_ring_unmap(io->ring);
+		free(io->ring);
+	}
+out:
+	if (rc) {
+		pthread_cond_destroy(&io->idle);
+		pthread_mutex_destroy(&io->lock);
+	}
+	return rc;
+}
+
+bool spool_io_uring(const spool_io_t *io)
+{
+	return io->ring != NULL;
+}
+
+int spool_io_register_buffers(spool_io_t *io, const struct iovec *iov, unsigned int n)
+{
+	if (!io->ring)
+		return -EOPNOTSUPP;
+	/* unregistering fails if nothing is registered yet, that's fine */
+	_uring_register(io->ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	if (n && _uring_register(io->ring->fd, IORING_REGISTER_BUFFERS, (void *) iov, n))
+		return -errno;
+	return 0;
+}
+
+void spool_io_submit(spool_io_t *io, spool_io_req_t *req)
+{
+	pthread_mutex_lock(&io->lock);
+	io->npending++;
+	if (io->ring)
+		_ring_queue(io->ring, req);
+	pthread_mutex_unlock(&io->lock);
+	if (!io->ring)
+		flusher_submit(&io->pool, &req->job);
+}
+
+void spool_io_drain(spool_io_t *io)
+{
+	pthread_mutex_lock(&io->lock);
+	while (io->npending)
+		pthread_cond_wait(&io->idle, &io->lock);
+	pthread_mutex_unlock(&io->lock);
+}
+
+void spool_io_destroy(spool_io_t *io)
+{
+	spool_io_drain(io);
+	if (io->ring)
+		_ring_destroy(io);
+	else
+		flusher_destroy(&io->pool);
+	pthread_cond_destroy(&io->idle);
+	pthread_mutex_destroy(&io->lock);
+}
@@ -0,0 +1,87 @@
+#ifndef SPOOL_IO_H
+#define SPOOL_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "flusher.h"
+
+/* spool I/O engine, asynchronous reads and writes of spool files.
+ *
+ * Requests are embedded in caller structures (see spool_io_req_t) and queued
+ * without any syscall. With the io_uring backend, a submitter thread moves
+ * every queued request to the submission ring and submits them with a single
+ * io_uring_enter(), whatever the file they target, while a reaper thread waits
+ * for completions. Without io_uring (old kernel, seccomp...), requests are
+ * handed to a pool of threads doing plain pread/pwrite.
+ *
+ * Short transfers and EINTR/EAGAIN are retried by the engine, the completion
+ * callback is only called once the whole request is done, or has failed.
+ **/
+
+/* size of the io_uring submission ring */
+#define SPOOL_IO_DEPTH 64
+
+/* number of threads of the thread pool backend */
+#define SPOOL_IO_THREADS 2
+
+typedef enum spool_io_backend_ {
+	SPOOL_IO_URING,		/* io_uring, or the thread pool if unavailable */
+	SPOOL_IO_THREADS_ONLY,	/* always the thread pool */
+} spool_io_backend_t;
+
+typedef enum spool_io_op_ {
+	SPOOL_IO_READ,
+	SPOOL_IO_WRITE,
+} spool_io_op_t;
+
+typedef struct spool_io_req_ {
+	flusher_job_t job;	/* thread pool backend */
+	struct spool_io_req_ *next;	/* io_uring submission queue */
+	spool_io_op_t op;
+	int fd;
+	void *buf;
+	size_t len;
+	off_t off;
+	int buf_index;		/* registered buffer holding buf, or -1 */
+	/* called from an engine thread with len bytes transferred (res == 0),
+	 * or a negative errno value. Reads past the end of file are filled
+	 * with zeros. The callback may submit requests, including req itself */
+	void (*done)(struct spool_io_req_ *req, int res);
+} spool_io_req_t;
+
+typedef struct spool_io_ring_ spool_io_ring_t;
+
+typedef struct spool_io_ {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;		/* no request pending */
+	size_t npending;		/* submitted and not completed yet */
+	spool_io_ring_t *ring;		/* NULL with the thread pool backend */
+	flusher_t pool;
+} spool_io_t;
+
+/* start the engine. Return 0 on success, -ENOMEM or -EAGAIN if the engine
+ * threads can't be created */
+int spool_io_init(spool_io_t *io, spool_io_backend_t backend);
+
+/* return true if the engine runs on io_uring */
+bool spool_io_uring(const spool_io_t *io);
+
+/* register n buffers, so that requests using them (see buf_index) don't have
+ * to map them on each transfer. Replaces the previous registration, which must
+ * not be in use anymore. Return 0 on success, -EOPNOTSUPP with the thread pool
+ * backend, or the io_uring_register() error */
+int spool_io_register_buffers(spool_io_t *io, const struct iovec *iov, unsigned int n);
+
+/* queue a request, never blocks */
+void spool_io_submit(spool_io_t *io, spool_io_req_t *req);
+
+/* wait until every submitted request has completed */
+void spool_io_drain(spool_io_t *io);
+
+/* drain the engine and stop its threads */
+void spool_io_destroy(spool_io_t *io);
+
+#endif
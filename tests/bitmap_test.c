@@ -145,6 +145,9 @@ void test_bitmap_realloc()
 		size_t minbits = min(tt[tidx].oldnbits, tt[tidx].newnbits);
 		for (i = 0; i < minbits; ++i)
 			CU_ASSERT_EQUAL(bitmap_get(bm, i), bitmap_get(tmp, i));
+		/* added bits are reset */
+		for (i = minbits; i < tt[tidx].newnbits; ++i)
+			CU_ASSERT_FALSE(bitmap_get(bm, i));
 
 		bitmap_free(bm);
 		bitmap_free(tmp);
@@ -289,6 +292,14 @@ void test_bitmap_get_range()
 		CU_ASSERT_EQUAL_FATAL(false, bitmap_get_range(bm, 0, t->nbits - 1));
 		CU_ASSERT_EQUAL_FATAL(true, bitmap_get_range(bm, 1, t->nbits - 3));
 
+		/* a reset bit in the middle of the range */
+		bitmap_fill(bm);
+		bitmap_reset(bm, t->nbits / 2);
+		CU_ASSERT_EQUAL_FATAL(false, bitmap_get_range(bm, 0, t->nbits));
+		CU_ASSERT_EQUAL_FATAL(false, bitmap_get_range(bm, 1, t->nbits - 1));
+		CU_ASSERT_EQUAL_FATAL(true, bitmap_get_range(bm, 0, t->nbits / 2));
+		CU_ASSERT_EQUAL_FATAL(true, bitmap_get_range(bm, t->nbits / 2 + 1, t->nbits - t->nbits / 2 - 1));
+
 		bitmap_free(bm);
 	}
 }
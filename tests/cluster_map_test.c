@@ -0,0 +1,176 @@
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "test_helpers.h"
+#include "../cluster_map.h"
+
+
+/* mapped values must not be NULL, use cidx + 1 */
+#define CBUF(cidx) ((void *) (uintptr_t) ((cidx) + 1))
+
+void test_cmap_set_lookup()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	cluster_map_t map;
+	size_t i;
+
+	typedef struct test_table_ { size_t cidx; } test_table;
+
+	test_table tt[]= {
+		{ .cidx = 0 },
+		{ .cidx = 1 },
+		{ .cidx = CMAP_NODE_SIZE - 1 },
+		{ .cidx = CMAP_NODE_SIZE },
+		{ .cidx = 100 * CMAP_NODE_SIZE + 3 },
+		{ .cidx = 1 << 20 },
+	};
+
+	cmap_init(&map);
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, 0));
+	CU_ASSERT_EQUAL(0, cmap_count(&map));
+
+	/* a single cluster doesn't allocate anything */
+	CU_ASSERT_RC_SUCCESS(cmap_set, &map, 0, CBUF(0));
+	CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, 0), CBUF(0));
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, 1));
+	CU_ASSERT_EQUAL(1, cmap_count(&map));
+	CU_ASSERT_EQUAL(0, cmap_overhead(&map));
+	CU_ASSERT_RC_SUCCESS(cmap_set, &map, 0, NULL);
+	CU_ASSERT_EQUAL(0, cmap_count(&map));
+
+	for (i = 0; i < sizeof(tt) / sizeof(tt[0]); ++i) {
+		CU_ASSERT_PTR_NULL_FATAL(cmap_lookup(&map, tt[i].cidx));
+		CU_ASSERT_RC_SUCCESS(cmap_set, &map, tt[i].cidx, CBUF(tt[i].cidx));
+		CU_ASSERT_PTR_EQUAL_FATAL(cmap_lookup(&map, tt[i].cidx), CBUF(tt[i].cidx));
+	}
+	CU_ASSERT_EQUAL(sizeof(tt) / sizeof(tt[0]), cmap_count(&map));
+
+	/* all clusters are still there after the directory grew */
+	for (i = 0; i < sizeof(tt) / sizeof(tt[0]); ++i)
+		CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, tt[i].cidx), CBUF(tt[i].cidx));
+
+	/* neighbours of mapped clusters aren't mapped */
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, 2));
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, CMAP_NODE_SIZE + 1));
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, (1 << 20) + 1));
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, 1 << 30));
+
+	/* replace and unmap */
+	CU_ASSERT_RC_SUCCESS(cmap_set, &map, 1, CBUF(42));
+	CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, 1), CBUF(42));
+	CU_ASSERT_RC_SUCCESS(cmap_set, &map, 1, NULL);
+	CU_ASSERT_PTR_NULL(cmap_lookup(&map, 1));
+	CU_ASSERT_EQUAL(sizeof(tt) / sizeof(tt[0]) - 1, cmap_count(&map));
+	CU_ASSERT_RC_SUCCESS(cmap_set, &map, 1 << 30, NULL);
+
+	/* only the nodes on the paths to mapped clusters are allocated: a
+	 * root of 4 levels, the leaves of clusters 1, 64, 6403 and 1 << 20,
+	 * and the nodes between them */
+	CU_ASSERT_EQUAL(10, map.nnodes);
+
+	cmap_destroy(&map, NULL);
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_cmap_huge_index()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t huge[] = { (size_t) 1 << 40, (size_t) 1 << 51, (size_t) -1 };
+	const size_t levels = (sizeof(size_t) * 8 + CMAP_NODE_SHIFT - 1) / CMAP_NODE_SHIFT;
+	cluster_map_t map;
+	size_t i;
+
+	/* a single cluster far away only takes a node per level */
+	for (i = 0; i < sizeof(huge) / sizeof(huge[0]); ++i) {
+		cmap_init(&map);
+		/* CBUF would wrap for the largest index */
+		CU_ASSERT_RC_SUCCESS(cmap_set, &map, huge[i], (void *) &huge[i]);
+		CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, huge[i]), &huge[i]);
+		CU_ASSERT_PTR_NULL(cmap_lookup(&map, huge[i] - 1));
+		CU_ASSERT_PTR_NULL(cmap_lookup(&map, 1));
+		CU_ASSERT(map.nnodes <= levels);
+		CU_ASSERT(cmap_overhead(&map) <= levels * sizeof(cmap_node_t));
+		/* lower clusters go under the same root */
+		CU_ASSERT_RC_SUCCESS(cmap_set, &map, 1, CBUF(1));
+		CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, 1), CBUF(1));
+		CU_ASSERT_PTR_EQUAL(cmap_lookup(&map, huge[i]), &huge[i]);
+		CU_ASSERT_EQUAL(2, cmap_count(&map));
+		cmap_destroy(&map, NULL);
+	}
+
+	CU_LEAK_CHECK_END;
+}
+
+typedef struct foreach_state_ {
+	size_t next;	/* next expected cluster index */
+	size_t step;
+} foreach_state;
+
+static void _check_order(size_t cidx, void *cbuf, void *arg)
+{
+	foreach_state *st = (foreach_state *) arg;
+	/* clusters are visited by increasing index */
+	CU_ASSERT_EQUAL(st->next, cidx);
+	st->next += st->step;
+}
+
+void test_cmap_foreach_destroy()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	cluster_map_t map;
+	foreach_state st = { .next = 0, .step = 7 };
+	const size_t nclusters = 10000;
+	size_t i;
+
+	cmap_init(&map);
+	for (i = 0; i < nclusters * st.step; i += st.step) {
+		/* destroy frees the buffers */
+		CU_ASSERT_RC_SUCCESS(cmap_set, &map, i, malloc(16));
+	}
+	CU_ASSERT_EQUAL(nclusters, cmap_count(&map));
+	cmap_foreach(&map, _check_order, &st);
+	CU_ASSERT_EQUAL(nclusters * st.step, st.next);
+	cmap_destroy(&map, free);
+
+	CU_LEAK_CHECK_END;
+}
+
+int init_cmap_test_suite(void) {
+	/* init PRNG */
+	srand(time(NULL));
+	return 0;
+}
+
+int clean_cmap_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("cluster_map_suite", init_cmap_test_suite, clean_cmap_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "cluster map set/lookup", test_cmap_set_lookup)) ||
+	    (NULL == CU_add_test(pSuite, "cluster map huge index", test_cmap_huge_index)) ||
+	    (NULL == CU_add_test(pSuite, "cluster map foreach/destroy", test_cmap_foreach_destroy))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
@@ -0,0 +1,205 @@
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "test_helpers.h"
+#include "../cluster_pool.h"
+
+
+void test_cpool_recycle()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t cluster_size = 4096;
+	cluster_pool_t *pool;
+	cpool_stats_t st;
+	void *c1, *c2;
+
+	cpool_set_limit((size_t) -1);
+	pool = cpool_get(cluster_size);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pool);
+	/* one pool per cluster size */
+	CU_ASSERT_PTR_EQUAL(pool, cpool_get(cluster_size));
+	CU_ASSERT_PTR_NOT_EQUAL(pool, cpool_get(cluster_size * 2));
+
+	c1 = cpool_alloc(pool);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(c1);
+	memset(c1, 0xab, cluster_size);
+	cpool_free(pool, c1);
+
+	/* freed clusters are handed out again */
+	c2 = cpool_alloc(pool);
+	CU_ASSERT_PTR_EQUAL(c1, c2);
+	cpool_stats(pool, &st);
+	CU_ASSERT_EQUAL(cluster_size, st.cluster_size);
+	CU_ASSERT(st.nused >= 1);
+	CU_ASSERT(st.peak_used >= st.nused);
+	cpool_free(pool, c2);
+
+	cpool_destroy_all();
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_cpool_limit()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t cluster_size = 1 << 20;
+	const size_t nclusters = 64;
+	cluster_pool_t *pool;
+	cpool_stats_t st;
+	void **cbufs;
+	size_t i;
+
+	/* keep at most 2 free clusters out of the magazines */
+	cpool_set_limit(2 * cluster_size);
+	pool = cpool_get(cluster_size);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pool);
+
+	cbufs = malloc(nclusters * sizeof(void *));
+	for (i = 0; i < nclusters; ++i) {
+		cbufs[i] = cpool_alloc(pool);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(cbufs[i]);
+	}
+	cpool_stats(pool, &st);
+	CU_ASSERT_EQUAL(nclusters, st.nused);
+	CU_ASSERT_EQUAL(nclusters, st.peak_used);
+
+	for (i = 0; i < nclusters; ++i)
+		cpool_free(pool, cbufs[i]);
+	cpool_stats(pool, &st);
+	CU_ASSERT(st.ncached <= 2);
+	/* only the calling thread magazine may still hold clusters */
+	CU_ASSERT(st.nused <= CPOOL_MAGAZINE_MAX);
+	CU_ASSERT_EQUAL(nclusters, st.peak_used);
+	free(cbufs);
+
+	cpool_destroy_all();
+	cpool_set_limit((size_t) -1);
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_cpool_align()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t align = 4096;
+	cluster_pool_t *pool;
+	void *cbufs[16];
+	size_t i;
+
+	cpool_set_limit((size_t) -1);
+	cpool_set_align(align);
+	/* cluster sizes the allocator wouldn't align on pages */
+	pool = cpool_get(3 * align);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(pool);
+	for (i = 0; i < 16; ++i) {
+		cbufs[i] = cpool_alloc(pool);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(cbufs[i]);
+		CU_ASSERT_EQUAL(0, (uintptr_t) cbufs[i] % align);
+	}
+	for (i = 0; i < 16; ++i)
+		cpool_free(pool, cbufs[i]);
+	cpool_set_align(0);
+	cpool_destroy_all();
+
+	CU_LEAK_CHECK_END;
+}
+
+#define CROSS_NTHREADS 4
+#define CROSS_NCLUSTERS 1000
+
+typedef struct cross_arg_ {
+	cluster_pool_t *pool;
+	void **cbufs;
+} cross_arg;
+
+/* free clusters allocated by another thread */
+static void *_cross_free(void *arg)
+{
+	cross_arg *a = (cross_arg *) arg;
+	size_t i;
+
+	for (i = 0; i < CROSS_NCLUSTERS; ++i)
+		cpool_free(a->pool, a->cbufs[i]);
+	/* and reuse some of them */
+	for (i = 0; i < CROSS_NCLUSTERS / 2; ++i)
+		a->cbufs[i] = cpool_alloc(a->pool);
+	for (i = 0; i < CROSS_NCLUSTERS / 2; ++i)
+		cpool_free(a->pool, a->cbufs[i]);
+	return NULL;
+}
+
+void test_cpool_cross_thread_free()
+{
+	const size_t cluster_size = 8192;
+	pthread_t threads[CROSS_NTHREADS];
+	cross_arg args[CROSS_NTHREADS];
+	cpool_stats_t st;
+	size_t i, t;
+
+	cpool_set_limit((size_t) -1);
+	for (t = 0; t < CROSS_NTHREADS; ++t) {
+		args[t].pool = cpool_get(cluster_size);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(args[t].pool);
+		args[t].cbufs = malloc(CROSS_NCLUSTERS * sizeof(void *));
+		for (i = 0; i < CROSS_NCLUSTERS; ++i) {
+			args[t].cbufs[i] = cpool_alloc(args[t].pool);
+			CU_ASSERT_PTR_NOT_NULL_FATAL(args[t].cbufs[i]);
+		}
+	}
+	for (t = 0; t < CROSS_NTHREADS; ++t)
+		pthread_create(&threads[t], NULL, _cross_free, &args[t]);
+	for (t = 0; t < CROSS_NTHREADS; ++t) {
+		pthread_join(threads[t], NULL);
+		free(args[t].cbufs);
+	}
+
+	/* exited threads gave their magazines back, only the calling thread
+	 * magazine may still hold clusters */
+	cpool_stats(args[0].pool, &st);
+	CU_ASSERT(st.nused <= CPOOL_MAGAZINE_MAX);
+	CU_ASSERT_EQUAL(CROSS_NTHREADS * CROSS_NCLUSTERS, st.peak_used);
+
+	cpool_destroy_all();
+}
+
+int init_cpool_test_suite(void) {
+	/* init PRNG */
+	srand(time(NULL));
+	return 0;
+}
+
+int clean_cpool_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("cluster_pool_suite", init_cpool_test_suite, clean_cpool_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "cluster pool recycle", test_cpool_recycle)) ||
+	    (NULL == CU_add_test(pSuite, "cluster pool limit", test_cpool_limit)) ||
+	    (NULL == CU_add_test(pSuite, "cluster pool alignment", test_cpool_align)) ||
+	    (NULL == CU_add_test(pSuite, "cluster pool cross-thread free", test_cpool_cross_thread_free))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
@@ -1,10 +1,19 @@
-﻿#include <stdlib.h>
+﻿#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
 #include "test_helpers.h"
 #include "../fdcache.h"
 #include "../fdcache_internal.h"
+#include "../dir_sink.h"
 
 
 /* fdcache test suite */
@@ -69,8 +78,8 @@ void test_fdcache_read_write_ram()
 
 		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, ino1, t->block_size, t->blocks_per_cluster, &ice1);
 
-		CU_ASSERT_EQUAL_FATAL(1, fdc_write(ice1, "\x00", 1, 0, &full_cluster));
-		CU_ASSERT_EQUAL_FATAL(3, fdc_write(ice1, "\x01\x02\x03", 3, 1, &full_cluster));
+		CU_ASSERT_EQUAL_FATAL(1, fdc_write(ice1, "\x00", 1, 0, &full_cluster, NULL));
+		CU_ASSERT_EQUAL_FATAL(3, fdc_write(ice1, "\x01\x02\x03", 3, 1, &full_cluster, NULL));
 
 		char got[4];
 
@@ -103,10 +112,10 @@ void test_fdcache_get_or_create_return_codes()
 {
 	CU_LEAK_CHECK_BEGIN;
 
-	const size_t max_cache_entries = 20;
+	const size_t num_cache_entries = 20000;
 	size_t ram_fs_limit = 1024 << 20;
-	size_t i;
-	fd_cache_t ice1;
+	size_t i, nbytes;
+	fd_cache_t ice1, ice2;
 
 	fdc_init(ram_fs_limit);
 
@@ -117,12 +126,20 @@ void test_fdcache_get_or_create_return_codes()
 	/* both block size and cluster per blocks invalid */
 	CU_ASSERT_RC_EQUAL(-EINVAL, fdc_get_or_create, 0, 0, 0, &ice1);
 
-	/* create the maximum number of cache entries */
-	for (i = 0; i < max_cache_entries; ++i)
+	/* create a lot of cache entries, the entry table must grow */
+	for (i = 0; i < num_cache_entries; ++i) {
 		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, i, 1, 1, &ice1);
+		CU_ASSERT_EQUAL_FATAL(1, fdc_write(ice1, "\x01", 1, i, NULL, NULL));
+	}
 
-	/* try to create another one, should fail */
-	CU_ASSERT_RC_EQUAL(-ENFILE, fdc_get_or_create, i, 1, 1, &ice1);
+	/* all of them must still be found, with their own content */
+	for (i = 0; i < num_cache_entries; ++i) {
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, i, 1, 1, &ice1);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, i, 1, 1, &ice2);
+		CU_ASSERT_EQUAL_FATAL(ice1, ice2);
+		CU_ASSERT_RC_SUCCESS(fdc_entry_size, i, &nbytes);
+		CU_ASSERT_EQUAL_FATAL(i + 1, nbytes);
+	}
 
 	fdc_deinit();
 	CU_LEAK_CHECK_END;
@@ -143,9 +160,9 @@ void test_fdcache_ram_cluster_write_return_codes()
 	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 0, 2, 2, &ice1);
 
 	/* write 1 byte at offset 0 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 0, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 0, &full_cluster, NULL));
 	/* write 1 byte at offset 15, making the entry 16 bytes long */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 15, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 15, &full_cluster, NULL));
 
 	/* invalid offsets */
 	CU_ASSERT_EQUAL(-EINVAL, _fdc_ram_cluster_write(ice1, 0, refbuf, 1, -1, unique_cluster));
@@ -178,9 +195,9 @@ void test_fdcache_read_return_codes()
 	CU_ASSERT_RC_EQUAL(-EINVAL, fdc_read, ice1, buf, 16, -1);
 
 	/* write 1 byte at offset 0 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 0, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 1, 1, 0, &full_cluster, NULL));
 	/* write 1 byte at offset 15, making the entry 16 bytes long */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 15, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 1, 1, 15, &full_cluster, NULL));
 
 	/* reading past buffer end */
 	CU_ASSERT_RC_EQUAL(-EOVERFLOW, fdc_read, ice1, buf, 1, 16);
@@ -195,9 +212,11 @@ void test_fdcache_read_return_codes()
 	CU_ASSERT_RC_EQUAL(2, fdc_read, ice1, buf, 2, 13);
 	CU_ASSERT_RC_EQUAL(3, fdc_read, ice1, buf, 3, 12);
 
-	/* trying to read unallocated clusters */
-	CU_ASSERT_RC_EQUAL(-EFAULT, fdc_read, ice1, buf, 1, 4);
-	CU_ASSERT_RC_EQUAL(-EFAULT, fdc_read, ice1, buf, 1, 8);
+	/* unallocated clusters are holes */
+	memset(buf, 0xff, sizeof(buf));
+	CU_ASSERT_RC_EQUAL(1, fdc_read, ice1, buf, 1, 4);
+	CU_ASSERT_RC_EQUAL(4, fdc_read, ice1, buf + 1, 4, 8);
+	CU_ASSERT_EQUAL_BUFFER(buf, "\x00\x00\x00\x00\x00", 5);
 	fdc_deinit();
 	CU_LEAK_CHECK_END;
 }
@@ -208,7 +227,8 @@ void test_fdcache_entry_size_mem()
 
 	size_t ram_fs_limit = 1024 << 20;	/* 1024 MB */
 	ssize_t full_cluster;
-	const char refbuf[] = "\x00\x01\x02\x03\x04\x05\x06\x07";
+	/* no zero byte, zeros aren't stored */
+	const char refbuf[] = "\x01\x02\x03\x04\x05\x06\x07\x08";
 	size_t nbytes;
 	fd_cache_t ice1;
 	cache_ino_t ino = 0;
@@ -222,7 +242,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, ino, 2, 2, &ice1);
 
 	/* write 1 byte at offset 0 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 0, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 0, &full_cluster, NULL));
 	/* check size = 1, mem = 1 */
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(1, nbytes);
@@ -230,7 +250,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(1, nbytes);
 
 	/* write 1 byte at offset 1 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 1, 1, 1, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 1, 1, 1, &full_cluster, NULL));
 	/* check size = 2, mem = 2 */
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(2, nbytes);
@@ -238,7 +258,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(2, nbytes);
 
 	/* write 1 byte at offset 3 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 3, 1, 3, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 3, 1, 3, &full_cluster, NULL));
 	/* check size = 4, mem = 4 */
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(4, nbytes);
@@ -246,7 +266,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(4, nbytes);
 
 	/* write 1 byte at offset 4 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 4, 1, 4, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf + 4, 1, 4, &full_cluster, NULL));
 	/* check size = 5, mem = 8 */
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(5, nbytes);
@@ -267,7 +287,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(0, nbytes);
 
 	/* write 1 byte at offset 1024 (1 cluster)*/
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1024, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1024, &full_cluster, NULL));
 	/* check size = 1025, mem = 1024 */
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(1025, nbytes);
@@ -275,7 +295,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(1024, nbytes);
 
 	/* write 1 byte at offset 1023 */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1023, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1023, &full_cluster, NULL));
 	/* check size = 1025, mem = 2048 (2 clusters)*/
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(1025, nbytes);
@@ -283,7 +303,7 @@ void test_fdcache_entry_size_mem()
 	CU_ASSERT_EQUAL(2 * 1024, nbytes);
 
 	/* write 1 byte at offset 1MB */
-	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1024 * 1024, &full_cluster));
+	CU_ASSERT_EQUAL(1, fdc_write(ice1, refbuf, 1, 1024 * 1024, &full_cluster, NULL));
 	/* check size = 1+1024*1024, mem = 2048 (2 clusters)*/
 	CU_ASSERT_RC_SUCCESS(fdc_entry_size, ino, &nbytes);
 	CU_ASSERT_EQUAL(1 + 1024 * 1024, nbytes);
@@ -295,6 +315,1524 @@ void test_fdcache_entry_size_mem()
 	CU_LEAK_CHECK_END;
 }
 
+/* multi-threaded test parameters */
+#define MT_BLOCK_SIZE		4096
+#define MT_BLOCKS_PER_CLUSTER	16
+#define MT_CLUSTER_SIZE		(MT_BLOCK_SIZE * MT_BLOCKS_PER_CLUSTER)
+#define MT_ENTRY_SIZE		(1 << 20)
+#define MT_SHARED_INO		((cache_ino_t) -1)
+
+typedef struct mt_worker_arg_ {
+	cache_ino_t ino;	/* entry private to this worker */
+	size_t nerrors;
+} mt_worker_arg;
+
+static inline char _mt_pattern(cache_ino_t ino, size_t off)
+{
+	return (char) (ino * 31 + off / MT_BLOCK_SIZE);
+}
+
+static void _mt_fill(char *buf, size_t len, cache_ino_t ino, size_t off)
+{
+	size_t i;
+	for (i = 0; i < len; i += MT_BLOCK_SIZE)
+		memset(buf + i, _mt_pattern(ino, off + i), MT_BLOCK_SIZE);
+}
+
+static void *_mt_worker(void *p)
+{
+	mt_worker_arg *arg = (mt_worker_arg *) p;
+	char want[MT_CLUSTER_SIZE], got[MT_BLOCK_SIZE];
+	fd_cache_t ice, shared;
+	size_t off;
+
+	if (fdc_get_or_create(arg->ino, MT_BLOCK_SIZE, MT_BLOCKS_PER_CLUSTER, &ice) ||
+	    fdc_get_or_create(MT_SHARED_INO, MT_BLOCK_SIZE, MT_BLOCKS_PER_CLUSTER, &shared)) {
+		arg->nerrors++;
+		return NULL;
+	}
+
+	/* fill our own entry while other threads fill theirs */
+	for (off = 0; off < MT_ENTRY_SIZE; off += MT_CLUSTER_SIZE) {
+		_mt_fill(want, MT_CLUSTER_SIZE, arg->ino, off);
+		if (fdc_write(ice, want, MT_CLUSTER_SIZE, off, NULL, NULL) != MT_CLUSTER_SIZE)
+			arg->nerrors++;
+	}
+
+	/* read back our own entry and the shared one, block by block */
+	for (off = 0; off < MT_ENTRY_SIZE; off += MT_BLOCK_SIZE) {
+		_mt_fill(want, MT_BLOCK_SIZE, arg->ino, off);
+		if (fdc_read(ice, got, MT_BLOCK_SIZE, off) != MT_BLOCK_SIZE ||
+		    memcmp(got, want, MT_BLOCK_SIZE))
+			arg->nerrors++;
+
+		_mt_fill(want, MT_BLOCK_SIZE, MT_SHARED_INO, off);
+		if (fdc_read(shared, got, MT_BLOCK_SIZE, off) != MT_BLOCK_SIZE ||
+		    memcmp(got, want, MT_BLOCK_SIZE))
+			arg->nerrors++;
+	}
+	return NULL;
+}
+
+void test_fdcache_small_entries()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	size_t ram_fs_limit = 1024 << 20;	/* 1024 MB */
+	const size_t block_size = 4096;
+	const size_t blocks_per_cluster = 256;	/* 1 MB clusters */
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t entry_size = 100000;
+	fd_cache_entry_t *ent;
+	fd_cache_t ice1;
+	char *buf = malloc(entry_size), *got = malloc(entry_size);
+	size_t off, i;
+
+	for (i = 0; i < entry_size; ++i)
+		buf[i] = (char) (i * 7);
+
+	fdc_init(ram_fs_limit);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+
+	/* append in small chunks, the first cluster grows geometrically */
+	for (off = 0; off < entry_size; off += 100) {
+		CU_ASSERT_EQUAL_FATAL(100, fdc_write(ice1, buf + off, 100, off, NULL, NULL));
+		if (off + 100 <= FDC_INLINE_SIZE)
+			CU_ASSERT_PTR_EQUAL(ent->u.ram.inline_data, cmap_lookup(&ent->clusters, 0));
+		if (off + 100 == 200)
+			CU_ASSERT_EQUAL(256, ent->u.ram.cap0);
+		if (off + 100 == 5000)
+			CU_ASSERT_EQUAL(8192, ent->u.ram.cap0);
+		if (off + 100 == 60000)
+			CU_ASSERT_EQUAL(1 << FDC_SMALL_MAX_SHIFT, ent->u.ram.cap0);
+	}
+	/* promoted to a full cluster once over the largest class */
+	CU_ASSERT_EQUAL(cluster_size, ent->u.ram.cap0);
+	CU_ASSERT_EQUAL(entry_size, fdc_read(ice1, got, entry_size, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, entry_size);
+
+	/* tiny entry, stored inline */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 0, NULL, NULL));
+	CU_ASSERT_PTR_EQUAL(ent->u.ram.inline_data, cmap_lookup(&ent->clusters, 0));
+	CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 10);
+
+	/* first cluster written last, after the entry grew past it: it must be
+	 * a full cluster */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 3, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(cluster_size, ent->u.ram.cap0);
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, cluster_size - 10, NULL, NULL));
+	CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, cluster_size - 10));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 10);
+
+	fdc_deinit();
+	free(buf);
+	free(got);
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_fdcache_sparse_entries()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	size_t ram_fs_limit = 1024 << 20;	/* 1024 MB */
+	const size_t block_size = 4096;
+	const size_t blocks_per_cluster = 16;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char *buf = calloc(1, 2 * cluster_size), *got = malloc(2 * cluster_size);
+	fd_cache_t ice1;
+	size_t nbytes, i;
+
+	fdc_init(ram_fs_limit);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+	/* a few bytes far away, a single cluster is allocated */
+	CU_ASSERT_EQUAL(4, fdc_write(ice1, "data", 4, 1000 * cluster_size + 10, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+	CU_ASSERT_EQUAL(cluster_size, nbytes);
+
+	/* holes and the zeroed parts of the cluster read as zeros */
+	memset(got, 0xff, 2 * cluster_size);
+	CU_ASSERT_EQUAL(cluster_size + 14, fdc_read(ice1, got, cluster_size + 14, 999 * cluster_size));
+	memcpy(buf + cluster_size + 10, "data", 4);
+	CU_ASSERT_EQUAL_BUFFER(got, buf, cluster_size + 14);
+
+	/* zeros are never stored */
+	memset(buf, 0, 2 * cluster_size);
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice1, buf, 2 * cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(100, fdc_write(ice1, buf, 100, 10 * cluster_size - 50, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+	CU_ASSERT_EQUAL(cluster_size, nbytes);
+
+	/* zeros over part of a cluster are written */
+	CU_ASSERT_EQUAL(2, fdc_write(ice1, buf, 2, 1000 * cluster_size + 11, NULL, NULL));
+	CU_ASSERT_EQUAL(4, fdc_read(ice1, got, 4, 1000 * cluster_size + 10));
+	CU_ASSERT_EQUAL_BUFFER(got, "d" "\x00\x00" "a", 4);
+
+	/* zeros over a whole cluster turn it into a hole */
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 1000 * cluster_size, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+	CU_ASSERT_EQUAL(0, nbytes);
+	CU_ASSERT_RC_SUCCESS(fdc_entry_size, 1, &nbytes);
+	CU_ASSERT_EQUAL(1001 * cluster_size, nbytes);
+	memset(got, 0xff, 4);
+	CU_ASSERT_EQUAL(4, fdc_read(ice1, got, 4, 1000 * cluster_size + 10));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 4);
+
+	/* gaps in a small entry read as zeros */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, block_size, blocks_per_cluster, &ice1);
+	CU_ASSERT_EQUAL(4, fdc_write(ice1, "abcd", 4, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(4, fdc_write(ice1, "efgh", 4, 500, NULL, NULL));
+	memset(got, 0xff, 504);
+	CU_ASSERT_EQUAL(504, fdc_read(ice1, got, 504, 0));
+	memcpy(buf, "abcd", 4);
+	memcpy(buf + 500, "efgh", 4);
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 504);
+
+	/* a non-zero byte anywhere, at any alignment, is stored */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 3, block_size, blocks_per_cluster, &ice1);
+	memset(buf, 0, 2 * cluster_size);
+	for (i = 0; i < 300; ++i) {
+		buf[i + 3] = 1;
+		CU_ASSERT_EQUAL(300, fdc_write(ice1, buf + 3, 300, i * cluster_size, NULL, NULL));
+		CU_ASSERT_EQUAL(1, fdc_read(ice1, got, 1, i * cluster_size + i));
+		CU_ASSERT_EQUAL(1, got[0]);
+		buf[i + 3] = 0;
+	}
+	fdc_deinit();
+
+	/* a cluster 1 TiB away only takes a few map nodes */
+	fdc_init((size_t) -1);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, cluster_size, 1, &ice1);
+	CU_ASSERT_EQUAL(4, fdc_write(ice1, "data", 4, ((off_t) 1 << 40) + 10, NULL, NULL));
+	CU_ASSERT(cmap_overhead(&((fd_cache_entry_t *) ice1)->clusters) < 4096);
+	CU_ASSERT_EQUAL(4, fdc_read(ice1, got, 4, ((off_t) 1 << 40) + 10));
+	CU_ASSERT_EQUAL_BUFFER(got, "data", 4);
+	fdc_deinit();
+
+	free(buf);
+	free(got);
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_fdcache_full_clusters()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	size_t ram_fs_limit = 1024 << 20;	/* 1024 MB */
+	const size_t block_size = 512;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char *buf = malloc(8 * cluster_size);
+	ssize_t full_cluster;
+	size_t nfull, off;
+	fd_cache_t ice1, ice2, ice3;
+
+	memset(buf, 0x42, 8 * cluster_size);
+	fdc_init(ram_fs_limit);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+	/* partial cluster */
+	CU_ASSERT_EQUAL(block_size, fdc_write(ice1, buf, block_size, 0, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(-1, full_cluster);
+	CU_ASSERT_EQUAL(0, nfull);
+
+	/* completes cluster 0, and fills clusters 1 and 2 */
+	CU_ASSERT_EQUAL(3 * cluster_size - block_size,
+			fdc_write(ice1, buf, 3 * cluster_size - block_size, block_size, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(0, full_cluster);
+	CU_ASSERT_EQUAL(3, nfull);
+
+	/* cluster 4 written, without its first block, cluster 3 not at all */
+	CU_ASSERT_EQUAL(3 * block_size,
+			fdc_write(ice1, buf, 3 * block_size, 4 * cluster_size + block_size, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(-1, full_cluster);
+	CU_ASSERT_EQUAL(0, nfull);
+
+	/* rewriting part of a full cluster reports it again */
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, cluster_size + 100, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(1, full_cluster);
+	CU_ASSERT_EQUAL(1, nfull);
+
+	/* small unaligned appends fill cluster 3 */
+	for (off = 3 * cluster_size; off < 4 * cluster_size - 100; off += 100) {
+		CU_ASSERT_EQUAL(100, fdc_write(ice1, buf, 100, off, &full_cluster, &nfull));
+		CU_ASSERT_EQUAL(0, nfull);
+	}
+	CU_ASSERT_EQUAL(4 * cluster_size - off,
+			fdc_write(ice1, buf, 4 * cluster_size - off, off, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(3, full_cluster);
+	CU_ASSERT_EQUAL(1, nfull);
+
+	/* the missing block of cluster 4, zeros are tracked as written too */
+	memset(buf, 0, block_size);
+	CU_ASSERT_EQUAL(block_size, fdc_write(ice1, buf, block_size, 4 * cluster_size, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(4, full_cluster);
+	CU_ASSERT_EQUAL(1, nfull);
+
+	/* the bitmap grows with the entry */
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 1000 * cluster_size, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(1000, full_cluster);
+	CU_ASSERT_EQUAL(1, nfull);
+	CU_ASSERT(bitmap_length(((fd_cache_entry_t *) ice1)->bitmap) >= 1001 * blocks_per_cluster);
+	CU_ASSERT_EQUAL(5 * blocks_per_cluster + blocks_per_cluster,
+			bitmap_count_setbits(((fd_cache_entry_t *) ice1)->bitmap));
+
+	/* a write ending inside a cluster doesn't check past the bitmap */
+	memset(buf, 0x42, block_size);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, 16, 128, &ice2);
+	CU_ASSERT_EQUAL(64 * 16, fdc_write(ice2, buf, 64 * 16, 0, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(0, nfull);
+
+	/* bits past the grown bitmap don't complete a cluster */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 3, 16, 256, &ice3);
+	CU_ASSERT_EQUAL(100 * 16, fdc_write(ice3, buf, 100 * 16, 0, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(16, fdc_write(ice3, buf, 16, 100 * 16, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(99 * 16, fdc_write(ice3, buf, 99 * 16, 101 * 16, &full_cluster, &nfull));
+	CU_ASSERT_EQUAL(-1, full_cluster);
+	CU_ASSERT_EQUAL(0, nfull);
+
+	fdc_deinit();
+	free(buf);
+
+	CU_LEAK_CHECK_END;
+}
+
+static int _failing_push(void *arg, cache_ino_t ino, size_t cidx,
+			 const void *buf, size_t nbytes)
+{
+	return -EIO;
+}
+
+/* check the content of a cluster flushed by the directory sink */
+static void _check_flushed(const char *dir, cache_ino_t ino, size_t cidx,
+			   const char *want, size_t nbytes)
+{
+	char path[256], *got = malloc(nbytes + 1);
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%llu.%lu", dir, ino, cidx);
+	fd = open(path, O_RDONLY);
+	CU_ASSERT_FATAL(fd >= 0);
+	/* one more byte, to check the file size */
+	CU_ASSERT_EQUAL(nbytes, read(fd, got, nbytes + 1));
+	CU_ASSERT_EQUAL_BUFFER(got, want, nbytes);
+	close(fd);
+	unlink(path);
+	free(got);
+}
+
+void test_fdcache_flush()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const fdc_flush_policy_t policies[] = { FDC_FLUSH_KEEP, FDC_FLUSH_FREE };
+	char dir[] = "/tmp/fdcache_flush_XXXXXX";
+	char *buf = malloc(4 * cluster_size), *got = malloc(4 * cluster_size);
+	fdc_options_t opts;
+	fdc_sink_t sink;
+	fdc_entry_stats_t est;
+	fd_cache_t ice1;
+	size_t i, pidx, nbytes;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	CU_ASSERT_RC_SUCCESS(dir_sink_init, &sink, dir);
+	for (i = 0; i < 4 * cluster_size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	for (pidx = 0; pidx < sizeof(policies) / sizeof(policies[0]); ++pidx) {
+		const bool freed = policies[pidx] == FDC_FLUSH_FREE;
+
+		fdc_options_init(&opts);
+		opts.sink = &sink;
+		opts.flush_policy = policies[pidx];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+		/* clusters 0 and 1 complete, cluster 2 partial */
+		CU_ASSERT_EQUAL(2 * cluster_size + 10, fdc_write(ice1, buf, 2 * cluster_size + 10, 0, NULL, NULL));
+		/* cluster 3 is a hole */
+		memset(got, 0, cluster_size);
+		CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, got, cluster_size, 3 * cluster_size, NULL, NULL));
+		CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+
+		_check_flushed(dir, 1, 0, buf, cluster_size);
+		_check_flushed(dir, 1, 1, buf + cluster_size, cluster_size);
+		_check_flushed(dir, 1, 3, got, cluster_size);
+		CU_ASSERT_RC_SUCCESS(fdc_entry_stats, 1, &est);
+		CU_ASSERT_EQUAL(3, est.flushes);
+
+		CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+		CU_ASSERT_EQUAL(freed ? cluster_size : 3 * cluster_size, nbytes);
+		if (freed) {
+			/* flushed clusters are gone, the partial one is still
+			 * there */
+			CU_ASSERT_EQUAL(-ENODATA, fdc_read(ice1, got, 10, cluster_size));
+			CU_ASSERT_EQUAL(-ENODATA, fdc_write(ice1, buf, 10, 0, NULL, NULL));
+			CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, 2 * cluster_size));
+			CU_ASSERT_EQUAL_BUFFER(got, buf + 2 * cluster_size, 10);
+			/* but they can be rewritten entirely */
+			CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 0, NULL, NULL));
+			CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+			_check_flushed(dir, 1, 0, buf, cluster_size);
+		} else {
+			CU_ASSERT_EQUAL(2 * cluster_size, fdc_read(ice1, got, 2 * cluster_size, 0));
+			CU_ASSERT_EQUAL_BUFFER(got, buf, 2 * cluster_size);
+		}
+		fdc_deinit();
+	}
+
+	/* failed pushes are reported, clusters are kept */
+	sink.push = _failing_push;
+	fdc_options_init(&opts);
+	opts.sink = &sink;
+	opts.flush_policy = FDC_FLUSH_FREE;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(-EIO, fdc_flush_wait());
+	CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+	CU_ASSERT_RC_SUCCESS(fdc_entry_stats, 1, &est);
+	CU_ASSERT_EQUAL(0, est.flushes);
+	CU_ASSERT_EQUAL(cluster_size, fdc_read(ice1, got, cluster_size, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, cluster_size);
+	fdc_deinit();
+
+	/* a sink needs threads */
+	opts.flush_threads = 0;
+	CU_ASSERT_RC_EQUAL(-EINVAL, fdc_init_opts, &opts);
+
+	dir_sink_destroy(&sink);
+	CU_ASSERT_RC_SUCCESS(rmdir, dir);
+	free(buf);
+	free(got);
+}
+
+/* number of files in dir */
+static size_t _count_files(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *de;
+	size_t n = 0;
+
+	while (dir && (de = readdir(dir))) {
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			n++;
+	}
+	if (dir)
+		closedir(dir);
+	return n;
+}
+
+void test_fdcache_spill()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char dir[] = "/tmp/fdcache_spool_XXXXXX";
+	char sink_dir[] = "/tmp/fdcache_sink_XXXXXX";
+	char *buf = malloc(4 * cluster_size), *got = malloc(6 * cluster_size);
+	fd_cache_entry_t *ent;
+	fdc_options_t opts;
+	fdc_sink_t sink;
+	fd_cache_t ice1;
+	size_t i, nbytes;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(sink_dir));
+	for (i = 0; i < 4 * cluster_size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = 4 * cluster_size;
+	opts.spool_dir = dir;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+
+	/* up to the limit, the entry stays in RAM */
+	CU_ASSERT_EQUAL(2 * cluster_size + 10, fdc_write(ice1, buf, 2 * cluster_size + 10, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 3 * cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_RAM_CACHE, ent->location);
+
+	/* growing over it moves the entry to an unlinked spool file */
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice1, buf + cluster_size, 2 * cluster_size, 4 * cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+	CU_ASSERT_EQUAL(0, cmap_count(&ent->clusters));
+	CU_ASSERT_EQUAL(0, _count_files(dir));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_size, 1, &nbytes);
+	CU_ASSERT_EQUAL(6 * cluster_size, nbytes);
+	CU_ASSERT_EQUAL(6 * cluster_size, fdc_read(ice1, got, 6 * cluster_size, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 2 * cluster_size + 10);
+	for (i = 2 * cluster_size + 10; i < 3 * cluster_size; ++i)
+		CU_ASSERT_EQUAL_FATAL(0, got[i]);
+	CU_ASSERT_EQUAL_BUFFER(got + 3 * cluster_size, buf, 3 * cluster_size);
+
+	/* spilled entries are still sparse */
+	CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 1000 * cluster_size, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+	CU_ASSERT(nbytes > 0);
+	CU_ASSERT(nbytes < 100 * cluster_size);
+	CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, 1000 * cluster_size));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, 10);
+	CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, 500 * cluster_size));
+	CU_ASSERT_EQUAL(0, got[0]);
+	CU_ASSERT_EQUAL(0, got[9]);
+
+	/* zeros over a whole cluster, and trailing zeros */
+	memset(got, 0, 2 * cluster_size);
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, got, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice1, got, 2 * cluster_size, 1001 * cluster_size, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_size, 1, &nbytes);
+	CU_ASSERT_EQUAL(1003 * cluster_size, nbytes);
+	CU_ASSERT_EQUAL(cluster_size + 1, fdc_read(ice1, got, cluster_size + 1, 0));
+	for (i = 0; i < cluster_size; ++i)
+		CU_ASSERT_EQUAL_FATAL(0, got[i]);
+	CU_ASSERT_EQUAL(buf[cluster_size], got[cluster_size]);
+	CU_ASSERT_EQUAL(cluster_size, fdc_read(ice1, got, cluster_size, 1002 * cluster_size));
+	CU_ASSERT_EQUAL(0, got[cluster_size - 1]);
+	fdc_deinit();
+
+	/* a zero cluster growing the entry is punched, the file still covers
+	 * it for readers of the mapping. Clusters span several pages, so that
+	 * the tail isn't in the page holding the end of the file */
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = cluster_size / 2;
+	opts.spool_dir = dir;
+	opts.spill_io = FDC_SPILL_MMAP;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, 4 * block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+	memset(got, 'x', 4 * cluster_size + 100);
+	CU_ASSERT_EQUAL(100, fdc_write(ice1, got, 100, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(4 * cluster_size + 100, fdc_write(ice1, got, 4 * cluster_size + 100, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+	CU_ASSERT_PTR_NOT_NULL(ent->u.fs.map);
+	memset(got, 0, 4 * cluster_size);
+	CU_ASSERT_EQUAL(4 * cluster_size, fdc_write(ice1, got, 4 * cluster_size, 4 * cluster_size, NULL, NULL));
+	memset(got, 1, 100);
+	CU_ASSERT_EQUAL(100, fdc_read(ice1, got, 100, 8 * cluster_size - 172));
+	CU_ASSERT_EQUAL(0, got[0]);
+	CU_ASSERT_EQUAL(0, got[99]);
+
+	/* an entry spilled by its first write is mapped too */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+	CU_ASSERT_PTR_NOT_NULL(ent->u.fs.map);
+	CU_ASSERT_EQUAL(cluster_size, fdc_read(ice1, got, cluster_size, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, cluster_size);
+	fdc_deinit();
+
+	/* flushed and freed clusters stay so once spilled */
+	CU_ASSERT_RC_SUCCESS(dir_sink_init, &sink, sink_dir);
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = 2 * cluster_size;
+	opts.spool_dir = dir;
+	opts.sink = &sink;
+	opts.flush_policy = FDC_FLUSH_FREE;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+	ent = (fd_cache_entry_t *) ice1;
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+	CU_ASSERT_EQUAL(3 * cluster_size + 10, fdc_write(ice1, buf, 3 * cluster_size + 10, cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+	CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+	CU_ASSERT_EQUAL(-ENODATA, fdc_read(ice1, got, 10, 0));
+	CU_ASSERT_EQUAL(-ENODATA, fdc_read(ice1, got, 10, 2 * cluster_size));
+	CU_ASSERT_EQUAL(-ENODATA, fdc_write(ice1, buf, 10, cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(10, fdc_read(ice1, got, 10, 4 * cluster_size));
+	CU_ASSERT_EQUAL_BUFFER(got, buf + 3 * cluster_size, 10);
+	CU_ASSERT_EQUAL(4, ent->nevicted);
+	/* the spilled clusters were pushed from the spool file */
+	CU_ASSERT_EQUAL(4, _count_files(sink_dir));
+	_check_flushed(sink_dir, 1, 3, buf + 2 * cluster_size, cluster_size);
+	/* a freed cluster can be entirely rewritten, and is flushed again */
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf + cluster_size, cluster_size, 2 * cluster_size, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+	_check_flushed(sink_dir, 1, 2, buf + cluster_size, cluster_size);
+	fdc_deinit();
+	dir_sink_destroy(&sink);
+	for (i = 0; i < 4; ++i) {
+		char path[256];
+		snprintf(path, sizeof(path), "%s/1.%lu", sink_dir, i);
+		unlink(path);
+	}
+
+	/* the entry stays in RAM if it can't be spilled */
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = cluster_size;
+	opts.spool_dir = "/nonexistent/spool";
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(-ENOENT, fdc_write(ice1, buf, 10, cluster_size, NULL, NULL));
+	CU_ASSERT_EQUAL(cluster_size, fdc_read(ice1, got, cluster_size, 0));
+	CU_ASSERT_EQUAL_BUFFER(got, buf, cluster_size);
+	fdc_deinit();
+
+	CU_ASSERT_RC_SUCCESS(rmdir, dir);
+	CU_ASSERT_RC_SUCCESS(rmdir, sink_dir);
+	free(buf);
+	free(got);
+}
+
+void test_fdcache_spill_async()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const fdc_io_engine_t engines[] = { FDC_IO_URING, FDC_IO_THREADS };
+	char dir[] = "/tmp/fdcache_spool_XXXXXX";
+	char *buf = malloc(4 * cluster_size), *got = malloc(5 * cluster_size);
+	fd_cache_entry_t *ent;
+	fdc_options_t opts;
+	fd_cache_t ice1;
+	size_t i, eidx, nbytes;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	for (i = 0; i < 4 * cluster_size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	for (eidx = 0; eidx < sizeof(engines) / sizeof(engines[0]); ++eidx) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = 2 * cluster_size;
+		opts.spool_dir = dir;
+		opts.io_engine = engines[eidx];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+		ent = (fd_cache_entry_t *) ice1;
+
+		/* spilled clusters and the ones appended are written in the
+		 * background, and readable meanwhile */
+		CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice1, buf, 2 * cluster_size, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice1, buf + 2 * cluster_size, 2 * cluster_size, 2 * cluster_size, NULL, NULL));
+		CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+		CU_ASSERT_EQUAL(4 * cluster_size, fdc_read(ice1, got, 4 * cluster_size, 0));
+		CU_ASSERT_EQUAL_BUFFER(got, buf, 4 * cluster_size);
+
+		/* once written, only the last cluster is still in RAM, until
+		 * the writer moves on */
+		CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+		CU_ASSERT_EQUAL(1, cmap_count(&ent->clusters));
+		CU_ASSERT_PTR_NOT_NULL(cmap_lookup(&ent->clusters, 3));
+		CU_ASSERT_RC_SUCCESS(fdc_entry_mem, 1, &nbytes);
+		CU_ASSERT(nbytes >= 4 * cluster_size);
+		CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 4 * cluster_size, NULL, NULL));
+		CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+		CU_ASSERT_EQUAL(1, cmap_count(&ent->clusters));
+		CU_ASSERT_PTR_NOT_NULL(cmap_lookup(&ent->clusters, 4));
+
+		/* rewrite clusters in the spool file, and the resident one */
+		CU_ASSERT_EQUAL(cluster_size + 20, fdc_write(ice1, buf + 5, cluster_size + 20, cluster_size - 10, NULL, NULL));
+		CU_ASSERT_EQUAL(5, fdc_write(ice1, buf, 5, 4 * cluster_size + 3, NULL, NULL));
+		memmove(buf + cluster_size - 10, buf + 5, cluster_size + 20);
+		CU_ASSERT_EQUAL(4 * cluster_size + 8, fdc_read(ice1, got, 4 * cluster_size + 8, 0));
+		CU_ASSERT_EQUAL_BUFFER(got, buf, 4 * cluster_size);
+		CU_ASSERT_EQUAL_BUFFER(got + 4 * cluster_size, "\x01\x02\x03\x01\x02\x03\x04\x05", 8);
+		CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+		fdc_deinit();
+		for (i = 0; i < 4 * cluster_size; ++i)
+			buf[i] = (char) (i % 251) + 1;
+	}
+
+	CU_ASSERT_RC_SUCCESS(rmdir, dir);
+	free(buf);
+	free(got);
+}
+
+void test_fdcache_spill_direct()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t size = 64 * cluster_size;
+	const fdc_io_engine_t engines[] = { FDC_IO_SYNC, FDC_IO_URING };
+	char dir[] = "/tmp/fdcache_spool_XXXXXX";
+	char *ref = calloc(1, size), *buf = malloc(size + 1), *got = malloc(size + 1);
+	fd_cache_entry_t *ent;
+	fdc_options_t opts;
+	fd_cache_t ice1, ice2;
+	size_t i, eidx;
+	void *cbuf;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	for (i = 0; i < size + 1; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	for (eidx = 0; eidx < sizeof(engines) / sizeof(engines[0]); ++eidx) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = 2 * cluster_size;
+		opts.spool_dir = dir;
+		opts.spool_direct = true;
+		opts.spill_io = FDC_SPILL_MMAP;
+		opts.io_engine = engines[eidx];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+		ent = (fd_cache_entry_t *) ice1;
+		memset(ref, 0, size);
+
+		/* a partial first cluster, then the spill */
+		CU_ASSERT_EQUAL(100, fdc_write(ice1, buf + 1, 100, 7, NULL, NULL));
+		memcpy(ref + 7, buf + 1, 100);
+		CU_ASSERT_EQUAL(2 * cluster_size + 3, fdc_write(ice1, buf + 3, 2 * cluster_size + 3, cluster_size - 1, NULL, NULL));
+		memcpy(ref + cluster_size - 1, buf + 3, 2 * cluster_size + 3);
+		CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+		/* the filesystem of the spool directory supports O_DIRECT here,
+		 * but it's not a requirement */
+		if (ent->u.fs.align) {
+			CU_ASSERT_PTR_NULL(ent->u.fs.map);
+			CU_ASSERT_EQUAL(0, cluster_size % ent->u.fs.align);
+			CU_ASSERT(fcntl(ent->u.fs.fd, F_GETFL) & O_DIRECT);
+			cbuf = cpool_alloc(ent->pool);
+			CU_ASSERT_EQUAL(0, (uintptr_t) cbuf % ent->u.fs.align);
+			cpool_free(ent->pool, cbuf);
+		}
+
+		/* unaligned in the file and in memory, larger than the bounce
+		 * buffer */
+		CU_ASSERT_EQUAL(size - 3 * cluster_size, fdc_write(ice1, buf + 1, size - 3 * cluster_size, 2 * cluster_size + 5, NULL, NULL));
+		memcpy(ref + 2 * cluster_size + 5, buf + 1, size - 3 * cluster_size);
+		/* aligned, straight from a cluster sized buffer */
+		CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 5 * cluster_size, NULL, NULL));
+		memcpy(ref + 5 * cluster_size, buf, cluster_size);
+		/* partial blocks in the middle of a block */
+		CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 9 * cluster_size + 100, NULL, NULL));
+		memcpy(ref + 9 * cluster_size + 100, buf, 10);
+		CU_ASSERT_RC_SUCCESS(fdc_flush_wait);
+
+		CU_ASSERT_EQUAL(size - cluster_size + 5, fdc_read(ice1, got + 1, size - cluster_size + 5, 0));
+		CU_ASSERT_EQUAL_BUFFER(got + 1, ref, size - cluster_size + 5);
+		for (i = 0; i < size - cluster_size; i += cluster_size - 7) {
+			CU_ASSERT_EQUAL_FATAL(333, fdc_read(ice1, got, 333, i));
+			CU_ASSERT_EQUAL_BUFFER(got, ref + i, 333);
+		}
+		fdc_deinit();
+	}
+
+	/* clusters that aren't a multiple of the alignment stay buffered */
+	fdc_options_init(&opts);
+	opts.ram_fs_limit = 1000;
+	opts.spool_dir = dir;
+	opts.spool_direct = true;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, 100, 3, &ice2);
+	CU_ASSERT_EQUAL(2000, fdc_write(ice2, buf + 1, 2000, 1, NULL, NULL));
+	CU_ASSERT_EQUAL(IN_FS_CACHE, ((fd_cache_entry_t *) ice2)->location);
+	CU_ASSERT_EQUAL(0, ((fd_cache_entry_t *) ice2)->u.fs.align);
+	CU_ASSERT_EQUAL(2000, fdc_read(ice2, got, 2000, 1));
+	CU_ASSERT_EQUAL_BUFFER(got, buf + 1, 2000);
+	fdc_deinit();
+
+	CU_ASSERT_RC_SUCCESS(rmdir, dir);
+	free(ref);
+	free(buf);
+	free(got);
+}
+
+/* concatenate the buffers of a view into out */
+static size_t _view_copy(const fdc_view_t *view, char *out)
+{
+	size_t n = 0;
+	int i;
+
+	for (i = 0; i < view->iovcnt; ++i) {
+		memcpy(out + n, view->iov[i].iov_base, view->iov[i].iov_len);
+		n += view->iov[i].iov_len;
+	}
+	return n;
+}
+
+static void *_unpin_thread(void *arg)
+{
+	fdc_unpin((fdc_view_t *) arg);
+	return NULL;
+}
+
+void test_fdcache_pin()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const fdc_spill_io_t spill_ios[] = { FDC_SPILL_PREAD, FDC_SPILL_MMAP };
+	char dir[] = "/tmp/fdcache_spool_XXXXXX";
+	char *buf = malloc(4 * cluster_size), *got = malloc(4 * cluster_size);
+	char *pinned = malloc(4 * cluster_size);
+	fd_cache_entry_t *ent;
+	fdc_options_t opts;
+	fdc_view_t view, view2;
+	fd_cache_t ice1, ice2;
+	pthread_t thread;
+	size_t i, sidx;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	for (i = 0; i < 4 * cluster_size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	for (sidx = 0; sidx < sizeof(spill_ios) / sizeof(spill_ios[0]); ++sidx) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = 2 * cluster_size;
+		opts.spool_dir = dir;
+		opts.spill_io = spill_ios[sidx];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, block_size, blocks_per_cluster, &ice2);
+		ent = (fd_cache_entry_t *) ice1;
+
+		/* a small entry, pointing to its inline data */
+		CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(10, fdc_pin(ice1, 10, 0, &view));
+		CU_ASSERT_EQUAL(1, view.iovcnt);
+		CU_ASSERT_PTR_EQUAL(ent->u.ram.inline_data, view.iov[0].iov_base);
+		CU_ASSERT_EQUAL(-EOVERFLOW, fdc_pin(ice1, 11, 0, &view2));
+		CU_ASSERT_EQUAL(-EINVAL, fdc_pin(ice1, 1, -1, &view2));
+
+		/* the entry isn't spilled while it's pinned, the buffers it
+		 * grows out of stay valid */
+		CU_ASSERT_EQUAL(3 * cluster_size, fdc_write(ice1, buf, 3 * cluster_size, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(IN_RAM_CACHE, ent->location);
+		CU_ASSERT_EQUAL(10, fdc_pin(ice1, 10, 0, &view2));
+		CU_ASSERT_PTR_NOT_EQUAL(ent->u.ram.inline_data, view2.iov[0].iov_base);
+		fdc_unpin(&view2);
+		/* plenty of retired buffers, which can't be reclaimed yet */
+		for (i = 0; i < 1000; ++i) {
+			CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_write(ice2, buf, cluster_size, 0, NULL, NULL));
+			memset(got, 0, cluster_size);
+			CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_write(ice2, got, cluster_size, 0, NULL, NULL));
+		}
+		CU_ASSERT_EQUAL(10, _view_copy(&view, pinned));
+		CU_ASSERT_EQUAL_BUFFER(pinned, buf, 10);
+		fdc_unpin(&view);
+
+		/* clusters and holes of a RAM entry */
+		memset(got, 0, cluster_size);
+		CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, got, cluster_size, cluster_size, NULL, NULL));
+		CU_ASSERT_EQUAL(3 * cluster_size - 20, fdc_pin(ice1, 3 * cluster_size - 20, 10, &view));
+		CU_ASSERT_EQUAL(3, view.iovcnt);
+		CU_ASSERT_EQUAL(3 * cluster_size - 20, _view_copy(&view, pinned));
+		CU_ASSERT_EQUAL(3 * cluster_size - 20, fdc_read(ice1, got, 3 * cluster_size - 20, 10));
+		CU_ASSERT_EQUAL_BUFFER(pinned, got, 3 * cluster_size - 20);
+		/* released from another thread */
+		pthread_create(&thread, NULL, _unpin_thread, &view);
+		pthread_join(thread, NULL);
+		CU_ASSERT_EQUAL(0, ent->npins);
+
+		/* spilled entry, copied or pointing to the mapping */
+		CU_ASSERT_EQUAL(cluster_size, fdc_write(ice1, buf, cluster_size, 3 * cluster_size, NULL, NULL));
+		CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+		CU_ASSERT_EQUAL(4 * cluster_size - 1, fdc_pin(ice1, 4 * cluster_size - 1, 1, &view));
+		CU_ASSERT_EQUAL(4 * cluster_size - 1, _view_copy(&view, pinned));
+		CU_ASSERT_EQUAL(4 * cluster_size - 1, fdc_read(ice1, got, 4 * cluster_size - 1, 1));
+		CU_ASSERT_EQUAL_BUFFER(pinned, got, 4 * cluster_size - 1);
+		if (spill_ios[sidx] == FDC_SPILL_MMAP)
+			CU_ASSERT_PTR_NULL(view.copy);
+		/* the mapping it points to is replaced as the entry grows */
+		CU_ASSERT_EQUAL(10, fdc_write(ice1, buf, 10, 1000 * cluster_size, NULL, NULL));
+		for (i = 0; i < 1000; ++i) {
+			CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_write(ice2, buf, cluster_size, 0, NULL, NULL));
+			memset(got, 0, cluster_size);
+			CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_write(ice2, got, cluster_size, 0, NULL, NULL));
+		}
+		CU_ASSERT_EQUAL(4 * cluster_size - 1, _view_copy(&view, got));
+		CU_ASSERT_EQUAL_BUFFER(pinned, got, 4 * cluster_size - 1);
+		fdc_unpin(&view);
+		fdc_deinit();
+	}
+
+	CU_ASSERT_RC_SUCCESS(rmdir, dir);
+	free(buf);
+	free(got);
+	free(pinned);
+}
+
+/* split count bytes at buf into random segments, some of them empty. Return
+ * the number of segments */
+static int _random_iov(struct iovec *iov, int max, char *buf, size_t count)
+{
+	int n = 0;
+
+	while (count && n < max - 1) {
+		size_t len = rand() % 3 == 0 ? 0 : (size_t) rand() % (count + 1);
+		iov[n].iov_base = buf;
+		iov[n].iov_len = len;
+		buf += len;
+		count -= len;
+		n++;
+	}
+	iov[n].iov_base = buf;
+	iov[n].iov_len = count;
+	return n + 1;
+}
+
+void test_fdcache_readv_writev()
+{
+	const size_t block_size = 512;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t size = 16 * cluster_size;
+	const size_t limits[] = { (size_t) -1, 8 * cluster_size, 8 * cluster_size };
+	const fdc_spill_io_t spill_ios[] = { FDC_SPILL_PREAD, FDC_SPILL_PREAD, FDC_SPILL_MMAP };
+	char *ref = malloc(size), *buf = malloc(size), *got = malloc(size);
+	struct iovec iov[16];
+	fdc_options_t opts;
+	fd_cache_t ice1;
+	ssize_t full_cluster;
+	size_t nfull, i, t;
+	int n;
+
+	for (t = 0; t < sizeof(limits) / sizeof(limits[0]); ++t) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = limits[t];
+		opts.spill_io = spill_ios[t];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+		memset(ref, 0, size);
+		CU_ASSERT_EQUAL(size, fdc_write(ice1, ref, size, 0, NULL, NULL));
+
+		/* segments in the middle of clusters, holes, and zeros */
+		for (i = 0; i < 200; ++i) {
+			size_t off = rand() % size;
+			size_t count = rand() % (size - off) + 1;
+			size_t j;
+			for (j = 0; j < count; ++j)
+				buf[j] = rand() % 4 ? 0 : (char) rand();
+			n = _random_iov(iov, 16, buf, count);
+			CU_ASSERT_EQUAL_FATAL(count, fdc_writev(ice1, iov, n, off, NULL, NULL));
+			memcpy(ref + off, buf, count);
+		}
+		CU_ASSERT_EQUAL(size, fdc_read(ice1, got, size, 0));
+		CU_ASSERT_EQUAL_BUFFER(got, ref, size);
+		for (i = 0; i < 200; ++i) {
+			size_t off = rand() % size;
+			size_t count = rand() % (size - off) + 1;
+			memset(got, 0xff, count);
+			n = _random_iov(iov, 16, got, count);
+			CU_ASSERT_EQUAL_FATAL(count, fdc_readv(ice1, iov, n, off));
+			CU_ASSERT_EQUAL_BUFFER(got, ref + off, count);
+		}
+
+		/* full clusters are reported over the whole range */
+		iov[0].iov_base = buf;
+		iov[0].iov_len = cluster_size - 1;
+		iov[1].iov_base = buf;
+		iov[1].iov_len = cluster_size + 2;
+		CU_ASSERT_EQUAL(2 * cluster_size + 1, fdc_writev(ice1, iov, 2, size + cluster_size, &full_cluster, &nfull));
+		CU_ASSERT_EQUAL(17, full_cluster);
+		CU_ASSERT_EQUAL(2, nfull);
+
+		/* an empty vector, and invalid ones */
+		CU_ASSERT_EQUAL(0, fdc_writev(ice1, iov, 0, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(0, fdc_readv(ice1, iov, 0, 0));
+		CU_ASSERT_EQUAL(-EINVAL, fdc_writev(ice1, iov, -1, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(-EINVAL, fdc_readv(ice1, iov, -1, 0));
+		iov[1].iov_len = SIZE_MAX;
+		CU_ASSERT_EQUAL(-EINVAL, fdc_writev(ice1, iov, 2, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(-EINVAL, fdc_readv(ice1, iov, 2, 0));
+		iov[1].iov_len = 1;
+		CU_ASSERT_EQUAL(-EOVERFLOW, fdc_readv(ice1, iov, 2, size + 3 * cluster_size));
+		fdc_deinit();
+	}
+	free(ref);
+	free(buf);
+	free(got);
+}
+
+/* read exactly count bytes from fd */
+static void _read_all(int fd, char *buf, size_t count)
+{
+	while (count) {
+		ssize_t n = read(fd, buf, count);
+		CU_ASSERT_FATAL(n > 0);
+		buf += n;
+		count -= n;
+	}
+}
+
+void test_fdcache_export()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t size = 8 * cluster_size;
+	const struct {
+		size_t ram_fs_limit;
+		fdc_spill_io_t spill_io;
+		bool spool_direct;
+	} tt[] = {
+		{ (size_t) -1, FDC_SPILL_PREAD, false },
+		{ cluster_size, FDC_SPILL_PREAD, false },
+		{ cluster_size, FDC_SPILL_MMAP, false },
+		{ cluster_size, FDC_SPILL_PREAD, true },
+	};
+	char path[] = "/tmp/fdcache_export_XXXXXX";
+	char *buf = malloc(size), *ref = malloc(size), *got = malloc(size);
+	fdc_options_t opts;
+	fd_cache_t ice1;
+	int pipefd[2], sock[2], out;
+	off_t out_offset;
+	size_t i, t;
+
+	out = mkstemp(path);
+	CU_ASSERT_FATAL(out >= 0);
+	unlink(path);
+	CU_ASSERT_RC_SUCCESS(pipe, pipefd);
+	CU_ASSERT_RC_SUCCESS(socketpair, AF_UNIX, SOCK_STREAM, 0, sock);
+	for (i = 0; i < size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+
+	for (t = 0; t < sizeof(tt) / sizeof(tt[0]); ++t) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = tt[t].ram_fs_limit;
+		opts.spill_io = tt[t].spill_io;
+		opts.spool_direct = tt[t].spool_direct;
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+		/* data, a hole, and unaligned edges */
+		CU_ASSERT_EQUAL(3 * cluster_size, fdc_write(ice1, buf, 3 * cluster_size, 0, NULL, NULL));
+		CU_ASSERT_EQUAL(4 * cluster_size - 10, fdc_write(ice1, buf, 4 * cluster_size - 10, 4 * cluster_size + 10, NULL, NULL));
+		CU_ASSERT_EQUAL(size, fdc_read(ice1, ref, size, 0));
+
+		/* regular file, at an offset and at its file offset */
+		out_offset = 100;
+		CU_ASSERT_EQUAL(size - 5, fdc_export(ice1, out, &out_offset, size - 5, 5));
+		CU_ASSERT_EQUAL(size + 95, out_offset);
+		CU_ASSERT_EQUAL(size - 5, pread(out, got, size - 5, 100));
+		CU_ASSERT_EQUAL_BUFFER(got, ref + 5, size - 5);
+		CU_ASSERT_EQUAL(0, lseek(out, 0, SEEK_SET));
+		CU_ASSERT_EQUAL(size, fdc_export(ice1, out, NULL, size, 0));
+		CU_ASSERT_EQUAL(size, lseek(out, 0, SEEK_CUR));
+		CU_ASSERT_EQUAL(size, pread(out, got, size, 0));
+		CU_ASSERT_EQUAL_BUFFER(got, ref, size);
+
+		/* pipe and socket */
+		CU_ASSERT_EQUAL(size - 7, fdc_export(ice1, pipefd[1], NULL, size - 7, 3));
+		_read_all(pipefd[0], got, size - 7);
+		CU_ASSERT_EQUAL_BUFFER(got, ref + 3, size - 7);
+		CU_ASSERT_EQUAL(size, fdc_export(ice1, sock[0], NULL, size, 0));
+		_read_all(sock[1], got, size);
+		CU_ASSERT_EQUAL_BUFFER(got, ref, size);
+
+		CU_ASSERT_EQUAL(0, fdc_export(ice1, out, NULL, 0, 0));
+		CU_ASSERT_EQUAL(-ESPIPE, fdc_export(ice1, pipefd[1], &out_offset, size, 0));
+		CU_ASSERT_EQUAL(-EOVERFLOW, fdc_export(ice1, out, NULL, size + 1, 0));
+		CU_ASSERT_EQUAL(-EBADF, fdc_export(ice1, -1, NULL, size, 0));
+		CU_ASSERT_EQUAL(0, ((fd_cache_entry_t *) ice1)->npins);
+		fdc_deinit();
+	}
+
+	close(out);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(sock[0]);
+	close(sock[1]);
+	free(buf);
+	free(ref);
+	free(got);
+}
+
+void test_fdcache_import()
+{
+	const size_t block_size = 1024;
+	const size_t blocks_per_cluster = 4;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t size = 16 * cluster_size;
+	const size_t limits[] = { (size_t) -1, 4 * cluster_size };
+	char path[] = "/tmp/fdcache_import_XXXXXX";
+	char *src = calloc(1, size), *got = malloc(size);
+	fdc_options_t opts;
+	fd_cache_t ice1;
+	ssize_t full_cluster;
+	size_t i, t, nbytes, nfull;
+	int in, pipefd[2];
+
+	in = mkstemp(path);
+	CU_ASSERT_FATAL(in >= 0);
+	unlink(path);
+	/* data, with whole zero clusters in the middle */
+	for (i = 0; i < size; ++i)
+		src[i] = (i / cluster_size) % 4 == 2 ? 0 : (char) (i % 251) + 1;
+	CU_ASSERT_EQUAL(size, pwrite(in, src, size, 0));
+	CU_ASSERT_RC_SUCCESS(pipe, pipefd);
+
+	for (t = 0; t < sizeof(limits) / sizeof(limits[0]); ++t) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = limits[t];
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+		/* mapped, at unaligned offsets, short at the end of the
+		 * source */
+		CU_ASSERT_EQUAL(size - 7, fdc_import(ice1, in, 7, size, 3));
+		CU_ASSERT_RC_SUCCESS(fdc_entry_size, 1, &nbytes);
+		CU_ASSERT_EQUAL(size - 4, nbytes);
+		CU_ASSERT_EQUAL(size - 7, fdc_read(ice1, got, size - 7, 3));
+		CU_ASSERT_EQUAL_BUFFER(got, src + 7, size - 7);
+		CU_ASSERT_EQUAL(0, fdc_import(ice1, in, size, 10, 0));
+
+		/* zero clusters of the source are holes, written blocks are
+		 * recorded */
+		CU_ASSERT_EQUAL(size, fdc_import(ice1, in, 0, size, 0));
+		if (limits[t] == (size_t) -1) {
+			CU_ASSERT_EQUAL(12, cmap_count(&((fd_cache_entry_t *) ice1)->clusters));
+		}
+		CU_ASSERT_EQUAL(1, fdc_write(ice1, "x", 1, 5, &full_cluster, &nfull));
+		CU_ASSERT_EQUAL(0, full_cluster);
+		CU_ASSERT_EQUAL(1, nfull);
+
+		/* from a pipe */
+		CU_ASSERT_EQUAL(3 * cluster_size, write(pipefd[1], src + cluster_size, 3 * cluster_size));
+		close(pipefd[1]);
+		CU_ASSERT_EQUAL(3 * cluster_size, fdc_import(ice1, pipefd[0], -1, 4 * cluster_size, size + 1));
+		CU_ASSERT_EQUAL(3 * cluster_size, fdc_read(ice1, got, 3 * cluster_size, size + 1));
+		CU_ASSERT_EQUAL_BUFFER(got, src + cluster_size, 3 * cluster_size);
+		close(pipefd[0]);
+		CU_ASSERT_RC_SUCCESS(pipe, pipefd);
+
+		CU_ASSERT_EQUAL(-EBADF, fdc_import(ice1, -1, 0, size, 0));
+		CU_ASSERT_EQUAL(-EINVAL, fdc_import(ice1, in, 0, size, -1));
+		fdc_deinit();
+	}
+
+	close(in);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	free(src);
+	free(got);
+}
+
+void test_fdcache_batch()
+{
+	const size_t block_size = 512;
+	const size_t blocks_per_cluster = 2;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char *buf = malloc(4 * cluster_size), *got[4];
+	fdc_op_t ops[32];
+	fd_cache_t ice;
+	size_t i, n;
+
+	for (i = 0; i < 4 * cluster_size; ++i)
+		buf[i] = (char) (i % 251) + 1;
+	for (i = 0; i < 4; ++i)
+		got[i] = calloc(1, 4 * cluster_size);
+
+	fdc_init((size_t) -1);
+	for (i = 1; i <= 3; ++i)
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, i, block_size, blocks_per_cluster, &ice);
+
+	/* interleaved entries, out of order offsets, and a missing entry */
+	n = 0;
+	for (i = 4; i > 0; --i) {
+		ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_WRITE, .buf = buf + (i - 1) * cluster_size,
+					.off = (i - 1) * cluster_size, .len = cluster_size };
+		ops[n++] = (fdc_op_t) { .ino = 2, .op = FDC_OP_WRITE, .buf = buf,
+					.off = (i - 1) * cluster_size, .len = cluster_size };
+	}
+	ops[n++] = (fdc_op_t) { .ino = 42, .op = FDC_OP_WRITE, .buf = buf, .off = 0, .len = 10 };
+	ops[n++] = (fdc_op_t) { .ino = 3, .op = FDC_OP_WRITE, .buf = buf, .off = 0, .len = 10 };
+	ops[n++] = (fdc_op_t) { .ino = 3, .op = FDC_OP_READ, .buf = got[3], .off = 0, .len = 11 };
+	CU_ASSERT_RC_SUCCESS(fdc_batch, ops, n);
+	for (i = 0; i < 8; ++i)
+		CU_ASSERT_EQUAL(cluster_size, ops[i].result);
+	CU_ASSERT_EQUAL(-EFAULT, ops[8].result);
+	CU_ASSERT_EQUAL(10, ops[9].result);
+	CU_ASSERT_EQUAL(-EOVERFLOW, ops[10].result);
+	/* ice is entry 3 */
+	CU_ASSERT_EQUAL(10, fdc_read(ice, got[3], 10, 0));
+	CU_ASSERT_EQUAL_BUFFER(got[3], buf, 10);
+
+	/* reads run after the writes of the same batch */
+	n = 0;
+	ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_READ, .buf = got[0], .off = 0, .len = 4 * cluster_size };
+	ops[n++] = (fdc_op_t) { .ino = 2, .op = FDC_OP_READ, .buf = got[1], .off = 0, .len = 4 * cluster_size };
+	CU_ASSERT_RC_SUCCESS(fdc_batch, ops, n);
+	CU_ASSERT_EQUAL(4 * cluster_size, ops[0].result);
+	CU_ASSERT_EQUAL(4 * cluster_size, ops[1].result);
+	CU_ASSERT_EQUAL_BUFFER(got[0], buf, 4 * cluster_size);
+	for (i = 0; i < 4; ++i)
+		CU_ASSERT_EQUAL_BUFFER(got[1] + i * cluster_size, buf, cluster_size);
+
+	/* overlapping operations keep their submission order */
+	n = 0;
+	ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_WRITE, .buf = "abcd", .off = 100, .len = 4 };
+	ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_READ, .buf = got[2], .off = 98, .len = 8 };
+	ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_WRITE, .buf = "XY", .off = 99, .len = 2 };
+	ops[n++] = (fdc_op_t) { .ino = 1, .op = FDC_OP_READ, .buf = got[2] + 8, .off = 98, .len = 8 };
+	CU_ASSERT_RC_SUCCESS(fdc_batch, ops, n);
+	CU_ASSERT_EQUAL_BUFFER(got[2], "\x63\x64" "abcd" "\x69\x6a", 8);
+	CU_ASSERT_EQUAL_BUFFER(got[2] + 8, "\x63" "XY" "bcd" "\x69\x6a", 8);
+
+	/* nothing to do */
+	CU_ASSERT_RC_SUCCESS(fdc_batch, ops, 0);
+	fdc_deinit();
+
+	for (i = 0; i < 4; ++i)
+		free(got[i]);
+	free(buf);
+}
+
+void test_fdcache_stats()
+{
+	const size_t block_size = 512;
+	const size_t blocks_per_cluster = 8;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char *buf = malloc(4 * cluster_size), *got = malloc(4 * cluster_size);
+	fdc_stats_t st;
+	fdc_entry_stats_t est;
+	fdc_view_t view;
+	fd_cache_t ice, big;
+	size_t n;
+
+	memset(buf, 'x', 4 * cluster_size);
+	fdc_init(2 * cluster_size);
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(0, st.bytes_written);
+	CU_ASSERT_EQUAL(0, st.resident);
+
+	/* a small entry grows from inline data to a size class, then to a
+	 * full cluster */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice);
+	CU_ASSERT_EQUAL(10, fdc_write(ice, buf, 10, 0, NULL, NULL));
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(1, st.lookups);
+	CU_ASSERT_EQUAL(10, st.bytes_written);
+	CU_ASSERT_EQUAL(0, st.clusters_allocated);
+	CU_ASSERT_EQUAL(200, fdc_write(ice, buf, 200, 10, NULL, NULL));
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice, buf, cluster_size, 0, NULL, NULL));
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(210 + cluster_size, st.bytes_written);
+	CU_ASSERT_EQUAL(2, st.clusters_allocated);
+	CU_ASSERT_EQUAL(2, st.reallocs);
+	/* the size class buffer may not be reclaimed yet */
+	CU_ASSERT(st.resident == cluster_size || st.resident == cluster_size + 256);
+
+	/* retired buffers are freed once the last reader is gone, even
+	 * without further writes */
+	CU_ASSERT_EQUAL(10, fdc_pin(ice, 10, 0, &view));
+	fdc_unpin(&view);
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(cluster_size, st.resident);
+
+	CU_ASSERT_EQUAL(100, fdc_read(ice, got, 100, 0));
+	CU_ASSERT_RC_SUCCESS(fdc_entry_size, 1, &n);
+	fdc_stats(&st);
+	/* pinned bytes are read too */
+	CU_ASSERT_EQUAL(110, st.bytes_read);
+	CU_ASSERT_EQUAL(2, st.lookups);
+
+	/* a spill hands the clusters of the entry back */
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 2, block_size, blocks_per_cluster, &big);
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(big, buf, 2 * cluster_size, 0, NULL, NULL));
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(big, buf, 2 * cluster_size, 2 * cluster_size, NULL, NULL));
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(1, st.spills);
+	CU_ASSERT_EQUAL(4, st.clusters_allocated);
+	CU_ASSERT_EQUAL(4 * cluster_size, st.bytes_written - 210 - cluster_size);
+
+	/* the same, per entry */
+	CU_ASSERT_RC_SUCCESS(fdc_entry_stats, 1, &est);
+	CU_ASSERT_EQUAL(210 + cluster_size, est.bytes_written);
+	CU_ASSERT_RC_SUCCESS(fdc_entry_stats, 2, &est);
+	CU_ASSERT_EQUAL(4 * cluster_size, est.bytes_written);
+	CU_ASSERT_EQUAL(-EFAULT, fdc_entry_stats(3, &est));
+
+	fdc_deinit();
+	fdc_stats(&st);
+	CU_ASSERT_EQUAL(0, st.resident);
+	CU_ASSERT_EQUAL(st.clusters_allocated, st.clusters_freed);
+	free(buf);
+	free(got);
+}
+
+static void *_latency_writer(void *arg)
+{
+	fd_cache_t ice = (fd_cache_t) arg;
+	char buf[100] = { 0 };
+	int i;
+
+	for (i = 0; i < 100; ++i)
+		fdc_write(ice, buf, sizeof(buf), 0, NULL, NULL);
+	return NULL;
+}
+
+void test_fdcache_latency()
+{
+	const size_t block_size = 512;
+	const size_t blocks_per_cluster = 8;
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	char *buf = malloc(4 * cluster_size);
+	fdc_latency_t lat;
+	fd_cache_t ice;
+	pthread_t t;
+	int i;
+
+	/* zeros would be holes */
+	memset(buf, 'x', 4 * cluster_size);
+	fdc_init(2 * cluster_size);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice);
+
+	/* nothing is measured by default */
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice, buf, cluster_size, 0, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_WRITE, &lat);
+	CU_ASSERT_EQUAL(0, lat.count);
+	CU_ASSERT_EQUAL(0, lat.p99);
+
+	fdc_latency_enable(true);
+	CU_ASSERT_EQUAL(cluster_size, fdc_write(ice, buf, cluster_size, cluster_size, NULL, NULL));
+	/* histograms of all threads are merged */
+	pthread_create(&t, NULL, _latency_writer, ice);
+	pthread_join(t, NULL);
+	for (i = 0; i < 10; ++i)
+		CU_ASSERT_EQUAL(100, fdc_read(ice, buf, 100, 0));
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_WRITE, &lat);
+	CU_ASSERT_EQUAL(101, lat.count);
+	CU_ASSERT(lat.min > 0);
+	CU_ASSERT(lat.min <= lat.p50 && lat.p50 <= lat.p90 && lat.p90 <= lat.p99 &&
+		  lat.p99 <= lat.p999 && lat.p999 <= lat.max);
+	CU_ASSERT(lat.mean >= lat.min && lat.mean <= lat.max);
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_READ, &lat);
+	CU_ASSERT_EQUAL(10, lat.count);
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_ALLOC, &lat);
+	CU_ASSERT_EQUAL(1, lat.count);
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_SPILL, &lat);
+	CU_ASSERT_EQUAL(0, lat.count);
+
+	/* moving the entry to the filesystem */
+	CU_ASSERT_EQUAL(2 * cluster_size, fdc_write(ice, buf, 2 * cluster_size, 2 * cluster_size, NULL, NULL));
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_SPILL, &lat);
+	CU_ASSERT_EQUAL(1, lat.count);
+
+	fdc_latency_reset();
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_WRITE, &lat);
+	CU_ASSERT_EQUAL(0, lat.count);
+	CU_ASSERT_EQUAL(100, fdc_read(ice, buf, 100, 0));
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_READ, &lat);
+	CU_ASSERT_EQUAL(1, lat.count);
+
+	fdc_latency_enable(false);
+	CU_ASSERT_EQUAL(100, fdc_read(ice, buf, 100, 0));
+	CU_ASSERT_RC_SUCCESS(fdc_latency, FDC_LATENCY_READ, &lat);
+	CU_ASSERT_EQUAL(1, lat.count);
+	CU_ASSERT_EQUAL(-EINVAL, fdc_latency(FDC_LATENCY_NOPS, &lat));
+
+	fdc_deinit();
+	free(buf);
+}
+
+void test_fdcache_multithreaded()
+{
+	/* no leak check here: the thread library keeps some memory cached
+	 * after threads are joined */
+	size_t ram_fs_limit = 1024 << 20;	/* 1024 MB */
+	const size_t nthreads_tt[] = { 1, 2, 4, 8 };
+	char buf[MT_CLUSTER_SIZE];
+	fd_cache_t shared;
+	size_t tidx, i, off;
+
+	for (tidx = 0; tidx < sizeof(nthreads_tt) / sizeof(nthreads_tt[0]); ++tidx) {
+		const size_t nthreads = nthreads_tt[tidx];
+		pthread_t threads[nthreads];
+		mt_worker_arg args[nthreads];
+		struct timespec start, end;
+
+		fdc_init(ram_fs_limit);
+
+		/* entry read concurrently by all threads */
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, MT_SHARED_INO, MT_BLOCK_SIZE, MT_BLOCKS_PER_CLUSTER, &shared);
+		for (off = 0; off < MT_ENTRY_SIZE; off += MT_CLUSTER_SIZE) {
+			_mt_fill(buf, MT_CLUSTER_SIZE, MT_SHARED_INO, off);
+			CU_ASSERT_EQUAL_FATAL(MT_CLUSTER_SIZE, fdc_write(shared, buf, MT_CLUSTER_SIZE, off, NULL, NULL));
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < nthreads; ++i) {
+			args[i].ino = i;
+			args[i].nerrors = 0;
+			CU_ASSERT_RC_SUCCESS(pthread_create, &threads[i], NULL, _mt_worker, &args[i]);
+		}
+		for (i = 0; i < nthreads; ++i)
+			pthread_join(threads[i], NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		for (i = 0; i < nthreads; ++i)
+			CU_ASSERT_EQUAL(0, args[i].nerrors);
+
+		/* each thread writes its entry once and reads two entries */
+		double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		double mbytes = 3.0 * nthreads * MT_ENTRY_SIZE / (1 << 20);
+		printf("%s nthreads=%lu %.1f MB/s\n", __func__, nthreads, mbytes / elapsed);
+
+		fdc_deinit();
+	}
+}
+
+void test_fdcache_hugepage_backend()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t block_size = 4096;
+	const size_t blocks_per_cluster = 512;	/* one huge page per cluster */
+	const size_t cluster_size = block_size * blocks_per_cluster;
+	const size_t nclusters = 4;
+	fdc_options_t opts;
+	fd_cache_t ice1;
+	size_t off;
+	char *buf = malloc(cluster_size), *got = malloc(cluster_size);
+
+	fdc_options_init(&opts);
+	opts.backend = FDC_BACKEND_HUGEPAGE;
+	CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+	CU_ASSERT_RC_SUCCESS(fdc_get_or_create, 1, block_size, blocks_per_cluster, &ice1);
+
+	for (off = 0; off < nclusters * cluster_size; off += cluster_size) {
+		memset(buf, (int) (off / cluster_size) + 1, cluster_size);
+		CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_write(ice1, buf, cluster_size, off, NULL, NULL));
+	}
+	for (off = 0; off < nclusters * cluster_size; off += cluster_size) {
+		memset(buf, (int) (off / cluster_size) + 1, cluster_size);
+		CU_ASSERT_EQUAL_FATAL(cluster_size, fdc_read(ice1, got, cluster_size, off));
+		CU_ASSERT_EQUAL_BUFFER(got, buf, cluster_size);
+	}
+
+	/* huge pages may not be available, just make sure we can count them */
+	long nhuge = fdc_hugepages();
+	CU_ASSERT(nhuge >= 0);
+	printf("%s %ld huge pages\n", __func__, nhuge);
+
+	fdc_deinit();
+	free(buf);
+	free(got);
+
+	CU_LEAK_CHECK_END;
+}
+
+/* optimistic read test parameters */
+#define OPT_ENTRY_SIZE		(256 << 10)
+#define OPT_WRITE_SIZE		100
+#define OPT_NREADERS		4
+
+typedef struct opt_reader_arg_ {
+	cache_ino_t ino;
+	fd_cache_t ice;
+	size_t nreads;
+	size_t nerrors;
+} opt_reader_arg;
+
+static inline char _opt_pattern(size_t off)
+{
+	return (char) (off * 7 + off / 251);
+}
+
+static void *_opt_reader(void *p)
+{
+	opt_reader_arg *arg = (opt_reader_arg *) p;
+	char got[4 * OPT_WRITE_SIZE];
+	size_t size = 0, off, count, i;
+
+	/* read random ranges of the entry while it grows */
+	while (size < OPT_ENTRY_SIZE) {
+		if (fdc_entry_size(arg->ino, &size)) {
+			arg->nerrors++;
+			break;
+		}
+		if (!size)
+			continue;
+		off = rand() % size;
+		count = min(size - off, sizeof(got));
+		if (fdc_read(arg->ice, got, count, off) != count) {
+			arg->nerrors++;
+			continue;
+		}
+		for (i = 0; i < count; ++i)
+			if (got[i] != _opt_pattern(off + i))
+				arg->nerrors++;
+		arg->nreads++;
+	}
+	return NULL;
+}
+
+void test_fdcache_concurrent_read_write()
+{
+	pthread_t threads[OPT_NREADERS];
+	opt_reader_arg args[OPT_NREADERS];
+	char buf[OPT_WRITE_SIZE];
+	cache_ino_t ino = 42;
+	fdc_options_t opts;
+	fd_cache_t ice;
+	size_t off, i, tidx;
+
+	typedef struct test_table_ {
+		size_t ram_fs_limit;
+		fdc_spill_io_t spill_io;
+		fdc_io_engine_t io_engine;
+	} test_table;
+
+	/* in RAM, then spilled halfway, read with pread or through a mapping
+	 * which gets remapped as the entry grows, and written synchronously or
+	 * in the background */
+	test_table tt[] = {
+		{ .ram_fs_limit = 1024 << 20, .spill_io = FDC_SPILL_PREAD, .io_engine = FDC_IO_SYNC },
+		{ .ram_fs_limit = OPT_ENTRY_SIZE / 2, .spill_io = FDC_SPILL_PREAD, .io_engine = FDC_IO_SYNC },
+		{ .ram_fs_limit = OPT_ENTRY_SIZE / 2, .spill_io = FDC_SPILL_MMAP, .io_engine = FDC_IO_SYNC },
+		{ .ram_fs_limit = OPT_ENTRY_SIZE / 2, .spill_io = FDC_SPILL_MMAP, .io_engine = FDC_IO_URING },
+		{ .ram_fs_limit = OPT_ENTRY_SIZE / 2, .spill_io = FDC_SPILL_PREAD, .io_engine = FDC_IO_THREADS },
+	};
+
+	for (tidx = 0; tidx < sizeof(tt) / sizeof(tt[0]); ++tidx) {
+		fdc_options_init(&opts);
+		opts.ram_fs_limit = tt[tidx].ram_fs_limit;
+		opts.spill_io = tt[tidx].spill_io;
+		opts.io_engine = tt[tidx].io_engine;
+		CU_ASSERT_RC_SUCCESS(fdc_init_opts, &opts);
+
+		/* small clusters so that the first cluster gets reallocated,
+		 * and many clusters get added, while readers are copying them */
+		CU_ASSERT_RC_SUCCESS(fdc_get_or_create, ino, 64, 16, &ice);
+
+		for (i = 0; i < OPT_NREADERS; ++i) {
+			args[i].ino = ino;
+			args[i].ice = ice;
+			args[i].nreads = 0;
+			args[i].nerrors = 0;
+			CU_ASSERT_RC_SUCCESS(pthread_create, &threads[i], NULL, _opt_reader, &args[i]);
+		}
+
+		/* append to the entry, by chunks that are not aligned on
+		 * clusters */
+		for (off = 0; off < OPT_ENTRY_SIZE; off += OPT_WRITE_SIZE) {
+			size_t count = min(OPT_WRITE_SIZE, OPT_ENTRY_SIZE - off);
+			for (i = 0; i < count; ++i)
+				buf[i] = _opt_pattern(off + i);
+			CU_ASSERT_EQUAL_FATAL(count, fdc_write(ice, buf, count, off, NULL, NULL));
+		}
+
+		for (i = 0; i < OPT_NREADERS; ++i) {
+			pthread_join(threads[i], NULL);
+			CU_ASSERT_EQUAL(0, args[i].nerrors);
+			CU_ASSERT(args[i].nreads > 0);
+		}
+		if (tt[tidx].spill_io == FDC_SPILL_MMAP) {
+			fd_cache_entry_t *ent = (fd_cache_entry_t *) ice;
+			CU_ASSERT_EQUAL(IN_FS_CACHE, ent->location);
+			CU_ASSERT_PTR_NOT_NULL_FATAL(ent->u.fs.map);
+			CU_ASSERT(ent->u.fs.map->len >= OPT_ENTRY_SIZE);
+		}
+
+		fdc_deinit();
+	}
+}
+
 int init_fdcache_test_suite()
 {
 	/* init PRNG */
@@ -326,7 +1864,24 @@ int main()
 	    (NULL == CU_add_test(pSuite, "fdcache get_or_create return codes", test_fdcache_get_or_create_return_codes)) ||
 	    (NULL == CU_add_test(pSuite, "fdcache read return codes", test_fdcache_read_return_codes)) ||
 	    (NULL == CU_add_test(pSuite, "fdcache RAM cluster write return codes", test_fdcache_ram_cluster_write_return_codes)) ||
-	    (NULL == CU_add_test(pSuite, "fdcache entry size/mem", test_fdcache_entry_size_mem))) {
+	    (NULL == CU_add_test(pSuite, "fdcache entry size/mem", test_fdcache_entry_size_mem)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache small entries", test_fdcache_small_entries)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache sparse entries", test_fdcache_sparse_entries)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache full clusters", test_fdcache_full_clusters)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache flush", test_fdcache_flush)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache spill", test_fdcache_spill)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache background spill", test_fdcache_spill_async)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache direct spill", test_fdcache_spill_direct)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache pinned views", test_fdcache_pin)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache readv/writev", test_fdcache_readv_writev)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache export", test_fdcache_export)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache import", test_fdcache_import)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache batch", test_fdcache_batch)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache stats", test_fdcache_stats)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache latency", test_fdcache_latency)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache multi-threaded read/write", test_fdcache_multithreaded)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache concurrent read/write", test_fdcache_concurrent_read_write)) ||
+	    (NULL == CU_add_test(pSuite, "fdcache huge page backend", test_fdcache_hugepage_backend))) {
 		CU_cleanup_registry();
 		return CU_get_error();
 	}
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "test_helpers.h"
+#include "../flusher.h"
+
+
+typedef struct count_job_ {
+	flusher_job_t job;
+	size_t *counter;
+	unsigned int delay_us;
+} count_job;
+
+static void _count_handler(flusher_job_t *fj, void *arg)
+{
+	count_job *job = (count_job *) fj;
+	if (job->delay_us)
+		usleep(job->delay_us);
+	__atomic_add_fetch(job->counter, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch((size_t *) arg, 1, __ATOMIC_RELAXED);
+	free(job);
+}
+
+void test_flusher_drain()
+{
+	const unsigned int nthreads_tt[] = { 1, 2, 8 };
+	const size_t njobs = 1000;
+	size_t tidx, i;
+
+	for (tidx = 0; tidx < sizeof(nthreads_tt) / sizeof(nthreads_tt[0]); ++tidx) {
+		flusher_t fl;
+		size_t counter = 0, handled = 0;
+
+		CU_ASSERT_RC_SUCCESS(flusher_init, &fl, nthreads_tt[tidx], _count_handler, &handled);
+		for (i = 0; i < njobs; ++i) {
+			count_job *job = malloc(sizeof(count_job));
+			job->counter = &counter;
+			job->delay_us = i % 100 ? 0 : 1000;
+			flusher_submit(&fl, &job->job);
+		}
+		/* every job submitted before is handled once drained */
+		flusher_drain(&fl);
+		CU_ASSERT_EQUAL(njobs, counter);
+		CU_ASSERT_EQUAL(njobs, handled);
+		CU_ASSERT_EQUAL(0, flusher_pending(&fl));
+
+		/* destroy handles what's left */
+		for (i = 0; i < njobs; ++i) {
+			count_job *job = malloc(sizeof(count_job));
+			job->counter = &counter;
+			job->delay_us = 0;
+			flusher_submit(&fl, &job->job);
+		}
+		flusher_destroy(&fl);
+		CU_ASSERT_EQUAL(2 * njobs, counter);
+	}
+}
+
+int init_flusher_test_suite(void) { return 0; }
+
+int clean_flusher_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("flusher_suite", init_flusher_test_suite, clean_flusher_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "flusher drain", test_flusher_drain))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "test_helpers.h"
+#include "../histogram.h"
+
+void test_histogram_exact()
+{
+	hist_t h;
+	uint64_t v;
+
+	hist_reset(&h);
+	CU_ASSERT_EQUAL(0, hist_percentile(&h, 50));
+	/* small values have a bucket of their own */
+	for (v = 1; v <= 10; ++v)
+		hist_record(&h, v);
+	CU_ASSERT_EQUAL(10, h.count);
+	CU_ASSERT_EQUAL(55, h.sum);
+	CU_ASSERT_EQUAL(1, h.min);
+	CU_ASSERT_EQUAL(10, h.max);
+	CU_ASSERT_EQUAL(5, hist_percentile(&h, 50));
+	CU_ASSERT_EQUAL(9, hist_percentile(&h, 90));
+	CU_ASSERT_EQUAL(10, hist_percentile(&h, 100));
+	CU_ASSERT_EQUAL(1, hist_percentile(&h, 0));
+}
+
+void test_histogram_precision()
+{
+	const uint64_t values[] = { 17, 100, 1000, 12345, 1000000, 123456789,
+				    1ULL << 40, UINT64_MAX / 3, UINT64_MAX };
+	size_t i;
+
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+		hist_t h;
+		uint64_t p;
+
+		/* one value below, so that the percentile isn't capped to the
+		 * maximum */
+		hist_reset(&h);
+		hist_record(&h, values[i]);
+		hist_record(&h, UINT64_MAX);
+		p = hist_percentile(&h, 50);
+		CU_ASSERT(p >= values[i]);
+		CU_ASSERT(p - values[i] <= values[i] / 16);
+	}
+}
+
+void test_histogram_merge()
+{
+	hist_t a, b, m;
+	uint64_t v;
+
+	hist_reset(&a);
+	hist_reset(&b);
+	hist_reset(&m);
+	for (v = 0; v < 1000; ++v) {
+		hist_record(&a, v);
+		hist_record(&b, 1000 + v);
+	}
+	hist_merge(&m, &a);
+	hist_merge(&m, &b);
+	CU_ASSERT_EQUAL(2000, m.count);
+	CU_ASSERT_EQUAL(0, m.min);
+	CU_ASSERT_EQUAL(1999, m.max);
+	CU_ASSERT_EQUAL(1999 * 1000, m.sum);
+	v = hist_percentile(&m, 50);
+	CU_ASSERT(v >= 999 && v <= 999 + 999 / 16);
+	v = hist_percentile(&m, 99);
+	CU_ASSERT(v >= 1979 && v <= 1979 + 1979 / 16);
+	/* merging an empty histogram changes nothing */
+	hist_reset(&a);
+	hist_merge(&m, &a);
+	CU_ASSERT_EQUAL(0, m.min);
+	CU_ASSERT_EQUAL(2000, m.count);
+}
+
+static hist_t _shared;
+static int _stop;
+
+static void *_recorder(void *arg)
+{
+	uint64_t v;
+	for (v = 0; v < 1000000; ++v)
+		hist_record(&_shared, v % 5000);
+	__atomic_store_n(&_stop, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void test_histogram_concurrent_merge()
+{
+	pthread_t t;
+	hist_t m;
+
+	hist_reset(&_shared);
+	_stop = 0;
+	pthread_create(&t, NULL, _recorder, NULL);
+	/* merges while recording see a consistent subset of the values */
+	while (!__atomic_load_n(&_stop, __ATOMIC_ACQUIRE)) {
+		hist_reset(&m);
+		hist_merge(&m, &_shared);
+		CU_ASSERT(m.count == 0 || m.max < 5000);
+		CU_ASSERT(hist_percentile(&m, 100) < 5000);
+	}
+	pthread_join(t, NULL);
+	hist_reset(&m);
+	hist_merge(&m, &_shared);
+	CU_ASSERT_EQUAL(1000000, m.count);
+}
+
+int init_histogram_test_suite(void) { return 0; }
+
+int clean_histogram_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("histogram_suite", init_histogram_test_suite, clean_histogram_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "histogram exact", test_histogram_exact)) ||
+	    (NULL == CU_add_test(pSuite, "histogram precision", test_histogram_precision)) ||
+	    (NULL == CU_add_test(pSuite, "histogram merge", test_histogram_merge)) ||
+	    (NULL == CU_add_test(pSuite, "histogram concurrent merge", test_histogram_concurrent_merge))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
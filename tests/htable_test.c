@@ -0,0 +1,143 @@
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "test_helpers.h"
+#include "../htable.h"
+
+
+/* values stored in the table must not be NULL, use key + 1 */
+#define VAL(key) ((void *) (uintptr_t) ((key) + 1))
+
+void test_htable_insert_lookup()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	htable_t ht;
+	size_t i;
+	const size_t nkeys = 100000;
+
+	CU_ASSERT_RC_SUCCESS(htable_init, &ht, 0);
+
+	for (i = 0; i < nkeys; ++i) {
+		CU_ASSERT_PTR_NULL_FATAL(htable_lookup(&ht, i));
+		CU_ASSERT_RC_SUCCESS(htable_insert, &ht, i, VAL(i));
+		CU_ASSERT_PTR_EQUAL_FATAL(htable_lookup(&ht, i), VAL(i));
+	}
+	CU_ASSERT_EQUAL(nkeys, htable_count(&ht));
+
+	/* duplicate keys are refused */
+	CU_ASSERT_RC_EQUAL(-EEXIST, htable_insert, &ht, 0, VAL(0));
+	CU_ASSERT_RC_EQUAL(-EEXIST, htable_insert, &ht, nkeys - 1, VAL(0));
+
+	/* every key is still there after all the resizes */
+	for (i = 0; i < nkeys; ++i)
+		CU_ASSERT_PTR_EQUAL_FATAL(htable_lookup(&ht, i), VAL(i));
+
+	/* the largest key, (cache_ino_t) -1, is a valid key */
+	CU_ASSERT_RC_SUCCESS(htable_insert, &ht, (cache_ino_t) -1, VAL(0));
+	CU_ASSERT_PTR_EQUAL(htable_lookup(&ht, (cache_ino_t) -1), VAL(0));
+
+	htable_destroy(&ht);
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_htable_remove()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	htable_t ht;
+	size_t i, round;
+	const size_t nkeys = 10000;
+
+	CU_ASSERT_RC_SUCCESS(htable_init, &ht, 16);
+
+	/* unknown key */
+	CU_ASSERT_PTR_NULL(htable_remove(&ht, 1));
+
+	/* insert and remove many times, so that tombstones accumulate and
+	 * resizes happen while keys are being removed */
+	for (round = 0; round < 4; ++round) {
+		for (i = 0; i < nkeys; ++i)
+			CU_ASSERT_RC_SUCCESS(htable_insert, &ht, round * nkeys + i, VAL(i));
+
+		/* remove even keys */
+		for (i = 0; i < nkeys; i += 2)
+			CU_ASSERT_PTR_EQUAL_FATAL(htable_remove(&ht, round * nkeys + i), VAL(i));
+		CU_ASSERT_EQUAL(nkeys / 2, htable_count(&ht));
+
+		for (i = 0; i < nkeys; ++i) {
+			void *want = i % 2 ? VAL(i) : NULL;
+			CU_ASSERT_PTR_EQUAL_FATAL(htable_lookup(&ht, round * nkeys + i), want);
+		}
+
+		/* remove odd keys */
+		for (i = 1; i < nkeys; i += 2)
+			CU_ASSERT_PTR_EQUAL_FATAL(htable_remove(&ht, round * nkeys + i), VAL(i));
+		CU_ASSERT_EQUAL(0, htable_count(&ht));
+	}
+
+	htable_destroy(&ht);
+
+	CU_LEAK_CHECK_END;
+}
+
+static void _count_and_check(cache_ino_t key, void *val, void *arg)
+{
+	size_t *n = (size_t *) arg;
+	CU_ASSERT_PTR_EQUAL(val, VAL(key));
+	(*n)++;
+}
+
+void test_htable_foreach()
+{
+	htable_t ht;
+	size_t i, n = 0;
+	const size_t nkeys = 1000;
+
+	CU_ASSERT_RC_SUCCESS(htable_init, &ht, 0);
+	/* entries may be split between the current and the old table */
+	for (i = 0; i < nkeys; ++i)
+		CU_ASSERT_RC_SUCCESS(htable_insert, &ht, i, VAL(i));
+
+	htable_foreach(&ht, _count_and_check, &n);
+	CU_ASSERT_EQUAL(nkeys, n);
+
+	htable_destroy(&ht);
+}
+
+int init_htable_test_suite(void) {
+	/* init PRNG */
+	srand(time(NULL));
+	return 0;
+}
+
+int clean_htable_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("htable_suite", init_htable_test_suite, clean_htable_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "htable insert/lookup", test_htable_insert_lookup)) ||
+	    (NULL == CU_add_test(pSuite, "htable remove", test_htable_remove)) ||
+	    (NULL == CU_add_test(pSuite, "htable foreach", test_htable_foreach))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
@@ -0,0 +1,78 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_helpers.h"
+#include "../hugepage.h"
+
+
+void test_hpage_alloc_free()
+{
+	CU_LEAK_CHECK_BEGIN;
+
+	const size_t sizes[] = { 1, HPAGE_SIZE - 1, HPAGE_SIZE, HPAGE_SIZE + 1, 4 * HPAGE_SIZE };
+	size_t i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		char *buf = hpage_alloc(sizes[i]);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(buf);
+		CU_ASSERT_EQUAL(0, (uintptr_t) buf & (HPAGE_SIZE - 1));
+		/* the whole buffer is writable */
+		memset(buf, 0x5a, sizes[i]);
+		CU_ASSERT_EQUAL(0x5a, buf[sizes[i] - 1]);
+		hpage_free(buf, sizes[i]);
+	}
+
+	CU_LEAK_CHECK_END;
+}
+
+void test_hpage_count()
+{
+	const size_t size = 8 * HPAGE_SIZE;
+	long before = hpage_count();
+	char *buf = hpage_alloc(size);
+	long nhuge;
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(buf);
+	memset(buf, 1, size);
+
+	/* depends on the kernel THP settings, but never more than we mapped */
+	CU_ASSERT_FATAL(before >= 0);
+	nhuge = hpage_count() - before;
+	CU_ASSERT(nhuge >= 0);
+	CU_ASSERT(nhuge <= size / HPAGE_SIZE);
+	printf("%s %ld/%lu huge pages\n", __func__, nhuge, size / HPAGE_SIZE);
+
+	hpage_free(buf, size);
+	CU_ASSERT_EQUAL(before, hpage_count());
+}
+
+int init_hpage_test_suite(void) { return 0; }
+
+int clean_hpage_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("hugepage_suite", init_hpage_test_suite, clean_hpage_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "huge page alloc/free", test_hpage_alloc_free)) ||
+	    (NULL == CU_add_test(pSuite, "huge page count", test_hpage_count))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
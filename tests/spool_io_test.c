@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "test_helpers.h"
+#include "../spool_io.h"
+
+
+#define SPOOL_NFILES 4
+#define SPOOL_NREQS 256
+#define SPOOL_REQ_SIZE 4096
+
+typedef struct test_req_ {
+	spool_io_req_t req;
+	int res;
+	int rounds;		/* times to submit the request again */
+	spool_io_t *io;
+	size_t *ndone;
+} test_req;
+
+static void _test_done(spool_io_req_t *r, int res)
+{
+	test_req *t = (test_req *) r;
+
+	t->res = res;
+	if (!res && t->rounds) {
+		t->rounds--;
+		/* requests may be submitted again from their callback */
+		spool_io_submit(t->io, r);
+		return;
+	}
+	__atomic_add_fetch(t->ndone, 1, __ATOMIC_RELAXED);
+}
+
+static char _pattern(int file, size_t off)
+{
+	return (char) ((off * 7 + file) % 251 + 1);
+}
+
+static void _test_backend(spool_io_backend_t backend)
+{
+	char path[] = "/tmp/spool_io_XXXXXX";
+	test_req *reqs = calloc(SPOOL_NREQS, sizeof(test_req));
+	char *bufs = malloc(SPOOL_NREQS * SPOOL_REQ_SIZE);
+	size_t done = 0;
+	int fds[SPOOL_NFILES];
+	struct iovec iov;
+	spool_io_t io;
+	size_t i, j;
+	int rc;
+
+	for (i = 0; i < SPOOL_NFILES; ++i) {
+		fds[i] = mkstemp(path);
+		CU_ASSERT_FATAL(fds[i] >= 0);
+		unlink(path);
+		strcpy(path, "/tmp/spool_io_XXXXXX");
+	}
+	CU_ASSERT_RC_SUCCESS(spool_io_init, &io, backend);
+	if (backend == SPOOL_IO_THREADS_ONLY)
+		CU_ASSERT_FALSE(spool_io_uring(&io));
+
+	/* writes to several files, batched together. Some are submitted again
+	 * from their callback */
+	for (i = 0; i < SPOOL_NREQS; ++i) {
+		const int file = i % SPOOL_NFILES;
+		const size_t off = (i / SPOOL_NFILES) * SPOOL_REQ_SIZE;
+		char *buf = bufs + i * SPOOL_REQ_SIZE;
+
+		for (j = 0; j < SPOOL_REQ_SIZE; ++j)
+			buf[j] = _pattern(file, off + j);
+		reqs[i].req.op = SPOOL_IO_WRITE;
+		reqs[i].req.fd = fds[file];
+		reqs[i].req.buf = buf;
+		reqs[i].req.len = SPOOL_REQ_SIZE;
+		reqs[i].req.off = off;
+		reqs[i].req.buf_index = -1;
+		reqs[i].req.done = _test_done;
+		reqs[i].res = 1;
+		reqs[i].rounds = i % 3;
+		reqs[i].io = &io;
+		reqs[i].ndone = &done;
+		spool_io_submit(&io, &reqs[i].req);
+	}
+	spool_io_drain(&io);
+	CU_ASSERT_EQUAL(SPOOL_NREQS, done);
+	for (i = 0; i < SPOOL_NREQS; ++i)
+		CU_ASSERT_EQUAL_FATAL(0, reqs[i].res);
+
+	/* read them back, past the end of file reads as zeros */
+	memset(bufs, 0xff, SPOOL_NREQS * SPOOL_REQ_SIZE);
+	done = 0;
+	for (i = 0; i < SPOOL_NREQS + SPOOL_NFILES; ++i) {
+		test_req *t = &reqs[i % SPOOL_NREQS];
+		t->req.op = SPOOL_IO_READ;
+		t->req.fd = fds[i % SPOOL_NFILES];
+		t->req.buf = bufs + (i % SPOOL_NREQS) * SPOOL_REQ_SIZE;
+		t->req.len = SPOOL_REQ_SIZE;
+		t->req.off = (i / SPOOL_NFILES) * SPOOL_REQ_SIZE;
+		t->rounds = 0;
+		spool_io_submit(&io, &t->req);
+		if (i == SPOOL_NREQS - 1)
+			spool_io_drain(&io);
+	}
+	spool_io_drain(&io);
+	for (i = 0; i < SPOOL_NFILES; ++i) {
+		for (j = 0; j < SPOOL_REQ_SIZE; ++j)
+			CU_ASSERT_EQUAL_FATAL(0, bufs[i * SPOOL_REQ_SIZE + j]);
+	}
+	for (i = SPOOL_NFILES; i < SPOOL_NREQS; ++i) {
+		const size_t off = (i / SPOOL_NFILES) * SPOOL_REQ_SIZE;
+		for (j = 0; j < SPOOL_REQ_SIZE; ++j)
+			CU_ASSERT_EQUAL_FATAL(_pattern(i % SPOOL_NFILES, off + j),
+					      bufs[i * SPOOL_REQ_SIZE + j]);
+	}
+
+	/* registered buffers */
+	iov.iov_base = bufs;
+	iov.iov_len = SPOOL_NREQS * SPOOL_REQ_SIZE;
+	rc = spool_io_register_buffers(&io, &iov, 1);
+	if (!spool_io_uring(&io)) {
+		CU_ASSERT_EQUAL(-EOPNOTSUPP, rc);
+	} else if (!rc) {
+		char got[SPOOL_REQ_SIZE];
+
+		memset(bufs, 'x', SPOOL_REQ_SIZE);
+		reqs[0].req.op = SPOOL_IO_WRITE;
+		reqs[0].req.fd = fds[0];
+		reqs[0].req.buf = bufs;
+		reqs[0].req.len = SPOOL_REQ_SIZE;
+		reqs[0].req.off = 0;
+		reqs[0].req.buf_index = 0;
+		spool_io_submit(&io, &reqs[0].req);
+		spool_io_drain(&io);
+		CU_ASSERT_EQUAL(0, reqs[0].res);
+		CU_ASSERT_EQUAL(SPOOL_REQ_SIZE, pread(fds[0], got, SPOOL_REQ_SIZE, 0));
+		CU_ASSERT_EQUAL_BUFFER(got, bufs, SPOOL_REQ_SIZE);
+		CU_ASSERT_RC_SUCCESS(spool_io_register_buffers, &io, NULL, 0);
+	}
+
+	/* errors are reported to the callback */
+	reqs[0].req.op = SPOOL_IO_WRITE;
+	reqs[0].req.fd = -1;
+	reqs[0].req.buf_index = -1;
+	spool_io_submit(&io, &reqs[0].req);
+	spool_io_drain(&io);
+	CU_ASSERT_EQUAL(-EBADF, reqs[0].res);
+
+	spool_io_destroy(&io);
+	for (i = 0; i < SPOOL_NFILES; ++i)
+		close(fds[i]);
+	free(reqs);
+	free(bufs);
+}
+
+void test_spool_io_uring()
+{
+	_test_backend(SPOOL_IO_URING);
+}
+
+void test_spool_io_threads()
+{
+	_test_backend(SPOOL_IO_THREADS_ONLY);
+}
+
+int init_spool_io_test_suite(void) { return 0; }
+
+int clean_spool_io_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("spool_io_suite", init_spool_io_test_suite, clean_spool_io_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "spool io uring", test_spool_io_uring)) ||
+	    (NULL == CU_add_test(pSuite, "spool io thread pool", test_spool_io_threads))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
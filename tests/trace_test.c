@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "test_helpers.h"
+/* records up to info level, debug ones are compiled out */
+#undef FDC_TRACE_LEVEL
+#define FDC_TRACE_LEVEL TRACE_INFO
+#include "../trace.h"
+
+/* save the records and decode them, return the number of lines decoded for
+ * event and the greatest first argument of those in max_arg, or -1 if decoding
+ * failed */
+static long _decoded(uint32_t event, uint64_t *max_arg)
+{
+	FILE *saved = tmpfile(), *out = tmpfile();
+	char line[256], name[64];
+	long n = -1;
+
+	if (!saved || !out)
+		goto out;
+	if (trace_save(fileno(saved)))
+		goto out;
+	rewind(saved);
+	if (trace_decode(saved, out))
+		goto out;
+	rewind(out);
+	n = 0;
+	while (fgets(line, sizeof(line), out)) {
+		unsigned long long a0;
+		if (sscanf(line, "%*s %*u %63s %llu", name, &a0) != 2) {
+			n = -1;
+			break;
+		}
+		if (strcmp(name, trace_event_name(event)))
+			continue;
+		++n;
+		if (max_arg && (n == 1 || a0 > *max_arg))
+			*max_arg = a0;
+	}
+out:
+	if (saved)
+		fclose(saved);
+	if (out)
+		fclose(out);
+	return n;
+}
+
+void test_trace_levels()
+{
+	uint64_t last = 0;
+
+	trace_reset();
+	FDC_TRACE(TRACE_ERROR, TRACE_FLUSH, 1, 0, 0, 0);
+	FDC_TRACE(TRACE_INFO, TRACE_SPILL, 2, 0, 0, 0);
+	FDC_TRACE(TRACE_DEBUG, TRACE_RAM_WRITE, 3, 0, 0, 0);
+	CU_ASSERT_EQUAL(1, _decoded(TRACE_FLUSH, &last));
+	CU_ASSERT_EQUAL(1, last);
+	CU_ASSERT_EQUAL(1, _decoded(TRACE_SPILL, &last));
+	CU_ASSERT_EQUAL(2, last);
+	CU_ASSERT_EQUAL(0, _decoded(TRACE_RAM_WRITE, NULL));
+	trace_reset();
+	CU_ASSERT_EQUAL(0, _decoded(TRACE_FLUSH, NULL));
+}
+
+void test_trace_wrap()
+{
+	const uint64_t n = 3 * TRACE_RING_SIZE + 5;
+	uint64_t i, last = 0;
+
+	trace_reset();
+	for (i = 0; i < n; ++i)
+		FDC_TRACE(TRACE_INFO, TRACE_FS_WRITE, i, 0, 0, 0);
+	/* the newest records are kept */
+	CU_ASSERT_EQUAL(TRACE_RING_SIZE, _decoded(TRACE_FS_WRITE, &last));
+	CU_ASSERT_EQUAL(n - 1, last);
+	trace_reset();
+}
+
+#define NTHREADS 8
+#define NRECORDS 1000
+
+static void *_tracer(void *arg)
+{
+	uint64_t i;
+	for (i = 0; i < NRECORDS; ++i)
+		FDC_TRACE(TRACE_INFO, TRACE_FS_READ, i, (uintptr_t) arg, 0, 0);
+	return NULL;
+}
+
+void test_trace_threads()
+{
+	pthread_t threads[NTHREADS];
+	uintptr_t i;
+
+	trace_reset();
+	for (i = 0; i < NTHREADS; ++i)
+		pthread_create(&threads[i], NULL, _tracer, (void *) i);
+	/* records are saved while being taken */
+	CU_ASSERT(_decoded(TRACE_FS_READ, NULL) >= 0);
+	for (i = 0; i < NTHREADS; ++i)
+		pthread_join(threads[i], NULL);
+	/* records of exited threads are kept */
+	CU_ASSERT_EQUAL(NTHREADS * NRECORDS, _decoded(TRACE_FS_READ, NULL));
+	trace_reset();
+}
+
+#define NSEQUENTIAL 64
+
+static void *_short_tracer(void *arg)
+{
+	FDC_TRACE(TRACE_INFO, TRACE_EVICT, (uintptr_t) arg, 0, 0, 0);
+	return NULL;
+}
+
+void test_trace_thread_exit()
+{
+	const size_t nrings = trace_nrings();
+	pthread_t thread;
+	uintptr_t i;
+
+	trace_reset();
+	/* rings of exited threads are reused, the number of rings doesn't grow
+	 * with the number of threads */
+	for (i = 0; i < NSEQUENTIAL; ++i) {
+		pthread_create(&thread, NULL, _short_tracer, (void *) i);
+		pthread_join(thread, NULL);
+	}
+	CU_ASSERT(trace_nrings() <= nrings + 1);
+	/* and their records are kept until overwritten */
+	CU_ASSERT_EQUAL(NSEQUENTIAL, _decoded(TRACE_EVICT, NULL));
+	trace_reset();
+}
+
+void test_trace_decode_invalid()
+{
+	FILE *in = tmpfile(), *out = tmpfile();
+
+	CU_ASSERT_FATAL(in && out);
+	fputs("not a trace, definitely not a trace", in);
+	rewind(in);
+	CU_ASSERT_EQUAL(-EINVAL, trace_decode(in, out));
+	CU_ASSERT_EQUAL(0, ftell(out));
+	fclose(in);
+	fclose(out);
+}
+
+int init_trace_test_suite(void) { return 0; }
+
+int clean_trace_test_suite(void) { return 0; }
+
+int main()
+{
+	int rc = EXIT_FAILURE;
+	CU_pSuite pSuite = NULL;
+
+	if (CUE_SUCCESS != CU_initialize_registry())
+		return CU_get_error();
+
+	pSuite = CU_add_suite("trace_suite", init_trace_test_suite, clean_trace_test_suite);
+	if (NULL == pSuite) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	if ((NULL == CU_add_test(pSuite, "trace levels", test_trace_levels)) ||
+	    (NULL == CU_add_test(pSuite, "trace wrap", test_trace_wrap)) ||
+	    (NULL == CU_add_test(pSuite, "trace threads", test_trace_threads)) ||
+	    (NULL == CU_add_test(pSuite, "trace thread exit", test_trace_thread_exit)) ||
+	    (NULL == CU_add_test(pSuite, "trace decode invalid", test_trace_decode_invalid))) {
+		CU_cleanup_registry();
+		return CU_get_error();
+	}
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	rc = (CU_get_number_of_failures() != 0) ? 1 : 0;
+	CU_cleanup_registry();
+	return rc;
+}
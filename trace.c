@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include "trace.h"
+
+#define TRACE_MAGIC "FDCTRACE"
+#define TRACE_VERSION 1
+
+typedef struct trace_header_ {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t nrecords;
+} trace_header_t;
+
+typedef struct trace_ring_ {
+	struct trace_ring_ *next;
+	uint32_t tid;
+	int in_use;			/* cleared when the thread exits */
+	uint64_t head;			/* number of records written */
+	uint64_t saved;			/* head seen by trace_save */
+	trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static const char *_event_names[TRACE_NEVENTS] = {
+	[TRACE_RAM_WRITE] = "ram_write",
+	[TRACE_RAM_READ] = "ram_read",
+	[TRACE_FS_WRITE] = "fs_write",
+	[TRACE_FS_READ] = "fs_read",
+	[TRACE_SPILL] = "spill",
+	[TRACE_EVICT] = "evict",
+	[TRACE_FLUSH] = "flush",
+};
+
+/* rings of all threads, exited ones included. The ring of an exited thread
+ * is kept, records included, until another thread takes it over */
+static pthread_mutex_t _rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *_rings;
+static size_t _nrings;
+
+static __thread trace_ring_t *_ring;
+static pthread_key_t _ring_key;
+static pthread_once_t _ring_key_once = PTHREAD_ONCE_INIT;
+
+static void _ring_thread_exit(void *arg)
+{
+	trace_ring_t *ring = (trace_ring_t *) arg;
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _ring_make_key(void)
+{
+	pthread_key_create(&_ring_key, _ring_thread_exit);
+}
+
+/* find a ring for the calling thread, NULL if it can't be mapped */
+static trace_ring_t *_ring_new(void)
+{
+	trace_ring_t *ring;
+
+	pthread_once(&_ring_key_once, _ring_make_key);
+	pthread_mutex_lock(&_rings_lock);
+	for (ring = _rings; ring; ring = ring->next) {
+		if (!__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE))
+			break;
+	}
+	if (!ring) {
+		/* rings are mapped rather than allocated, they don't show up
+		 * in the memory accounting of the cache */
+		ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ring == MAP_FAILED) {
+			pthread_mutex_unlock(&_rings_lock);
+			return NULL;
+		}
+		ring->next = _rings;
+		_rings = ring;
+		++_nrings;
+	}
+	/* records of the previous owner keep their tid, and are overwritten
+	 * as the ring wraps */
+	ring->tid = syscall(SYS_gettid);
+	__atomic_store_n(&ring->in_use, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&_rings_lock);
+	pthread_setspecific(_ring_key, ring);
+	_ring = ring;
+	return ring;
+}
+
+void trace_record(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	trace_ring_t *ring = _ring;
+	trace_record_t *r;
+	struct timespec ts;
+
+	if (__builtin_expect(!ring, 0)) {
+		ring = _ring_new();
+		if (!ring)
+			return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+	r->ts = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->event = event;
+	r->tid = ring->tid;
+	r->args[0] = a0;
+	r->args[1] = a1;
+	r->args[2] = a2;
+	r->args[3] = a3;
+	/* the record is complete before savers see it */
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+const char *trace_event_name(uint32_t event)
+{
+	if (event >= TRACE_NEVENTS || !_event_names[event])
+		return "unknown";
+	return _event_names[event];
+}
+
+static int _write_all(int fd, const void *buf, size_t count)
+{
+	while (count) {
+		ssize_t n = write(fd, buf, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		buf += n;
+		count -= n;
+	}
+	return 0;
+}
+
+int trace_save(int fd)
+{
+	trace_header_t hdr;
+	trace_ring_t *ring;
+	int rc;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.record_size = sizeof(trace_record_t);
+
+	pthread_mutex_lock(&_rings_lock);
+	for (ring = _rings; ring; ring = ring->next) {
+		ring->saved = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		hdr.nrecords += ring->saved < TRACE_RING_SIZE ? ring->saved : TRACE_RING_SIZE;
+	}
+	rc = _write_all(fd, &hdr, sizeof(hdr));
+	for (ring = _rings; !rc && ring; ring = ring->next) {
+		/* the oldest records may be overwritten meanwhile by a
+		 * running thread, they're decoded as they are */
+		uint64_t head = ring->saved;
+		uint64_t first = head < TRACE_RING_SIZE ? 0 : head - TRACE_RING_SIZE;
+		uint64_t i;
+		for (i = first; !rc && i < head; ++i)
+			rc = _write_all(fd, &ring->records[i & (TRACE_RING_SIZE - 1)],
+					sizeof(trace_record_t));
+	}
+	pthread_mutex_unlock(&_rings_lock);
+	return rc;
+}
+
+static int _record_cmp(const void *a, const void *b)
+{
+	const trace_record_t *x = a, *y = b;
+	if (x->ts != y->ts)
+		return x->ts < y->ts ? -1 : 1;
+	return x->tid < y->tid ? -1 : x->tid > y->tid;
+}
+
+int trace_decode(FILE *in, FILE *out)
+{
+	trace_header_t hdr;
+	trace_record_t *records;
+	uint64_t i;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != TRACE_VERSION ||
+	    hdr.record_size != sizeof(trace_record_t))
+		return -EINVAL;
+	records = malloc((hdr.nrecords ? hdr.nrecords : 1) * sizeof(trace_record_t));
+	if (!records)
+		return -ENOMEM;
+	if (fread(records, sizeof(trace_record_t), hdr.nrecords, in) != hdr.nrecords) {
+		free(records);
+		return -EINVAL;
+	}
+
+	qsort(records, hdr.nrecords, sizeof(trace_record_t), _record_cmp);
+	for (i = 0; i < hdr.nrecords; ++i) {
+		const trace_record_t *r = &records[i];
+		fprintf(out, "%llu.%09llu %u %s %llu %llu %llu %llu\n",
+			(unsigned long long) r->ts / 1000000000ULL,
+			(unsigned long long) r->ts % 1000000000ULL,
+			r->tid, trace_event_name(r->event),
+			(unsigned long long) r->args[0], (unsigned long long) r->args[1],
+			(unsigned long long) r->args[2], (unsigned long long) r->args[3]);
+	}
+	free(records);
+	return 0;
+}
+
+size_t trace_nrings(void)
+{
+	size_t n;
+
+	pthread_mutex_lock(&_rings_lock);
+	n = _nrings;
+	pthread_mutex_unlock(&_rings_lock);
+	return n;
+}
+
+void trace_reset(void)
+{
+	trace_ring_t *ring;
+
+	/* rings stay mapped, running threads keep theirs */
+	pthread_mutex_lock(&_rings_lock);
+	for (ring = _rings; ring; ring = ring->next) {
+		__atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+		ring->saved = 0;
+	}
+	pthread_mutex_unlock(&_rings_lock);
+}
@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* tracing, binary records in per-thread ring buffers.
+ *
+ * FDC_TRACE() calls whose level is above FDC_TRACE_LEVEL compile to nothing,
+ * and so does every call at the default level 0. Enabled calls write a fixed
+ * size record (timestamp, event, 4 integer arguments) to a ring buffer of the
+ * calling thread, without any lock nor formatting. Once full, a ring buffer
+ * overwrites its oldest records.
+ *
+ * trace_save() writes the records of all threads to a file descriptor, to be
+ * decoded offline by fdc_trace_dump (see trace_decode()).
+ **/
+
+#ifndef FDC_TRACE_LEVEL
+#define FDC_TRACE_LEVEL 0
+#endif
+
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+/* number of records of a ring buffer, a power of two */
+#define TRACE_RING_SIZE 8192
+
+typedef enum trace_event_ {
+	TRACE_RAM_WRITE,	/* ino, cidx, count, coff */
+	TRACE_RAM_READ,		/* ino, cidx, count, coff */
+	TRACE_FS_WRITE,		/* ino, offset, count */
+	TRACE_FS_READ,		/* ino, offset, count */
+	TRACE_SPILL,		/* ino, total size, rc */
+	TRACE_EVICT,		/* ino, cidx */
+	TRACE_FLUSH,		/* ino, cidx, rc */
+	TRACE_NEVENTS
+} trace_event_t;
+
+typedef struct trace_record_ {
+	uint64_t ts;		/* CLOCK_MONOTONIC, in ns */
+	uint32_t event;
+	uint32_t tid;
+	uint64_t args[4];
+} trace_record_t;
+
+/* record an event, see FDC_TRACE() */
+void trace_record(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3);
+
+#if FDC_TRACE_LEVEL > 0
+#define FDC_TRACE(level, event, a0, a1, a2, a3) do {				\
+	if ((level) <= FDC_TRACE_LEVEL)						\
+		trace_record((event), (uint64_t) (a0), (uint64_t) (a1),		\
+			     (uint64_t) (a2), (uint64_t) (a3));			\
+} while (0)
+#else
+#define FDC_TRACE(level, event, a0, a1, a2, a3) do { } while (0)
+#endif
+
+/* return the name of an event */
+const char *trace_event_name(uint32_t event);
+
+/* write the records of all threads to fd. Return 0 or a negative errno
+ * value */
+int trace_save(int fd);
+
+/* decode records written by trace_save() from in, and print them to out in
+ * timestamp order. Return 0, -EINVAL if in isn't a trace, or -ENOMEM */
+int trace_decode(FILE *in, FILE *out);
+
+/* drop all the records. No thread may be tracing meanwhile */
+void trace_reset(void);
+
+/* return the number of ring buffers. The ring of an exited thread is reused
+ * by the next thread that starts tracing, so this is the highest number of
+ * threads that traced at the same time */
+size_t trace_nrings(void);
+
+#endif
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+
+/* decode a trace written by fdc_trace_save, one record per line:
+ * <seconds>.<ns> <tid> <event> <arg0> <arg1> <arg2> <arg3> */
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	int rc;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [trace file]\n", argv[0]);
+		return 2;
+	}
+	if (argc == 2 && !(in = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	rc = trace_decode(in, stdout);
+	if (in != stdin)
+		fclose(in);
+	if (rc) {
+		fprintf(stderr, "%s: %s\n", argc == 2 ? argv[1] : "stdin", strerror(-rc));
+		return 1;
+	}
+	return 0;
+}